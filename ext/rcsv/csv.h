@@ -28,8 +28,18 @@ extern "C" {
 #define CSV_APPEND_NULL 8 /* Ensure that all fields are null-terminated */
 #define CSV_EMPTY_IS_NULL 16 /* Pass null pointer to cb1 function when
                                 empty, unquoted fields are encountered */
+#define CSV_ZERO_COPY 32 /* Pass fields that need no unescaping to cb1 as
+                             pointers into the data given to csv_parse
+                             rather than copying them into the entry buffer.
+                             Such fields are not null-terminated even when
+                             CSV_APPEND_NULL is set */
 
 
+/* Entry buffer growth policies */
+#define CSV_GROW_LINEAR 0    /* grow by blk_size bytes at a time */
+#define CSV_GROW_GEOMETRIC 1 /* double the size, growing by at least blk_size
+                                and at most blk_max bytes at a time */
+
 /* Character values */
 #define CSV_TAB    0x09
 #define CSV_SPACE  0x20
@@ -38,6 +48,52 @@ extern "C" {
 #define CSV_COMMA  0x2c
 #define CSV_QUOTE  0x22
 
+/* Field flags of struct csv_batch */
+#define CSV_FIELD_QUOTED 1   /* The field was quoted */
+#define CSV_FIELD_NULL 2     /* Empty, unquoted field with CSV_EMPTY_IS_NULL set */
+#define CSV_FIELD_BUFFERED 4 /* The field is in buf of the batch rather than in the input */
+
+/* Row flags of struct csv_batch */
+#define CSV_ROW_REJECTED 1   /* The row was rejected by the filter, its fields in the batch are dropped */
+
+/* A batch receives the fields and rows found by csv_parse_batch. Fields are
+   described by their offset in the input passed to csv_parse_batch, unless
+   they had to be unescaped or started in a previous call, in which case they
+   are copied into buf. Fields following the end of the last row belong to a
+   row that is continued by the next call. */
+struct csv_batch {
+  size_t *offsets;        /* Offset of every field in the input, or in buf with CSV_FIELD_BUFFERED */
+  size_t *lengths;        /* Length of every field */
+  unsigned char *flags;   /* CSV_FIELD_* flags of every field */
+  size_t fields;          /* Number of fields in the batch */
+  size_t fields_size;     /* Capacity of offsets, lengths and flags */
+  size_t *row_ends;       /* Number of fields in the batch up to the end of every row */
+  int *row_terms;         /* Character ending every row, as passed to cb2 by csv_parse */
+  unsigned char *row_flags; /* CSV_ROW_* flags of every row */
+  size_t rows;            /* Number of rows in the batch */
+  size_t max_rows;        /* Capacity of row_ends and row_terms */
+  unsigned char *buf;     /* Copied fields, null-terminated with CSV_APPEND_NULL */
+  size_t buf_len;
+  size_t buf_size;
+  void *(*realloc_func)(void *, size_t);
+  void (*free_func)(void *);
+};
+
+/* A pool keeps the entry buffer of a freed parser around so that parsers
+   that are set up with it later reuse that buffer instead of allocating a
+   new one, and keeps track of allocation statistics of these parsers */
+struct csv_pool {
+  unsigned char * buf;  /* Cached entry buffer */
+  size_t size;          /* Size of the cached entry buffer */
+  size_t allocations;   /* Number of allocations made by parsers using the pool */
+  size_t reuses;        /* Number of times the cached buffer was handed over */
+  size_t releases;      /* Number of parsers freed into the pool */
+  size_t peak_size;     /* Largest entry buffer used by parsers using the pool */
+  void *(*malloc_func)(size_t);
+  void *(*realloc_func)(void *, size_t);
+  void (*free_func)(void *);
+};
+
 struct csv_parser {
   int pstate;         /* Parser state */
   int quoted;         /* Is the current field a quoted field? */
@@ -55,6 +111,19 @@ struct csv_parser {
   void *(*malloc_func)(size_t);
   void *(*realloc_func)(void *, size_t);
   void (*free_func)(void *);
+  int growth;         /* Entry buffer growth policy */
+  size_t blk_max;     /* Largest increment of the entry buffer size with CSV_GROW_GEOMETRIC */
+  size_t allocations; /* Number of entry buffer allocations made */
+  struct csv_pool *pool; /* Pool the entry buffer is taken from and returned to */
+  void *parallel;     /* Scratch space of csv_parse_parallel, released by csv_free */
+  void *(*blocking_func)(void *(*)(void *), void *); /* Runs the waiting part of csv_parse_parallel */
+  const unsigned char *column_mask; /* Columns whose fields are passed on, see csv_set_columns */
+  size_t column_mask_len;
+  size_t column;      /* Column of the current field */
+  int (*filter)(const void *, size_t, size_t, void *); /* Rejects rows while parsing into batches, see csv_set_filter */
+  void *filter_data;
+  int rejected;       /* Has the current row been rejected by filter? */
+  unsigned char char_class[256]; /* Character classes derived from delim_char and quote_char */
 };
 
 /* Function Prototypes */
@@ -64,6 +133,10 @@ void csv_free(struct csv_parser *p);
 int csv_error(struct csv_parser *p);
 const char * csv_strerror(int error);
 size_t csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, size_t, void *), void (*cb2)(int, void *), void *data);
+size_t csv_parse_batch(struct csv_parser *p, const void *s, size_t len, struct csv_batch *b);
+int csv_batch_init(struct csv_batch *b, size_t max_rows);
+void csv_batch_free(struct csv_batch *b);
+size_t csv_parse_parallel(struct csv_parser *p, const void *s, size_t len, int threads, size_t chunk_size, void (*cb1)(void *, size_t, void *), void (*cb2)(int, void *), void *data);
 size_t csv_write(void *dest, size_t dest_size, const void *src, size_t src_size);
 int csv_fwrite(FILE *fp, const void *src, size_t src_size);
 size_t csv_write2(void *dest, size_t dest_size, const void *src, size_t src_size, unsigned char quote);
@@ -76,10 +149,20 @@ unsigned char csv_get_delim(struct csv_parser *p);
 unsigned char csv_get_quote(struct csv_parser *p);
 void csv_set_space_func(struct csv_parser *p, int (*f)(unsigned char));
 void csv_set_term_func(struct csv_parser *p, int (*f)(unsigned char));
+void csv_set_malloc_func(struct csv_parser *p, void *(*)(size_t));
 void csv_set_realloc_func(struct csv_parser *p, void *(*)(void *, size_t));
 void csv_set_free_func(struct csv_parser *p, void (*)(void *));
 void csv_set_blk_size(struct csv_parser *p, size_t);
 size_t csv_get_buffer_size(struct csv_parser *p);
+void csv_set_growth(struct csv_parser *p, int growth, size_t blk_max);
+size_t csv_get_allocations(struct csv_parser *p);
+void csv_set_pool(struct csv_parser *p, struct csv_pool *pool);
+void csv_set_blocking_func(struct csv_parser *p, void *(*f)(void *(*)(void *), void *));
+void csv_set_columns(struct csv_parser *p, const unsigned char *mask, size_t len);
+void csv_set_filter(struct csv_parser *p, int (*f)(const void *, size_t, size_t, void *), void *data);
+int csv_row_rejected(struct csv_parser *p);
+void csv_pool_init(struct csv_pool *pool);
+void csv_pool_destroy(struct csv_pool *pool);
 
 #ifdef __cplusplus
 }
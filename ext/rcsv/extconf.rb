@@ -1,3 +1,31 @@
 require 'mkmf'
 
+# csv_parse_parallel() falls back to serial parsing when POSIX threads are unavailable
+if have_header('pthread.h')
+  have_library('pthread', 'pthread_create')
+end
+
+# Parsing with :release_gvl needs rb_thread_call_without_gvl()
+have_header('ruby/thread.h')
+
+# IO::Buffer input is parsed in place on Ruby 3.1+
+if have_header('ruby/io/buffer.h')
+  have_func('rb_io_buffer_get_bytes_for_reading', 'ruby/io/buffer.h')
+end
+
+# Hash rows are pre-sized and filled in one go where the C API allows it
+have_func('rb_hash_new_capa', 'ruby.h')
+have_func('rb_hash_bulk_insert', 'ruby.h')
+
+# Regular files are memory-mapped instead of being read through IO#read where mmap() is available
+have_header('sys/mman.h')
+
+# gzip input is decompressed with zlib, zstd input with libzstd if it is installed
+if have_library('z', 'inflate', 'zlib.h')
+  have_header('zlib.h')
+end
+if have_library('zstd', 'ZSTD_decompressStream', 'zstd.h')
+  have_header('zstd.h')
+end
+
 create_makefile('rcsv/rcsv')
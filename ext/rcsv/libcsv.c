@@ -23,10 +23,26 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #  define SIZE_MAX ((size_t)-1) /* C89 doesn't have stdint.h or SIZE_MAX */
 #endif
 
+#include <string.h>
+
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
 #include "csv.h"
 
 #define VERSION "3.0.3"
 
+/* SIMD structural character scanning is available on x86 with GCC or Clang.
+   SSE2 is the baseline, AVX2 is picked at runtime when the CPU supports it. */
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#  include <immintrin.h>
+#  define CSV_SCAN_SSE2 1
+#  if defined(__clang__) || __GNUC__ >= 5
+#    define CSV_SCAN_AVX2 1
+#  endif
+#endif
+
 #define ROW_NOT_BEGUN           0
 #define FIELD_NOT_BEGUN         1
 #define FIELD_BEGUN             2
@@ -43,30 +59,220 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
 #define MEM_BLK_SIZE 128
+#define MEM_BLK_MAX (16 * 1024 * 1024)
+
+/* Fields of columns that are masked out by csv_set_columns are only scanned for their end,
+   as well as the rest of a row that has been rejected by the filter */
+#define COLUMN_SKIPPED(p, col) ((col) < (p)->column_mask_len && !(p)->column_mask[col])
+#define FIELD_SKIPPED(p, col) ((p)->rejected || COLUMN_SKIPPED(p, col))
+
+/* The field passed to cb1 or to the filter, which isn't null-terminated */
+#define FIELD_DATA(p) \
+  ((!quoted && !entry_pos && ((p)->options & CSV_EMPTY_IS_NULL)) ? NULL : field_start ? (void *)field_start : (void *)(p)->entry_buf)
 
 #define SUBMIT_FIELD(p) \
   do { \
    if (!quoted) \
      entry_pos -= spaces; \
-   if (p->options & CSV_APPEND_NULL) \
-     ((p)->entry_buf[entry_pos]) = '\0'; \
-   if (cb1 && (p->options & CSV_EMPTY_IS_NULL) && !quoted && entry_pos == 0) \
-     cb1(NULL, entry_pos, data); \
-   else if (cb1) \
-     cb1(p->entry_buf, entry_pos, data); \
+   if (skip) { \
+     ; \
+   } else if (batch) { \
+     if ((p)->filter && (p)->filter(FIELD_DATA(p), entry_pos, column, (p)->filter_data)) { \
+       batch->fields = batch->rows ? batch->row_ends[batch->rows - 1] : 0; \
+       (p)->rejected = 1; \
+     } else if (csv_batch_field(p, batch, us, field_start, entry_pos, quoted, append_null) != 0) \
+       batch_full = 1; \
+   } else if (field_start && entry_pos) { \
+     if (cb1) \
+       cb1((void *)field_start, entry_pos, data); \
+   } else { \
+     if (append_null) \
+       ((p)->entry_buf[entry_pos]) = '\0'; \
+     if (cb1 && (p->options & CSV_EMPTY_IS_NULL) && !quoted && entry_pos == 0) \
+       cb1(NULL, entry_pos, data); \
+     else if (cb1) \
+       cb1(p->entry_buf, entry_pos, data); \
+   } \
+   field_start = NULL; \
    pstate = FIELD_NOT_BEGUN; \
    entry_pos = quoted = spaces = 0; \
+   column++; \
+   skip = FIELD_SKIPPED(p, column); \
  } while (0)
 
+/* Character classification within csv_parse_loop(), see csv_update_classes() */
+#define CSV_CLASS_SPACE 1
+#define CSV_CLASS_TERM  2
+#define CSV_CLASS_DELIM 4
+#define CSV_CLASS_QUOTE 8
+
+#define IS_SPACE(c) (table ? (char_class[c] & CSV_CLASS_SPACE) : (is_space ? is_space(c) : (c) == CSV_SPACE || (c) == CSV_TAB))
+#define IS_TERM(c)  (table ? (char_class[c] & CSV_CLASS_TERM) : (is_term ? is_term(c) : (c) == CSV_CR || (c) == CSV_LF))
+#define IS_DELIM(c) (table ? (char_class[c] & CSV_CLASS_DELIM) : (c) == delim)
+#define IS_QUOTE(c) (table ? (char_class[c] & CSV_CLASS_QUOTE) : (c) == quote)
+
+/* Number of bytes classified one by one before handing the rest of a field over to csv_scan */
+#define CSV_SHORT_RUN 2
+
+#if defined(__GNUC__) || defined(__clang__)
+#  define CSV_INLINE static __inline__ __attribute__((always_inline))
+#else
+#  define CSV_INLINE static
+#endif
+
 #define SUBMIT_ROW(p, c) \
   do { \
-    if (cb2) \
+    if (batch) { \
+      batch->row_ends[batch->rows] = batch->fields; \
+      batch->row_flags[batch->rows] = (p)->rejected ? CSV_ROW_REJECTED : 0; \
+      batch->row_terms[batch->rows++] = (c); \
+      if (batch->rows == batch->max_rows) \
+        batch_full = 1; \
+    } else if (cb2) \
       cb2(c, data); \
     pstate = ROW_NOT_BEGUN; \
     entry_pos = quoted = spaces = 0; \
+    column = 0; \
+    (p)->rejected = 0; \
+    skip = COLUMN_SKIPPED(p, 0); \
+  } while (0)
+
+/* With CSV_ZERO_COPY, field_start points to the beginning of the current field in the input
+   for as long as the field is a contiguous, unmodified part of it. Characters are only copied
+   into the entry buffer once that no longer holds. Characters of skipped fields are only counted. */
+#define SUBMIT_CHAR(p, c) \
+  do { \
+    if (skip) { \
+      entry_pos++; \
+      break; \
+    } \
+    if (field_start) { \
+      if (field_start + entry_pos == us + pos - 1) { \
+        entry_pos++; \
+        break; \
+      } \
+      if (csv_materialize(p, &field_start, entry_pos) != 0) { \
+        STORE_STATE(p); \
+        return pos - 1; \
+      } \
+    } else if (zero_copy && !entry_pos) { \
+      field_start = us + pos - 1; \
+      entry_pos++; \
+      break; \
+    } \
+    (p)->entry_buf[entry_pos++] = (c); \
+  } while (0)
+
+/* Submits n bytes starting at s at once. Unless the field is kept in the input,
+   the caller makes sure that there is enough room for them in the entry buffer. */
+#define SUBMIT_RUN(p, s, n) \
+  do { \
+    if (field_start || skip) { \
+      entry_pos += (n); \
+    } else if (zero_copy && !entry_pos) { \
+      field_start = (s); \
+      entry_pos = (n); \
+    } else { \
+      memcpy((p)->entry_buf + entry_pos, (s), (n)); \
+      entry_pos += (n); \
+    } \
+  } while (0)
+
+/* Saves the parser state kept in local variables, copying a zero-copy field into the entry buffer
+   since the input it points to is not going to be available on the next call */
+#define STORE_STATE(p) \
+  do { \
+    if (field_start && csv_materialize(p, &field_start, entry_pos) != 0) \
+      entry_pos = 0; \
+    p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos, p->column = column; \
   } while (0)
 
-#define SUBMIT_CHAR(p, c) ((p)->entry_buf[entry_pos++] = (c))
+/* Returns the offset of the first byte of s that is equal to one of a, b, c or d, or len if there is none */
+typedef size_t (*csv_scan_func)(const unsigned char *s, size_t len, unsigned char a, unsigned char b, unsigned char c, unsigned char d);
+
+static size_t
+csv_scan_scalar(const unsigned char *s, size_t len, unsigned char a, unsigned char b, unsigned char c, unsigned char d)
+{
+  size_t i;
+  unsigned char x;
+
+  for (i = 0; i < len; i++) {
+    x = s[i];
+    if (x == a || x == b || x == c || x == d)
+      break;
+  }
+  return i;
+}
+
+#ifdef CSV_SCAN_SSE2
+static size_t
+csv_scan_sse2(const unsigned char *s, size_t len, unsigned char a, unsigned char b, unsigned char c, unsigned char d)
+{
+  const __m128i va = _mm_set1_epi8((char)a);
+  const __m128i vb = _mm_set1_epi8((char)b);
+  const __m128i vc = _mm_set1_epi8((char)c);
+  const __m128i vd = _mm_set1_epi8((char)d);
+  __m128i v, m;
+  int mask;
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    v = _mm_loadu_si128((const __m128i *)(s + i));
+    m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+                     _mm_or_si128(_mm_cmpeq_epi8(v, vc), _mm_cmpeq_epi8(v, vd)));
+    mask = _mm_movemask_epi8(m);
+    if (mask)
+      return i + __builtin_ctz((unsigned int)mask);
+  }
+  return i + csv_scan_scalar(s + i, len - i, a, b, c, d);
+}
+#endif
+
+#ifdef CSV_SCAN_AVX2
+__attribute__((target("avx2"))) static size_t
+csv_scan_avx2(const unsigned char *s, size_t len, unsigned char a, unsigned char b, unsigned char c, unsigned char d)
+{
+  const __m256i va = _mm256_set1_epi8((char)a);
+  const __m256i vb = _mm256_set1_epi8((char)b);
+  const __m256i vc = _mm256_set1_epi8((char)c);
+  const __m256i vd = _mm256_set1_epi8((char)d);
+  __m256i v, m;
+  unsigned int mask;
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    v = _mm256_loadu_si256((const __m256i *)(s + i));
+    m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)),
+                        _mm256_or_si256(_mm256_cmpeq_epi8(v, vc), _mm256_cmpeq_epi8(v, vd)));
+    mask = (unsigned int)_mm256_movemask_epi8(m);
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+  return i + csv_scan_sse2(s + i, len - i, a, b, c, d);
+}
+#endif
+
+static csv_scan_func csv_scan = NULL;
+
+static csv_scan_func
+csv_scan_select(void)
+{
+  /* Pick the widest scanner supported by the running CPU */
+#ifdef CSV_SCAN_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return csv_scan_avx2;
+#endif
+#ifdef CSV_SCAN_SSE2
+  return csv_scan_sse2;
+#else
+  return csv_scan_scalar;
+#endif
+}
+
+static void csv_parallel_release(struct csv_parser *p);
+static int csv_batch_field(struct csv_parser *p, struct csv_batch *b, const unsigned char *us, const unsigned char *field_start,
+                           size_t len, int quoted, int append_null);
 
 static const char *csv_errors[] = {"success",
                                    "error parsing data while strict checking enabled",
@@ -112,6 +318,19 @@ csv_set_opts(struct csv_parser *p, unsigned char options)
   return 0;
 }
 
+static void
+csv_update_classes(struct csv_parser *p)
+{
+  /* Rebuild the character class table after the delimiter or quote character have been changed */
+  memset(p->char_class, 0, sizeof(p->char_class));
+  p->char_class[CSV_SPACE] |= CSV_CLASS_SPACE;
+  p->char_class[CSV_TAB] |= CSV_CLASS_SPACE;
+  p->char_class[CSV_CR] |= CSV_CLASS_TERM;
+  p->char_class[CSV_LF] |= CSV_CLASS_TERM;
+  p->char_class[p->delim_char] |= CSV_CLASS_DELIM;
+  p->char_class[p->quote_char] |= CSV_CLASS_QUOTE;
+}
+
 int
 csv_init(struct csv_parser *p, unsigned char options)
 {
@@ -135,6 +354,22 @@ csv_init(struct csv_parser *p, unsigned char options)
   p->malloc_func = NULL;
   p->realloc_func = realloc;
   p->free_func = free;
+  p->growth = CSV_GROW_GEOMETRIC;
+  p->blk_max = MEM_BLK_MAX;
+  p->allocations = 0;
+  p->pool = NULL;
+  p->parallel = NULL;
+  p->blocking_func = NULL;
+  p->column_mask = NULL;
+  p->column_mask_len = 0;
+  p->column = 0;
+  p->filter = NULL;
+  p->filter_data = NULL;
+  p->rejected = 0;
+  csv_update_classes(p);
+
+  if (!csv_scan)
+    csv_scan = csv_scan_select();
 
   return 0;
 }
@@ -142,15 +377,37 @@ csv_init(struct csv_parser *p, unsigned char options)
 void
 csv_free(struct csv_parser *p)
 {
-  /* Free the entry_buffer of csv_parser object */
+  /* Free the entry_buffer of csv_parser object, or give it back to the pool */
+  struct csv_pool *pool;
+
   if (p == NULL)
     return;
 
+  csv_parallel_release(p);
+
+  pool = p->pool;
+  if (pool) {
+    pool->allocations += p->allocations;
+    pool->releases++;
+    if (p->entry_size > pool->peak_size)
+      pool->peak_size = p->entry_size;
+
+    /* Keep the larger one of the cached and the released buffers */
+    if (p->entry_buf && p->entry_size > pool->size) {
+      if (pool->buf)
+        pool->free_func(pool->buf);
+      pool->buf = p->entry_buf;
+      pool->size = p->entry_size;
+      p->entry_buf = NULL;
+    }
+  }
+
   if (p->entry_buf)
     p->free_func(p->entry_buf);
 
   p->entry_buf = NULL;
   p->entry_size = 0;
+  p->allocations = 0;
 
   return;
 }
@@ -163,10 +420,20 @@ csv_fini(struct csv_parser *p, void (*cb1)(void *, size_t, void *), void (*cb2)(
   int pstate = p->pstate;
   size_t spaces = p->spaces;
   size_t entry_pos = p->entry_pos;
+  int append_null = p->options & CSV_APPEND_NULL;
+  const unsigned char *field_start = NULL;
+  const unsigned char *us = NULL;
+  struct csv_batch *batch = NULL;  /* SUBMIT_FIELD and SUBMIT_ROW always call back from here */
+  int batch_full = 0;
+  size_t column;
+  int skip;
 
   if (p == NULL)
     return -1;
 
+  column = p->column;
+  skip = FIELD_SKIPPED(p, column);
+
 
   if (p->pstate == FIELD_BEGUN && p->quoted && p->options & CSV_STRICT && p->options & CSV_STRICT_FINI) {
     /* Current field is quoted, no end-quote was seen, and CSV_STRICT_FINI is set */
@@ -187,9 +454,12 @@ csv_fini(struct csv_parser *p, void (*cb1)(void *, size_t, void *), void (*cb2)(
     case ROW_NOT_BEGUN: /* Already ended properly */
       ;
   }
+  (void)batch_full;
 
   /* Reset parser */
   p->spaces = p->quoted = p->entry_pos = p->status = 0;
+  p->column = 0;
+  p->rejected = 0;
   p->pstate = ROW_NOT_BEGUN;
 
   return 0;
@@ -199,14 +469,20 @@ void
 csv_set_delim(struct csv_parser *p, unsigned char c)
 {
   /* Set the delimiter */
-  if (p) p->delim_char = c;
+  if (p) {
+    p->delim_char = c;
+    csv_update_classes(p);
+  }
 }
 
 void
 csv_set_quote(struct csv_parser *p, unsigned char c)
 {
   /* Set the quote character */
-  if (p) p->quote_char = c;
+  if (p) {
+    p->quote_char = c;
+    csv_update_classes(p);
+  }
 }
 
 unsigned char
@@ -237,6 +513,13 @@ csv_set_term_func(struct csv_parser *p, int (*f)(unsigned char))
   if (p) p->is_term = f;
 }
 
+void
+csv_set_malloc_func(struct csv_parser *p, void *(*f)(size_t))
+{
+  /* Set the malloc function used to allocate the buffer */
+  if (p) p->malloc_func = f;
+}
+
 void
 csv_set_realloc_func(struct csv_parser *p, void *(*f)(void *, size_t))
 {
@@ -267,11 +550,131 @@ csv_get_buffer_size(struct csv_parser *p)
   return 0;
 }
 
+void
+csv_set_growth(struct csv_parser *p, int growth, size_t blk_max)
+{
+  /* Set the entry buffer growth policy, blk_max of 0 means no limit */
+  if (p) {
+    p->growth = growth;
+    p->blk_max = blk_max;
+  }
+}
+
+size_t
+csv_get_allocations(struct csv_parser *p)
+{
+  /* Get the number of entry buffer allocations made since the parser was initialized or freed */
+  if (p)
+    return p->allocations;
+  return 0;
+}
+
+void
+csv_set_pool(struct csv_parser *p, struct csv_pool *pool)
+{
+  /* Use the memory functions of the pool and take its cached buffer over.
+   * Must be called before anything is parsed.
+   */
+  if (p == NULL || pool == NULL)
+    return;
+
+  p->pool = pool;
+  p->malloc_func = pool->malloc_func;
+  p->realloc_func = pool->realloc_func;
+  p->free_func = pool->free_func;
+
+  if (!p->entry_buf && pool->buf) {
+    p->entry_buf = pool->buf;
+    p->entry_size = pool->size;
+    pool->buf = NULL;
+    pool->size = 0;
+    pool->reuses++;
+  }
+}
+
+void
+csv_set_blocking_func(struct csv_parser *p, void *(*f)(void *(*)(void *), void *))
+{
+  /* csv_parse_parallel passes f the function that starts worker threads and waits for them, so that
+   * the caller can release locks, e.g. the GVL of an interpreter, while its thread is blocked.
+   * f must call the function with the argument it's given and return its result.
+   */
+  if (p)
+    p->blocking_func = f;
+}
+
+void
+csv_set_columns(struct csv_parser *p, const unsigned char *mask, size_t len)
+{
+  /* Only pass on fields of columns i with mask[i] set, and of all the columns from len on.
+   * Other fields are scanned for their end, but are neither copied nor passed to cb1 or batches.
+   * The mask is not copied and must be set between rows, NULL passes every field on.
+   */
+  if (p) {
+    p->column_mask = mask;
+    p->column_mask_len = mask ? len : 0;
+  }
+}
+
+void
+csv_set_filter(struct csv_parser *p, int (*f)(const void *, size_t, size_t, void *), void *data)
+{
+  /* While parsing into batches, f is passed every field that would be recorded along with its length,
+   * its column and data. If it returns nonzero, the fields of the row recorded by the current call are
+   * dropped, the rest of the row is only scanned for its end, and the row is flagged with CSV_ROW_REJECTED.
+   * f must not call back into the parser. csv_parse and csv_fini don't use the filter.
+   */
+  if (p) {
+    p->filter = f;
+    p->filter_data = data;
+  }
+}
+
+int
+csv_row_rejected(struct csv_parser *p)
+{
+  /* Has the row that continues past the data parsed so far been rejected by the filter? */
+  return p ? p->rejected : 0;
+}
+
+void
+csv_pool_init(struct csv_pool *pool)
+{
+  /* Initialize an empty pool using the standard memory functions */
+  if (pool == NULL)
+    return;
+
+  pool->buf = NULL;
+  pool->size = 0;
+  pool->allocations = 0;
+  pool->reuses = 0;
+  pool->releases = 0;
+  pool->peak_size = 0;
+  pool->malloc_func = malloc;
+  pool->realloc_func = realloc;
+  pool->free_func = free;
+}
+
+void
+csv_pool_destroy(struct csv_pool *pool)
+{
+  /* Free the cached buffer of the pool */
+  if (pool == NULL)
+    return;
+
+  if (pool->buf)
+    pool->free_func(pool->buf);
+
+  pool->buf = NULL;
+  pool->size = 0;
+}
+
 static int
 csv_increase_buffer(struct csv_parser *p)
 {
   /* Increase the size of the entry buffer.  Attempt to increase size by
-   * p->blk_size, if this is larger than SIZE_MAX try to increase current
+   * p->blk_size, or by the current buffer size limited by p->blk_max with
+   * CSV_GROW_GEOMETRIC, if this is larger than SIZE_MAX try to increase current
    * buffer size to SIZE_MAX.  If allocation fails, try to allocate halve
    * the size and try again until successful or increment size is zero.
    */
@@ -279,6 +682,12 @@ csv_increase_buffer(struct csv_parser *p)
   size_t to_add = p->blk_size;
   void *vp;
 
+  if (p->growth == CSV_GROW_GEOMETRIC && p->entry_size > to_add) {
+    to_add = p->entry_size;
+    if (p->blk_max && to_add > p->blk_max)
+      to_add = p->blk_max > p->blk_size ? p->blk_max : p->blk_size;
+  }
+
   if ( p->entry_size >= SIZE_MAX - to_add )
     to_add = SIZE_MAX - p->entry_size;
 
@@ -287,7 +696,8 @@ csv_increase_buffer(struct csv_parser *p)
     return -1;
   }
 
-  while ((vp = p->realloc_func(p->entry_buf, p->entry_size + to_add)) == NULL) {
+  while ((vp = (!p->entry_buf && p->malloc_func) ? p->malloc_func(p->entry_size + to_add)
+                                                  : p->realloc_func(p->entry_buf, p->entry_size + to_add)) == NULL) {
     to_add /= 2;
     if (!to_add) {
       p->status = CSV_ENOMEM;
@@ -298,11 +708,90 @@ csv_increase_buffer(struct csv_parser *p)
   /* Update entry buffer pointer and entry_size if successful */
   p->entry_buf = vp;
   p->entry_size += to_add;
+  p->allocations++;
   return 0;
 }
 
-size_t
-csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data)
+static int
+csv_materialize(struct csv_parser *p, const unsigned char **field_start, size_t entry_pos)
+{
+  /* Copy a field that has been kept in the input into the entry buffer, leaving room for at least
+   * one more character and the terminating null.
+   */
+  while (p->entry_size < entry_pos + 2) {
+    if (csv_increase_buffer(p) != 0)
+      return -1;
+  }
+
+  memcpy(p->entry_buf, *field_start, entry_pos);
+  *field_start = NULL;
+  return 0;
+}
+
+static int
+csv_batch_field(struct csv_parser *p, struct csv_batch *b, const unsigned char *us, const unsigned char *field_start,
+                size_t len, int quoted, int append_null)
+{
+  /* Append a field to the batch, copying it unless it is still in the input */
+  size_t size, need, i = b->fields;
+  void *vp;
+
+  if (i == b->fields_size) {
+    size = b->fields_size ? b->fields_size * 2 : 1024;
+    if ((vp = b->realloc_func(b->offsets, size * sizeof(size_t))) == NULL)
+      goto nomem;
+    b->offsets = vp;
+    if ((vp = b->realloc_func(b->lengths, size * sizeof(size_t))) == NULL)
+      goto nomem;
+    b->lengths = vp;
+    if ((vp = b->realloc_func(b->flags, size)) == NULL)
+      goto nomem;
+    b->flags = vp;
+    b->fields_size = size;
+  }
+
+  b->lengths[i] = len;
+  b->flags[i] = quoted ? CSV_FIELD_QUOTED : 0;
+
+  if (field_start && len) {
+    b->offsets[i] = field_start - us;
+  } else if ((p->options & CSV_EMPTY_IS_NULL) && !quoted && len == 0) {
+    b->offsets[i] = 0;
+    b->flags[i] |= CSV_FIELD_NULL;
+  } else {
+    need = b->buf_len + len + 1;
+    if (need > b->buf_size) {
+      size = b->buf_size ? b->buf_size : 4096;
+      while (size < need)
+        size *= 2;
+      if ((vp = b->realloc_func(b->buf, size)) == NULL)
+        goto nomem;
+      b->buf = vp;
+      b->buf_size = size;
+    }
+    memcpy(b->buf + b->buf_len, p->entry_buf, len);
+    if (append_null)
+      b->buf[b->buf_len + len] = '\0';
+    b->offsets[i] = b->buf_len;
+    b->flags[i] |= CSV_FIELD_BUFFERED;
+    b->buf_len += len + 1;
+  }
+
+  b->fields++;
+  return 0;
+
+nomem:
+  p->status = CSV_ENOMEM;
+  return -1;
+}
+
+/* The parsing loop is specialized by the compiler for every combination of constant table, strict and
+ * append_null arguments it is inlined with, so that the per-byte option checks disappear. With table set,
+ * characters are classified by p->char_class, otherwise p->is_space and p->is_term are honored.
+ */
+CSV_INLINE size_t
+csv_parse_loop(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data,
+               struct csv_batch *batch, const int table, const int strict, const int append_null)
 {
   unsigned const char *us = s;  /* Access input data as array of unsigned char */
   unsigned char c;              /* The character we are currently processing */
@@ -313,25 +802,123 @@ csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, s
   unsigned char quote = p->quote_char;
   int (*is_space)(unsigned char) = p->is_space;
   int (*is_term)(unsigned char) = p->is_term;
+  const unsigned char *char_class = p->char_class;
   int quoted = p->quoted;
   int pstate = p->pstate;
   size_t spaces = p->spaces;
   size_t entry_pos = p->entry_pos;
+  int zero_copy = batch ? 1 : p->options & CSV_ZERO_COPY; /* Batches always refer to the input */
+  const unsigned char *field_start = NULL; /* Start of the current field in s, see SUBMIT_CHAR */
+  int batch_full = 0;           /* Set once the batch has no room for another row */
+  size_t column = p->column;
+  int skip = FIELD_SKIPPED(p, column); /* Is the current field skipped? */
+  size_t run, avail, trailing;
+  unsigned char stop;
 
 
   if (!p->entry_buf && pos < len) {
     /* Buffer hasn't been allocated yet and len > 0 */
     if (csv_increase_buffer(p) != 0) {
-      p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+      p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos, p->column = column;
       return pos;
     }
   }
 
-  while (pos < len) {
+  while (pos < len && !batch_full) {
+    /* Fields of skipped columns are stepped over without the state machine, along with the skipped fields
+       that follow them. Anything but field contents, escaped quotes and delimiters is left to the state machine. */
+    if (table && skip && pstate == FIELD_BEGUN) {
+      spaces = 0;
+      while (pos < len) {
+        if (quoted) {
+          pos += csv_scan(us + pos, len - pos, quote, quote, quote, quote);
+          if (pos + 1 >= len)
+            break;
+          if (us[pos + 1] == quote) { /* Two quotes in a row */
+            pos += 2;
+            continue;
+          }
+          if ((char_class[us[pos + 1]] & ~CSV_CLASS_SPACE) != CSV_CLASS_DELIM)
+            break;
+          pos++;
+        } else {
+          pos += csv_scan(us + pos, len - pos, delim, quote, CSV_CR, CSV_LF);
+          if (pos == len || (char_class[us[pos]] & ~CSV_CLASS_SPACE) != CSV_CLASS_DELIM)
+            break;
+        }
+
+        /* The field ends here, same as SUBMIT_FIELD */
+        pos++;
+        pstate = FIELD_NOT_BEGUN;
+        entry_pos = quoted = 0;
+        column++;
+        skip = FIELD_SKIPPED(p, column);
+        if (!skip || pos == len)
+          break;
+
+        /* Start the next field right away unless it begins with a space, a delimiter or a line end */
+        if (char_class[us[pos]] == CSV_CLASS_QUOTE) {
+          quoted = 1;
+          pos++;
+        } else if (char_class[us[pos]]) {
+          break;
+        }
+        pstate = FIELD_BEGUN;
+      }
+      if (pos == len)
+        break;
+    }
+
+    /* Fast path: copy everything up to the next structural character at once.
+       Custom space and term functions are not vectorizable, so they always take the slow path. */
+    if (table && pstate == FIELD_BEGUN) {
+      /* Short fields are common, so the first few bytes are classified without the vector scanner */
+      stop = quoted ? CSV_CLASS_QUOTE : CSV_CLASS_DELIM | CSV_CLASS_QUOTE | CSV_CLASS_TERM;
+      for (run = 0; run < CSV_SHORT_RUN && pos + run < len && !(char_class[us[pos + run]] & stop); run++)
+        ;
+      if (run == CSV_SHORT_RUN) {
+        if (quoted)
+          run += csv_scan(us + pos + run, len - pos - run, quote, quote, quote, quote);
+        else
+          run += csv_scan(us + pos + run, len - pos - run, delim, quote, CSV_CR, CSV_LF);
+      }
+
+      if (field_start && field_start + entry_pos != us + pos) {
+        /* Some characters of the field were dropped, it can't be passed from the input anymore */
+        if (csv_materialize(p, &field_start, entry_pos) != 0) {
+          STORE_STATE(p);
+          return pos;
+        }
+      }
+
+      if (!field_start && !skip && !(zero_copy && !entry_pos)) {
+        /* Never outgrow the buffer here, the slow path below takes care of that */
+        avail = p->entry_size - entry_pos - (append_null ? 1 : 0);
+        if (run > avail)
+          run = avail;
+      }
+
+      if (run) {
+        if (!quoted) {
+          /* Keep track of trailing spaces exactly as the slow path does */
+          for (trailing = 0; trailing < run; trailing++) {
+            c = us[pos + run - 1 - trailing];
+            if (c != CSV_SPACE && c != CSV_TAB)
+              break;
+          }
+          spaces = (trailing == run) ? spaces + run : trailing;
+        }
+        SUBMIT_RUN(p, us + pos, run);
+        pos += run;
+        if (pos == len)
+          break;
+      }
+    }
+
     /* Check memory usage, increase buffer if neccessary */
-    if (entry_pos == ((p->options & CSV_APPEND_NULL) ? p->entry_size - 1 : p->entry_size) ) {
+    if (!field_start && !skip && entry_pos == (append_null ? p->entry_size - 1 : p->entry_size) ) {
       if (csv_increase_buffer(p) != 0) {
-        p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+        p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos, p->column = column;
         return pos;
       }
     }
@@ -341,9 +928,9 @@ csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, s
     switch (pstate) {
       case ROW_NOT_BEGUN:
       case FIELD_NOT_BEGUN:
-        if ((is_space ? is_space(c) : c == CSV_SPACE || c == CSV_TAB) && c!=delim) { /* Space or Tab */
+        if (IS_SPACE(c) && !IS_DELIM(c)) { /* Space or Tab */
           continue;
-        } else if (is_term ? is_term(c) : c == CSV_CR || c == CSV_LF) { /* Carriage Return or Line Feed */
+        } else if (IS_TERM(c)) { /* Carriage Return or Line Feed */
           if (pstate == FIELD_NOT_BEGUN) {
             SUBMIT_FIELD(p);
             SUBMIT_ROW(p, (unsigned char)c);
@@ -354,10 +941,10 @@ csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, s
             }
           }
           continue;
-        } else if (c == delim) { /* Comma */
+        } else if (IS_DELIM(c)) { /* Comma */
           SUBMIT_FIELD(p);
           break;
-        } else if (c == quote) { /* Quote */
+        } else if (IS_QUOTE(c)) { /* Quote */
           pstate = FIELD_BEGUN;
           quoted = 1;
         } else {               /* Anything else */
@@ -367,34 +954,34 @@ csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, s
         }
         break;
       case FIELD_BEGUN:
-        if (c == quote) {         /* Quote */
+        if (IS_QUOTE(c)) {         /* Quote */
           if (quoted) {
             SUBMIT_CHAR(p, c);
             pstate = FIELD_MIGHT_HAVE_ENDED;
           } else {
             /* STRICT ERROR - double quote inside non-quoted field */
-            if (p->options & CSV_STRICT) {
+            if (strict) {
               p->status = CSV_EPARSE;
-              p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+              STORE_STATE(p);
               return pos-1;
             }
             SUBMIT_CHAR(p, c);
             spaces = 0;
           }
-        } else if (c == delim) {  /* Comma */
+        } else if (IS_DELIM(c)) {  /* Comma */
           if (quoted) {
             SUBMIT_CHAR(p, c);
           } else {
             SUBMIT_FIELD(p);
           }
-        } else if (is_term ? is_term(c) : c == CSV_CR || c == CSV_LF) {  /* Carriage Return or Line Feed */
+        } else if (IS_TERM(c)) {  /* Carriage Return or Line Feed */
           if (!quoted) {
             SUBMIT_FIELD(p);
             SUBMIT_ROW(p, (unsigned char)c);
           } else {
             SUBMIT_CHAR(p, c);
           }
-        } else if (!quoted && (is_space? is_space(c) : c == CSV_SPACE || c == CSV_TAB)) { /* Tab or space for non-quoted field */
+        } else if (!quoted && IS_SPACE(c)) { /* Tab or space for non-quoted field */
             SUBMIT_CHAR(p, c);
             spaces++;
         } else {  /* Anything else */
@@ -404,22 +991,22 @@ csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, s
         break;
       case FIELD_MIGHT_HAVE_ENDED:
         /* This only happens when a quote character is encountered in a quoted field */
-        if (c == delim) {  /* Comma */
+        if (IS_DELIM(c)) {  /* Comma */
           entry_pos -= spaces + 1;  /* get rid of spaces and original quote */
           SUBMIT_FIELD(p);
-        } else if (is_term ? is_term(c) : c == CSV_CR || c == CSV_LF) {  /* Carriage Return or Line Feed */
+        } else if (IS_TERM(c)) {  /* Carriage Return or Line Feed */
           entry_pos -= spaces + 1;  /* get rid of spaces and original quote */
           SUBMIT_FIELD(p);
           SUBMIT_ROW(p, (unsigned char)c);
-        } else if (is_space ? is_space(c) : c == CSV_SPACE || c == CSV_TAB) {  /* Space or Tab */
+        } else if (IS_SPACE(c)) {  /* Space or Tab */
           SUBMIT_CHAR(p, c);
           spaces++;
-        } else if (c == quote) {  /* Quote */
+        } else if (IS_QUOTE(c)) {  /* Quote */
           if (spaces) {
             /* STRICT ERROR - unescaped double quote */
-            if (p->options & CSV_STRICT) {
+            if (strict) {
               p->status = CSV_EPARSE;
-              p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+              STORE_STATE(p);
               return pos-1;
             }
             spaces = 0;
@@ -430,9 +1017,9 @@ csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, s
           }
         } else {  /* Anything else */
           /* STRICT ERROR - unescaped double quote */
-          if (p->options & CSV_STRICT) {
+          if (strict) {
             p->status = CSV_EPARSE;
-            p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+            STORE_STATE(p);
             return pos-1;
           }
           pstate = FIELD_BEGUN;
@@ -444,10 +1031,561 @@ csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, s
        break;
     }
   }
-  p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
+  STORE_STATE(p);
   return pos;
 }
 
+#define CSV_PARSE_VARIANT(name, table, strict, append_null) \
+  static size_t \
+  name(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data) \
+  { \
+    return csv_parse_loop(p, s, len, cb1, cb2, data, NULL, table, strict, append_null); \
+  }
+
+#define CSV_PARSE_BATCH_VARIANT(name, table, strict, append_null) \
+  static size_t \
+  name(struct csv_parser *p, const void *s, size_t len, struct csv_batch *b) \
+  { \
+    return csv_parse_loop(p, s, len, NULL, NULL, NULL, b, table, strict, append_null); \
+  }
+
+CSV_PARSE_VARIANT(csv_parse_table, 1, 0, 0)
+CSV_PARSE_VARIANT(csv_parse_table_strict, 1, 1, 0)
+CSV_PARSE_VARIANT(csv_parse_table_append_null, 1, 0, 1)
+CSV_PARSE_VARIANT(csv_parse_table_strict_append_null, 1, 1, 1)
+
+CSV_PARSE_BATCH_VARIANT(csv_parse_batch_table, 1, 0, 0)
+CSV_PARSE_BATCH_VARIANT(csv_parse_batch_table_strict, 1, 1, 0)
+CSV_PARSE_BATCH_VARIANT(csv_parse_batch_table_append_null, 1, 0, 1)
+CSV_PARSE_BATCH_VARIANT(csv_parse_batch_table_strict_append_null, 1, 1, 1)
+
+static size_t
+csv_parse_generic(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data)
+{
+  return csv_parse_loop(p, s, len, cb1, cb2, data, NULL, 0, p->options & CSV_STRICT, p->options & CSV_APPEND_NULL);
+}
+
+static size_t
+csv_parse_batch_generic(struct csv_parser *p, const void *s, size_t len, struct csv_batch *b)
+{
+  return csv_parse_loop(p, s, len, NULL, NULL, NULL, b, 0, p->options & CSV_STRICT, p->options & CSV_APPEND_NULL);
+}
+
+size_t
+csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data)
+{
+  /* Custom space and term functions can't be put into the character class table */
+  if (p->is_space || p->is_term)
+    return csv_parse_generic(p, s, len, cb1, cb2, data);
+
+  switch (p->options & (CSV_STRICT | CSV_APPEND_NULL)) {
+    case CSV_STRICT:
+      return csv_parse_table_strict(p, s, len, cb1, cb2, data);
+    case CSV_APPEND_NULL:
+      return csv_parse_table_append_null(p, s, len, cb1, cb2, data);
+    case CSV_STRICT | CSV_APPEND_NULL:
+      return csv_parse_table_strict_append_null(p, s, len, cb1, cb2, data);
+    default:
+      return csv_parse_table(p, s, len, cb1, cb2, data);
+  }
+}
+
+size_t
+csv_parse_batch(struct csv_parser *p, const void *s, size_t len, struct csv_batch *b)
+{
+  /* Parse s into the batch until it holds b->max_rows rows or s is exhausted, and return the number
+   * of bytes consumed. Previous contents of the batch are discarded. Like csv_parse, fewer bytes than
+   * len are consumed on errors, which are reported by csv_error.
+   */
+  b->fields = b->rows = b->buf_len = 0;
+
+  if (p->is_space || p->is_term)
+    return csv_parse_batch_generic(p, s, len, b);
+
+  switch (p->options & (CSV_STRICT | CSV_APPEND_NULL)) {
+    case CSV_STRICT:
+      return csv_parse_batch_table_strict(p, s, len, b);
+    case CSV_APPEND_NULL:
+      return csv_parse_batch_table_append_null(p, s, len, b);
+    case CSV_STRICT | CSV_APPEND_NULL:
+      return csv_parse_batch_table_strict_append_null(p, s, len, b);
+    default:
+      return csv_parse_batch_table(p, s, len, b);
+  }
+}
+
+int
+csv_batch_init(struct csv_batch *b, size_t max_rows)
+{
+  /* Initialize a batch holding up to max_rows rows, returns 0 on success, -1 on error */
+  if (b == NULL || max_rows == 0)
+    return -1;
+
+  memset(b, 0, sizeof(struct csv_batch));
+  b->realloc_func = realloc;
+  b->free_func = free;
+  b->max_rows = max_rows;
+  b->row_ends = malloc(max_rows * sizeof(size_t));
+  b->row_terms = malloc(max_rows * sizeof(int));
+  b->row_flags = malloc(max_rows);
+  if (b->row_ends == NULL || b->row_terms == NULL || b->row_flags == NULL) {
+    csv_batch_free(b);
+    return -1;
+  }
+  return 0;
+}
+
+void
+csv_batch_free(struct csv_batch *b)
+{
+  /* Free the arrays of a batch */
+  if (b == NULL)
+    return;
+
+  free(b->row_ends);
+  free(b->row_terms);
+  free(b->row_flags);
+  if (b->free_func) {
+    b->free_func(b->offsets);
+    b->free_func(b->lengths);
+    b->free_func(b->flags);
+    b->free_func(b->buf);
+  }
+  memset(b, 0, sizeof(struct csv_batch));
+}
+
+/*
+  Parallel parsing
+
+  csv_parse_parallel() cuts its input into chunks of about chunk_size bytes
+  and moves the start of every chunk forward to the next record boundary.
+  A line terminator ends a record when the number of quote characters in
+  front of it is even, which holds for any data that is valid in strict
+  mode. The chunks are parsed by worker threads in waves of up to `threads`
+  chunks at a time. Workers record the fields and rows they find, and the
+  recorded callbacks are replayed on the calling thread in input order once
+  the wave is over, so callbacks are never called concurrently and no worker
+  is running when a callback doesn't return.
+*/
+
+#define CSV_PARALLEL_CHUNK (4 * 1024 * 1024)
+#define CSV_PARALLEL_MAX_THREADS 64
+
+#define CSV_EVENT_FIELD      0 /* Field passed from the input, off is relative to the input */
+#define CSV_EVENT_FIELD_COPY 1 /* Field copied by the worker, off is relative to the chunk's copy buffer */
+#define CSV_EVENT_NULL       2 /* Null field, see CSV_EMPTY_IS_NULL */
+#define CSV_EVENT_ROW        3 /* End of row, c is the character passed to cb2 */
+
+struct csv_event {
+  size_t off;
+  size_t len;
+  int type;
+  int c;
+};
+
+struct csv_chunk {
+  struct csv_parallel *job;
+  int slot;                   /* Index of the worker thread */
+  size_t start;               /* Range of the input parsed by the worker */
+  size_t end;
+  size_t parsed;              /* Number of bytes consumed by csv_parse */
+  int status;
+  struct csv_parser parser;
+  struct csv_event *events;   /* Recorded callbacks */
+  size_t events_len;
+  size_t events_size;
+  unsigned char *copy;        /* Fields that couldn't be passed from the input */
+  size_t copy_len;
+  size_t copy_size;
+};
+
+struct csv_parallel {
+  void *(*worker)(void *);    /* Function run by all worker threads of the current pass */
+  int nthreads;               /* Number of worker threads of the current pass */
+  const unsigned char *input;
+  size_t len;
+  size_t chunk_size;
+  size_t nchunks;
+  size_t *bounds;             /* Start of every chunk, followed by len */
+  size_t *quotes;             /* Number of quote characters in every chunk before it was adjusted */
+  unsigned char quote;
+  int threads;
+  struct csv_chunk slots[CSV_PARALLEL_MAX_THREADS];
+};
+
+static void
+csv_parallel_release(struct csv_parser *p)
+{
+  /* Free everything csv_parse_parallel has allocated, including after a callback didn't return */
+  struct csv_parallel *job = p->parallel;
+  int i;
+
+  if (job == NULL)
+    return;
+
+  for (i = 0; i < CSV_PARALLEL_MAX_THREADS; i++) {
+    csv_free(&job->slots[i].parser);
+    free(job->slots[i].events);
+    free(job->slots[i].copy);
+  }
+  free(job->bounds);
+  free(job->quotes);
+  free(job);
+  p->parallel = NULL;
+}
+
+#ifdef HAVE_PTHREAD_H
+
+static struct csv_event *
+csv_chunk_event(struct csv_chunk *c, int type)
+{
+  /* Append an event to the chunk, returns NULL if out of memory */
+  struct csv_event *events;
+  size_t size;
+
+  if (c->status)
+    return NULL;
+
+  if (c->events_len == c->events_size) {
+    size = c->events_size ? c->events_size * 2 : 1024;
+    events = realloc(c->events, size * sizeof(struct csv_event));
+    if (events == NULL) {
+      c->status = CSV_ENOMEM;
+      return NULL;
+    }
+    c->events = events;
+    c->events_size = size;
+  }
+
+  c->events[c->events_len].type = type;
+  c->events[c->events_len].off = 0;
+  c->events[c->events_len].len = 0;
+  c->events[c->events_len].c = 0;
+  return &c->events[c->events_len++];
+}
+
+static void
+csv_chunk_field(void *s, size_t len, void *data)
+{
+  /* cb1 of worker threads */
+  struct csv_chunk *c = data;
+  const unsigned char *input = c->job->input;
+  const unsigned char *field = s;
+  struct csv_event *ev;
+  unsigned char *copy;
+  size_t size, need;
+
+  if (field == NULL) {
+    csv_chunk_event(c, CSV_EVENT_NULL);
+    return;
+  }
+
+  if (field >= input && field + len <= input + c->job->len) {
+    if ((ev = csv_chunk_event(c, CSV_EVENT_FIELD)) != NULL) {
+      ev->off = field - input;
+      ev->len = len;
+    }
+    return;
+  }
+
+  /* The field is in the entry buffer, copy it along with the null appended by CSV_APPEND_NULL */
+  need = c->copy_len + len + 1;
+  if (need > c->copy_size) {
+    size = c->copy_size ? c->copy_size : 4096;
+    while (size < need)
+      size *= 2;
+    copy = realloc(c->copy, size);
+    if (copy == NULL) {
+      c->status = CSV_ENOMEM;
+      return;
+    }
+    c->copy = copy;
+    c->copy_size = size;
+  }
+
+  if ((ev = csv_chunk_event(c, CSV_EVENT_FIELD_COPY)) != NULL) {
+    memcpy(c->copy + c->copy_len, field, len + ((c->parser.options & CSV_APPEND_NULL) ? 1 : 0));
+    ev->off = c->copy_len;
+    ev->len = len;
+    c->copy_len += len + 1;
+  }
+}
+
+static void
+csv_chunk_row(int ch, void *data)
+{
+  /* cb2 of worker threads */
+  struct csv_event *ev = csv_chunk_event(data, CSV_EVENT_ROW);
+
+  if (ev)
+    ev->c = ch;
+}
+
+static void *
+csv_count_quotes(void *data)
+{
+  /* Count quote characters in every chunk assigned to the worker */
+  struct csv_chunk *c = data;
+  struct csv_parallel *job = c->job;
+  const unsigned char *q, *end;
+  size_t i, n;
+
+  for (i = c->slot; i < job->nchunks; i += job->threads) {
+    q = job->input + job->bounds[i];
+    end = job->input + job->bounds[i + 1];
+    for (n = 0; q < end && (q = memchr(q, job->quote, end - q)) != NULL; q++)
+      n++;
+    job->quotes[i] = n;
+  }
+  return NULL;
+}
+
+static void *
+csv_parse_chunk(void *data)
+{
+  /* Parse the chunk assigned to the worker, recording the callbacks */
+  struct csv_chunk *c = data;
+  size_t len = c->end - c->start;
+
+  if (len) {
+    c->parsed = csv_parse(&c->parser, c->job->input + c->start, len, csv_chunk_field, csv_chunk_row, c);
+    if (c->parsed != len && !c->status)
+      c->status = csv_error(&c->parser);
+  }
+  return NULL;
+}
+
+static void *
+csv_parallel_wait(void *data)
+{
+  /* Run job->worker for the first job->nthreads slots and wait for them to finish.
+   * A worker is run on the calling thread if a thread can't be created.
+   */
+  struct csv_parallel *job = data;
+  pthread_t tids[CSV_PARALLEL_MAX_THREADS];
+  int started[CSV_PARALLEL_MAX_THREADS];
+  int i;
+
+  for (i = 0; i < job->nthreads; i++) {
+    started[i] = pthread_create(&tids[i], NULL, job->worker, &job->slots[i]) == 0;
+    if (!started[i])
+      job->worker(&job->slots[i]);
+  }
+
+  for (i = 0; i < job->nthreads; i++) {
+    if (started[i])
+      pthread_join(tids[i], NULL);
+  }
+  return NULL;
+}
+
+static void
+csv_parallel_run(struct csv_parser *p, struct csv_parallel *job, int threads, void *(*worker)(void *))
+{
+  /* Run worker on threads worker threads, through the blocking function if there is one */
+  job->worker = worker;
+  job->nthreads = threads;
+
+  if (p->blocking_func)
+    p->blocking_func(csv_parallel_wait, job);
+  else
+    csv_parallel_wait(job);
+}
+
+static void
+csv_parallel_bounds(struct csv_parser *p, struct csv_parallel *job)
+{
+  /* Move chunk starts to the first record boundary that follows them */
+  const unsigned char *us = job->input;
+  size_t i, pos, prev = 0;
+  int odd = 0;
+  unsigned char c;
+
+  for (i = 1; i < job->nchunks; i++) {
+    odd ^= job->quotes[i - 1] & 1;
+
+    pos = job->bounds[i] > prev ? job->bounds[i] : prev;
+    if (pos == job->bounds[i]) {
+      /* Quote parity is only known at the original start of the chunk */
+      int parity = odd;
+      while (pos < job->len) {
+        c = us[pos++];
+        if (c == job->quote)
+          parity = !parity;
+        else if (!parity && (p->is_term ? p->is_term(c) : c == CSV_CR || c == CSV_LF))
+          break;
+      }
+    }
+    job->bounds[i] = prev = pos;
+  }
+}
+
+static int
+csv_adopt_state(struct csv_parser *p, struct csv_parser *w)
+{
+  /* Continue from where worker parser w has stopped, skipped fields have nothing in the entry buffer */
+  if (!FIELD_SKIPPED(w, w->column)) {
+    while (p->entry_size < w->entry_pos + 2) {
+      if (csv_increase_buffer(p) != 0)
+        return -1;
+    }
+
+    memcpy(p->entry_buf, w->entry_buf, w->entry_pos);
+  }
+  p->pstate = w->pstate;
+  p->quoted = w->quoted;
+  p->spaces = w->spaces;
+  p->entry_pos = w->entry_pos;
+  p->column = w->column;
+  p->rejected = w->rejected;
+  return 0;
+}
+
+#endif
+
+size_t
+csv_parse_parallel(struct csv_parser *p, const void *s, size_t len, int threads, size_t chunk_size, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data)
+{
+  /* Parse s using up to threads worker threads, calling cb1 and cb2 exactly as csv_parse would.
+   * Only strict mode data parsed from the beginning of a row can be split into chunks, anything
+   * else is passed over to csv_parse.
+   */
+#ifdef HAVE_PTHREAD_H
+  struct csv_parallel *job;
+  struct csv_chunk *c;
+  struct csv_event *ev;
+  size_t i, wave, end, n;
+  int t, nthreads;
+
+  if (p == NULL)
+    return 0;
+
+  if (!chunk_size)
+    chunk_size = CSV_PARALLEL_CHUNK;
+  if (threads > CSV_PARALLEL_MAX_THREADS)
+    threads = CSV_PARALLEL_MAX_THREADS;
+
+  if (threads < 2 || len <= chunk_size || !(p->options & CSV_STRICT) || p->pstate != ROW_NOT_BEGUN)
+    return csv_parse(p, s, len, cb1, cb2, data);
+
+  /* Scratch space is attached to the parser, so that csv_free can take care of it if a callback doesn't return */
+  csv_parallel_release(p);
+  if ((job = calloc(1, sizeof(struct csv_parallel))) == NULL) {
+    p->status = CSV_ENOMEM;
+    return 0;
+  }
+  p->parallel = job;
+
+  job->input = s;
+  job->len = len;
+  job->quote = p->quote_char;
+  job->threads = threads;
+  job->nchunks = (len + chunk_size - 1) / chunk_size;
+  job->bounds = malloc((job->nchunks + 1) * sizeof(size_t));
+  job->quotes = malloc(job->nchunks * sizeof(size_t));
+  if (job->bounds == NULL || job->quotes == NULL) {
+    csv_parallel_release(p);
+    p->status = CSV_ENOMEM;
+    return 0;
+  }
+
+  for (i = 0; i < job->nchunks; i++)
+    job->bounds[i] = i * chunk_size;
+  job->bounds[job->nchunks] = len;
+
+  for (t = 0; t < CSV_PARALLEL_MAX_THREADS; t++) {
+    c = &job->slots[t];
+    c->job = job;
+    c->slot = t;
+    csv_init(&c->parser, 0);
+  }
+
+  csv_parallel_run(p, job, threads, csv_count_quotes);
+  csv_parallel_bounds(p, job);
+
+  for (wave = 0; wave < job->nchunks; wave += threads) {
+    nthreads = (job->nchunks - wave < (size_t)threads) ? (int)(job->nchunks - wave) : threads;
+
+    for (t = 0; t < nthreads; t++) {
+      c = &job->slots[t];
+      csv_free(&c->parser);
+      c->parser = *p;
+      c->parser.entry_buf = NULL;
+      c->parser.entry_size = 0;
+      c->parser.status = 0;
+      c->parser.pool = NULL;
+      c->parser.parallel = NULL;
+      c->parser.allocations = 0;
+      c->start = job->bounds[wave + t];
+      c->end = job->bounds[wave + t + 1];
+      c->parsed = 0;
+      c->status = 0;
+      c->events_len = 0;
+      c->copy_len = 0;
+    }
+
+    csv_parallel_run(p, job, nthreads, csv_parse_chunk);
+
+    /* Replay the wave in input order */
+    for (t = 0; t < nthreads; t++) {
+      c = &job->slots[t];
+
+      if (c->status == CSV_ENOMEM) {
+        csv_parallel_release(p);
+        p->status = CSV_ENOMEM;
+        return c->start;
+      }
+
+      for (i = 0; i < c->events_len; i++) {
+        ev = &c->events[i];
+        switch (ev->type) {
+          case CSV_EVENT_FIELD:
+            if (cb1) cb1((void *)(job->input + ev->off), ev->len, data);
+            break;
+          case CSV_EVENT_FIELD_COPY:
+            if (cb1) cb1(c->copy + ev->off, ev->len, data);
+            break;
+          case CSV_EVENT_NULL:
+            if (cb1) cb1(NULL, 0, data);
+            break;
+          default:
+            if (cb2) cb2(ev->c, data);
+        }
+      }
+
+      if (c->status) {
+        /* Strict mode error, stop exactly where csv_parse would have */
+        n = c->start + c->parsed;
+        csv_adopt_state(p, &c->parser);
+        p->status = c->status;
+        csv_parallel_release(p);
+        return n;
+      }
+
+      if (c->parser.pstate != ROW_NOT_BEGUN) {
+        /* Either the last chunk ended in the middle of a row, or the data couldn't be split properly.
+           Take the state over and parse whatever is left serially. */
+        end = c->end;
+        if (csv_adopt_state(p, &c->parser) != 0) {
+          csv_parallel_release(p);
+          return c->start;
+        }
+        csv_parallel_release(p);
+        return end + csv_parse(p, (const unsigned char *)s + end, len - end, cb1, cb2, data);
+      }
+    }
+  }
+
+  csv_parallel_release(p);
+  return len;
+#else
+  (void)threads;
+  (void)chunk_size;
+  return csv_parse(p, s, len, cb1, cb2, data);
+#endif
+}
+
+
 size_t
 csv_write (void *dest, size_t dest_size, const void *src, size_t src_size)
 {
@@ -1,13 +1,67 @@
 #include <stdbool.h>
+#include <stdint.h>
 #include <ruby.h>
+#include <ruby/util.h>
+
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
+
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+#include <ruby/io/buffer.h>
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+#endif
 
 #include "csv.h"
 
 static VALUE rcsv_parse_error; /* class Rcsv::ParseError << StandardError; end */
+static VALUE rcsv_pool_class;  /* class Rcsv::Pool; end */
+static VALUE rcsv_row_class;   /* class Rcsv::Row; end */
+static VALUE rcsv_writer_class; /* class Rcsv::Writer; end */
+static VALUE rcsv_parser_class; /* class Rcsv::Parser; end */
+static VALUE rcsv_plan_class;   /* class Rcsv::Plan; end */
+static VALUE rcsv_files_class;  /* class Rcsv::Files; end */
+
+/* It is useful to know exact row/column positions and field contents where parse-time exception was raised.
+   Field contents are not necessarily NUL-terminated, hence the explicit length. */
+#define RAISE_WITH_LOCATION(row, column, contents, length, fmt, ...) \
+  rb_raise(rcsv_parse_error, "[%d:%d '%.*s'] " fmt, (int)(row), (int)(column), (int)(length), (contents) ? (char *)(contents) : "", ##__VA_ARGS__);
+
+/* Doubles represent integers up to 2^53 and powers of ten up to 10^22 exactly,
+   so numbers within these limits can be converted with a single correctly rounded operation */
+#define RCSV_EXACT_MANTISSA (1ULL << 53)
+#define RCSV_EXACT_POWER 22
+#define RCSV_MAX_DIGITS 19 /* Decimal digits that always fit into uint64_t */
+
+/* Results of the number scanners */
+#define RCSV_NUMBER_INVALID 0 /* Not a number */
+#define RCSV_NUMBER_VALID 1   /* Read exactly */
+#define RCSV_NUMBER_INEXACT 2 /* A valid number that has to be converted by Ruby */
 
-/* It is useful to know exact row/column positions and field contents where parse-time exception was raised */
-#define RAISE_WITH_LOCATION(row, column, contents, fmt, ...) \
-  rb_raise(rcsv_parse_error, "[%d:%d '%s'] " fmt, (int)(row), (int)(column), (char *)(contents), ##__VA_ARGS__);
+static const double rcsv_powers_of_ten[RCSV_EXACT_POWER + 1] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
 
 /* String encoding is only available in Ruby 1.9+ */
 #ifdef HAVE_RUBY_ENCODING_H
@@ -39,18 +93,75 @@ static VALUE rcsv_parse_error; /* class Rcsv::ParseError << StandardError; end *
 
 #endif
 
+/* Lazy rows of a parse share backing Strings, a new one is started once the current one grows this large */
+#define RCSV_ROW_BUFFER_SIZE (64 * 1024)
+
+/* Marks NULL fields in the field end offsets of lazy rows */
+#define RCSV_ROW_NULL 0x80000000U
+
+/* Interned columns return the same object for up to this many distinct values, other values are
+   converted as usual */
+#define RCSV_INTERN_LIMIT 4096
+
+/* Number of rows collected by csv_parse_batch() before they are turned into Ruby objects */
+#define RCSV_BATCH_ROWS 1024
+
+/* Arguments of csv_parse_batch(), which may be called without the GVL */
+struct rcsv_batch_call {
+  struct csv_parser * cp;
+  struct csv_batch * batch;
+  const char * input;
+  size_t input_len;
+  size_t parsed;
+};
+
+/* A byte string owned by a compiled filter */
+struct rcsv_filter_string {
+  char * str;                 /* NULL marks free slots of the hash set */
+  size_t len;
+};
+
+/* A numeric Range, nil endpoints are infinite */
+struct rcsv_filter_range {
+  double first;
+  double last;
+  bool exclude_end;
+};
+
+/* :only_rows or :except_rows values of a column, compiled into matchers that work on raw field bytes */
+struct rcsv_filter {
+  VALUE values;               /* Array of filter values, Qnil if the column isn't filtered */
+  char row_conversion;        /* Conversion of the column, decides which matchers apply */
+  bool strings_exact;         /* The matchers below decide String fields without converting them */
+  bool numbers_exact;         /* ... and Integer and Float fields */
+  bool match_true;            /* values include true */
+  bool match_false;           /* values include false */
+
+  struct rcsv_filter_string * strings; /* Open addressing hash set of Strings */
+  size_t strings_mask;        /* Number of slots in strings - 1 */
+  struct rcsv_filter_string * prefixes; /* Literal prefixes of /\A.../ Regexps */
+  size_t num_prefixes;
+  double * numbers;           /* Sorted Integers and Floats */
+  size_t num_numbers;
+  struct rcsv_filter_range * ranges;
+  size_t num_ranges;
+};
+
 struct rcsv_metadata {
   /* Derived from user-specified options */
   bool row_as_hash;           /* Used to return array of hashes rather than array of arrays */
   bool empty_field_is_nil;    /* Do we convert empty fields to nils? */
   size_t offset_rows;         /* Number of rows to skip before parsing */
+  size_t end_row;             /* Rows from here on are not parsed, see :limit_rows */
   int encoding_index;         /* If available, the encoding index of the original input */
 
   char * row_conversions;     /* A pointer to string/array of row conversions char specifiers */
-  VALUE * only_rows;          /* A pointer to array of row filters */
-  VALUE * except_rows;        /* A pointer to array of negative row filters */
+  unsigned char * column_mask; /* Columns that libcsv passes on, derived from row_conversions */
+  struct rcsv_filter * only_rows;   /* A pointer to array of row filters */
+  struct rcsv_filter * except_rows; /* A pointer to array of negative row filters */
   VALUE * row_defaults;       /* A pointer to array of row defaults */
   VALUE * column_names;       /* A pointer to array of column names to be used with hashes */
+  VALUE intern;               /* Dictionaries of interned columns, Qnil if there are none */
 
   /* Pointer options lengths */
   size_t num_row_conversions; /* Number of converter types in row_conversions array */
@@ -64,476 +175,4751 @@ struct rcsv_metadata {
   size_t current_col;         /* Current column's index */
   size_t current_row;         /* Current row's index */
 
-  VALUE last_entry;           /* A pointer to the last entry that's going to be appended to result */
+  VALUE last_entry;           /* A pointer to the last entry that's going to be appended to result. Fields of Hash and
+                                 :row_class rows are collected into an Array that is reused for every row. */
+  VALUE row_class;            /* Class that rows are instances of, Qnil for Arrays and Hashes */
+  bool row_class_is_struct;   /* row_class is a Struct, which can be instantiated without calling new */
+  long num_row_members;       /* Number of row_class members */
   VALUE * result;             /* A pointer to the parsed data */
+
+  /* :result => :columns */
+  VALUE result_columns;       /* Hash of column name => Array of column values, Qnil when parsing into rows */
+  VALUE column_values;        /* Arrays of result_columns indexed by column position, nil for skipped columns */
+  long num_result_rows;       /* Number of rows in every Array of column_values */
+
+  /* :lazy_rows */
+  VALUE row_layout;           /* Rcsv::Row layout shared by all rows, Qnil when rows are built eagerly */
+  VALUE row_buffer;           /* Backing String that raw fields of lazy rows are appended to */
+  size_t row_offset;          /* Where the current row starts in row_buffer */
+  uint32_t * row_ends;        /* Field end offsets of the current row, relative to row_offset */
+  size_t num_row_ends;        /* Number of fields in the current row */
+  size_t row_ends_size;       /* Capacity of row_ends */
+
+  void * mapping;             /* Memory-mapped input file, if any */
+  size_t mapping_size;        /* Size of the mapping */
+  VALUE locked_buffer;        /* IO::Buffer input, locked while it's being parsed */
+  struct csv_batch * batch;   /* Fields and rows collected by libcsv */
+  bool release_gvl;           /* Collect batches without holding the GVL */
+  int compression;            /* RCSV_COMPRESSION_* of the input, RCSV_COMPRESSION_AUTO until it's been detected */
+  struct rcsv_decompressor * decompressor; /* Decompression state of compressed input */
+
+  /* :configure */
+  struct csv_parser * parser; /* Parser that column options set up column masks and filters of */
+  VALUE options;              /* raw_parse options, merged with the options returned by :configure once it's been called */
+  VALUE configure;            /* Called with the fields of the first row, Qnil if there is none or once it's been called */
+  VALUE header;               /* Raw fields of the first row, collected until the row ends */
+
+  /* :batch_size */
+  long batch_size;            /* Number of rows yielded at once, 0 if rows are yielded one by one */
+  VALUE batch_rows;           /* Rows collected for the next yield */
+
+  /* Rcsv.compile */
+  struct rcsv_plan * plan;    /* Compiled plan the input is parsed with, if any */
+  bool shared_configuration;  /* Column options belong to the plan, and are not freed with the parse */
 };
 
-/* Internal callbacks */
+/* Rcsv::Plan holds options that have been validated and compiled once, to be reused by many parses */
+struct rcsv_plan {
+  struct csv_parser cp;       /* Set up libcsv parser that parses are started from, it never parses itself */
+  struct rcsv_metadata meta;  /* Set up metadata that parses are started from. Holds the column options unless they
+                                 depend on the header. */
+  struct rcsv_metadata compiled; /* Column options set up for header, copied into parses with the same header */
+  bool is_compiled;           /* compiled holds column options */
+  VALUE header;               /* Raw fields of the first row that compiled was set up for */
+  bool header_fields;         /* Headers only match if their fields do, otherwise if they have as many fields */
+  bool fixed_encoding;        /* :output_encoding was given, otherwise parses take the encoding of their input */
+  bool columns_result;        /* :result => :columns */
+  VALUE pool;                 /* Rcsv::Pool or Qnil */
+  int threads;
+  size_t chunk_size;
+};
 
-/* This procedure is called for every parsed field */
-void end_of_field_callback(void * field, size_t field_size, void * data) {
-  const char * field_str = (char *)field;
-  struct rcsv_metadata * meta = (struct rcsv_metadata *) data;
-  char row_conversion = 0;
-  VALUE parsed_field;
+/* Conversion kernels. Fields are not NUL-terminated, so they are converted by (pointer, length),
+   independently of the C locale. Spaces and tabs around numbers are ignored. */
 
-  /* No need to parse anything until the end of the line if skip_current_row is set */
-  if (meta->skip_current_row) {
-    return;
+static void rcsv_trim(const char ** str, size_t * len) {
+  while (*len && (**str == ' ' || **str == '\t')) {
+    (*str)++;
+    (*len)--;
   }
 
-  /* Skip the row if its position is less than specifed offset */
-  if (meta->current_row < meta->offset_rows) {
-    meta->skip_current_row = true;
-    return;
+  while (*len && ((*str)[*len - 1] == ' ' || (*str)[*len - 1] == '\t')) {
+    (*len)--;
   }
+}
 
-  /* Get row conversion char specifier */
-  if (meta->current_col < meta->num_row_conversions) {
-    row_conversion = (char)meta->row_conversions[meta->current_col];
+/* Reads a decimal integer without touching Ruby objects. Values that don't fit into 64 bits are RCSV_NUMBER_INEXACT. */
+static int rcsv_scan_int(const char * str, size_t len, int64_t * result) {
+  const char * cur, * end;
+  bool negative = false, overflow = false;
+  uint64_t value = 0, limit;
+  unsigned int digit;
+
+  rcsv_trim(&str, &len);
+  cur = str;
+  end = str + len;
+
+  if (cur < end && (*cur == '+' || *cur == '-')) {
+    negative = (*cur == '-');
+    cur++;
   }
 
-  /* Convert the field from string into Ruby type specified by row_conversion */
-  if (row_conversion != ' ') { /* spacebar skips the column */
-    if (field_size == 0) {
-      /* Assigning appropriate default value if applicable. */
-      if (meta->current_col < meta->num_row_defaults) {
-        parsed_field = meta->row_defaults[meta->current_col];
-      } else { /* It depends on empty_field_is_nil if we convert empty strings to nils */
-        if (meta->empty_field_is_nil || field_str == NULL) {
-          parsed_field = Qnil;
-        } else {
-          parsed_field = ENCODED_STR_NEW("", 0, meta->encoding_index);
-        }
-      }
-    } else {
-      if (meta->current_col < meta->num_row_conversions) {
-        switch (row_conversion){
-          case 's': /* String */
-            parsed_field = ENCODED_STR_NEW(field_str, field_size, meta->encoding_index);
-            break;
-          case 'i': /* Integer */
-            parsed_field = LL2NUM(atoll(field_str));
-            break;
-          case 'f': /* Float */
-            parsed_field = rb_float_new(atof(field_str));
-            break;
-          case 'b': /* TrueClass/FalseClass */
-            switch (field_str[0]) {
-              case 't':
-              case 'T':
-              case '1':
-                parsed_field = Qtrue;
-                break;
-              case 'f':
-              case 'F':
-              case '0':
-                parsed_field = Qfalse;
-                break;
-              default:
-                RAISE_WITH_LOCATION(
-                  meta->current_row,
-                  meta->current_col,
-                  field_str,
-                  "Bad Boolean value. Valid values are strings where the first character is T/t/1 for true or F/f/0 for false."
-                );
-            }
-            break;
-          default:
-            RAISE_WITH_LOCATION(
-              meta->current_row,
-              meta->current_col,
-              field_str,
-              "Unknown deserializer '%c'.",
-              row_conversion
-            );
-        }
-      } else { /* No conversion happens */
-        parsed_field = ENCODED_STR_NEW(field_str, field_size, meta->encoding_index); /* field */
-      }
-    }
+  if (cur == end) {
+    return RCSV_NUMBER_INVALID;
+  }
 
-    /* Filter by row values listed in meta->only_rows */
-    if ((meta->only_rows != NULL) &&
-        (meta->current_col < meta->num_only_rows) &&
-        (meta->only_rows[meta->current_col] != Qnil) &&
-        (!rb_ary_includes(meta->only_rows[meta->current_col], parsed_field))) {
-      meta->skip_current_row = true;
-      return;
+  limit = negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+  for (; cur < end; cur++) {
+    digit = (unsigned int)(unsigned char)*cur - '0';
+    if (digit > 9) {
+      return RCSV_NUMBER_INVALID;
     }
 
-    /* Filter out by row values listed in meta->except_rows */
-    if ((meta->except_rows != NULL) &&
-        (meta->current_col < meta->num_except_rows) &&
-        (meta->except_rows[meta->current_col] != Qnil) &&
-        (rb_ary_includes(meta->except_rows[meta->current_col], parsed_field))) {
-      meta->skip_current_row = true;
-      return;
+    if (value > (limit - digit) / 10) {
+      overflow = true;
+    } else {
+      value = value * 10 + digit;
     }
+  }
 
-    /* Assign the value to appropriate hash key if parsing into Hash */
-    if (meta->row_as_hash) {
-      if (meta->current_col >= meta->num_columns) {
-        RAISE_WITH_LOCATION(
-          meta->current_row,
-          meta->current_col,
-          field_str,
-          "There are at least %d columns in a row, which is beyond the number of provided column names (%d).",
-          (int)meta->current_col + 1,
-          (int)meta->num_columns
-        );
-      } else {
-        rb_hash_aset(meta->last_entry, meta->column_names[meta->current_col], parsed_field); /* last_entry[column_names[current_col]] = field */
-      }
-    } else { /* Parse into Array */
-      rb_ary_push(meta->last_entry, parsed_field); /* last_entry << field */
-    }
+  if (overflow) {
+    return RCSV_NUMBER_INEXACT;
+  } else if (negative) {
+    *result = value ? -(int64_t)(value - 1) - 1 : 0; /* -(2^63) is representable, 2^63 isn't */
+  } else {
+    *result = (int64_t)value;
   }
 
-  /* Increment column counter */
-  meta->current_col++;
-  return;
+  return RCSV_NUMBER_VALID;
 }
 
-/* This procedure is called for every line ending */
-void end_of_line_callback(int last_char, void * data) {
-  struct rcsv_metadata * meta = (struct rcsv_metadata *) data;
+/* Converts a decimal integer into Integer. Values that don't fit into 64 bits become Bignums.
+   Returns false if the field isn't a valid integer. */
+static bool rcsv_parse_int(const char * str, size_t len, VALUE * result) {
+  int64_t value;
 
-  /* If filters didn't match, current row parsing is reverted */
-  if (meta->skip_current_row) {
-    /* Do we wanna GC? */
-    meta->skip_current_row = false;
-  } else {
-    if (rb_block_given_p()) { /* STREAMING */
-      rb_yield(meta->last_entry);
+  switch (rcsv_scan_int(str, len, &value)) {
+    case RCSV_NUMBER_VALID:
+      *result = LL2NUM((long long)value);
+      return true;
+    case RCSV_NUMBER_INEXACT:
+      rcsv_trim(&str, &len);
+      *result = rb_str_to_inum(rb_str_new(str, len), 10, Qfalse);
+      return true;
+    default:
+      return false;
+  }
+}
+
+/* Reads a decimal floating point number without touching Ruby objects. Numbers with up to 19 significant
+   digits and exponents that keep them exact are converted with a single correctly rounded operation,
+   anything else is RCSV_NUMBER_INEXACT and has to go through ruby_strtod(). */
+static int rcsv_scan_float(const char * str, size_t len, double * result) {
+  const char * cur, * end;
+  bool negative = false, exponent_negative = false, truncated = false, any_digits = false;
+  uint64_t mantissa = 0;
+  long exponent = 0, explicit_exponent = 0;
+  int digits = 0;
+  unsigned int digit;
+  double value;
+
+  rcsv_trim(&str, &len);
+  cur = str;
+  end = str + len;
+
+  if (cur < end && (*cur == '+' || *cur == '-')) {
+    negative = (*cur == '-');
+    cur++;
+  }
+
+  /* Integer part */
+  for (; cur < end && (digit = (unsigned int)(unsigned char)*cur - '0') <= 9; cur++) {
+    any_digits = true;
+    if (digits < RCSV_MAX_DIGITS) {
+      if (mantissa || digit) {
+        mantissa = mantissa * 10 + digit;
+        digits++;
+      }
     } else {
-      rb_ary_push(*(meta->result), meta->last_entry);
+      truncated |= (digit != 0);
+      exponent++;
     }
   }
 
-  /* Re-initialize last_entry unless EOF reached */
-  if (last_char != -1) {
-    if (meta->row_as_hash) {
-      meta->last_entry = rb_hash_new(); /* {} */
-    } else {
-      meta->last_entry = rb_ary_new(); /* [] */
+  /* Fractional part */
+  if (cur < end && *cur == '.') {
+    for (cur++; cur < end && (digit = (unsigned int)(unsigned char)*cur - '0') <= 9; cur++) {
+      any_digits = true;
+      if (digits < RCSV_MAX_DIGITS) {
+        if (mantissa || digit) {
+          mantissa = mantissa * 10 + digit;
+          digits++;
+        }
+        exponent--;
+      } else {
+        truncated |= (digit != 0);
+      }
     }
   }
 
-  /* Resetting column counter */
-  meta->current_col = 0;
+  if (!any_digits) {
+    return RCSV_NUMBER_INVALID;
+  }
 
-  /* Incrementing row counter */
-  meta->current_row++;
-  return;
-}
+  /* Exponent */
+  if (cur < end && (*cur == 'e' || *cur == 'E')) {
+    cur++;
+    if (cur < end && (*cur == '+' || *cur == '-')) {
+      exponent_negative = (*cur == '-');
+      cur++;
+    }
 
-/* Filter rows need to be either nil or Arrays of Strings/bools/nil, so we validate this here */
-VALUE validate_filter_row(const char * filter_name, VALUE row) {
-  if (row == Qnil) {
-    return Qnil;
-  } else if (TYPE(row) == T_ARRAY) {
-    size_t j;
-    for (j = 0; j < (size_t)RARRAY_LEN(row); j++) {
-      switch (TYPE(rb_ary_entry(row, j))) {
-        case T_NIL:
-        case T_TRUE:
-        case T_FALSE:
-        case T_FLOAT:
-        case T_FIXNUM:
-        case T_BIGNUM:
-        case T_REGEXP:
-        case T_STRING:
-          break;
-        default:
-          rb_raise(rcsv_parse_error,
-            ":%s can only accept nil or Array consisting of String, boolean or nil elements, but %s was provided.",
-            filter_name, RSTRING_PTR(rb_inspect(row)));
+    if (cur == end) {
+      return RCSV_NUMBER_INVALID;
+    }
+
+    for (; cur < end && (digit = (unsigned int)(unsigned char)*cur - '0') <= 9; cur++) {
+      if (explicit_exponent < 100000) { /* Anything beyond that is either zero or infinity */
+        explicit_exponent = explicit_exponent * 10 + digit;
       }
     }
-    return row;
-  } else {
-    rb_raise(rcsv_parse_error,
-      ":%s can only accept nil or Array as an element, but %s was provided.",
-      filter_name, RSTRING_PTR(rb_inspect(row)));
+    exponent += exponent_negative ? -explicit_exponent : explicit_exponent;
   }
-}
 
-/* All the possible free()'s should be listed here.
-   This function should be invoked before returning the result to Ruby or raising an exception. */
-void free_memory(struct csv_parser * cp, struct rcsv_metadata * meta) {
-  if (meta->only_rows != NULL) {
-    free(meta->only_rows);
+  if (cur != end) {
+    return RCSV_NUMBER_INVALID;
   }
 
-  if (meta->except_rows != NULL) {
-    free(meta->except_rows);
+  if (mantissa == 0 && !truncated) {
+    *result = negative ? -0.0 : 0.0;
+    return RCSV_NUMBER_VALID;
   }
 
-  if (meta->row_defaults != NULL) {
-    free(meta->row_defaults);
+  if (truncated || mantissa > RCSV_EXACT_MANTISSA || exponent < -RCSV_EXACT_POWER || exponent > RCSV_EXACT_POWER) {
+    return RCSV_NUMBER_INEXACT;
   }
 
-  if (meta->column_names != NULL) {
-    free(meta->column_names);
+  value = (double)mantissa;
+  if (exponent < 0) {
+    value /= rcsv_powers_of_ten[-exponent];
+  } else {
+    value *= rcsv_powers_of_ten[exponent];
   }
 
-  if (cp != NULL) {
-    csv_free(cp);
-  }
+  *result = negative ? -value : value;
+  return RCSV_NUMBER_VALID;
 }
 
-/* An rb_rescue()-compatible free_memory() wrapper that unpacks C pointers from Ruby's Fixnums */
-VALUE rcsv_free_memory(VALUE ensure_container) {
-  free_memory(
-    (struct csv_parser *)NUM2LONG(rb_ary_entry(ensure_container, 3)),
-    (struct rcsv_metadata *)NUM2LONG(rb_ary_entry(ensure_container, 2))
-  );
+/* Converts a decimal floating point number into Float, correctly rounded.
+   Returns false if the field isn't a valid number. */
+static bool rcsv_parse_float(const char * str, size_t len, VALUE * result) {
+  double value;
+  VALUE copy;
 
-  return Qnil;
+  switch (rcsv_scan_float(str, len, &value)) {
+    case RCSV_NUMBER_VALID:
+      break;
+    case RCSV_NUMBER_INEXACT:
+      /* Slow path for long or extreme numbers, ruby_strtod() needs a terminated copy */
+      rcsv_trim(&str, &len);
+      copy = rb_str_new(str, len);
+      value = ruby_strtod(RSTRING_PTR(copy), NULL);
+      RB_GC_GUARD(copy);
+      break;
+    default:
+      return false;
+  }
+
+  *result = rb_float_new(value);
+  return true;
 }
 
-/* An rb_rescue()-compatible Ruby pseudo-method that handles the actual parsing */
-VALUE rcsv_raw_parse(VALUE ensure_container) {
-  /* Unpacking multiple variables from a single Ruby VALUE */
-  VALUE options = rb_ary_entry(ensure_container, 0);
-  VALUE csvio   = rb_ary_entry(ensure_container, 1);
-  struct rcsv_metadata * meta = (struct rcsv_metadata *)NUM2LONG(rb_ary_entry(ensure_container, 2));
-  struct csv_parser * cp = (struct csv_parser *)NUM2LONG(rb_ary_entry(ensure_container, 3));
+/* Internal callbacks */
 
-  /* Helper temporary variables */
-  VALUE option, csvstr, buffer_size;
+/* Appends a field value to the Array of its column with :result => :columns,
+   creating the Array with nils for all previous rows when the column is seen for the first time */
+static void rcsv_append_column_value(struct rcsv_metadata * meta, VALUE value) {
+  VALUE values = rb_ary_entry(meta->column_values, (long)meta->current_col);
+  VALUE key;
 
-  /* libcsv-related temporary variables */
-  char * csv_string;
-  size_t csv_string_len;
-  int error;
+  if (values == Qnil) {
+    values = rb_ary_new_capa(meta->num_result_rows + 1);
+    rb_ary_resize(values, meta->num_result_rows);
+    rb_ary_store(meta->column_values, (long)meta->current_col, values);
+
+    if (meta->current_col < meta->num_columns && meta->column_names[meta->current_col] != Qnil) {
+      key = meta->column_names[meta->current_col];
+    } else {
+      key = SIZET2NUM(meta->current_col);
+    }
+    rb_hash_aset(meta->result_columns, key, values);
+  }
 
-  /* Generic iterator */
-  size_t i = 0;
+  rb_ary_push(values, value);
+}
 
-  /* IO buffer size can be controller via an option */
-  buffer_size = rb_hash_aref(options, ID2SYM(rb_intern("buffer_size")));
+/* Finishes a row with :result => :columns, either dropping values of a filtered out row
+   or padding columns that the row was too short for */
+static void rcsv_end_column_row(struct rcsv_metadata * meta, bool skipped) {
+  long i, num_columns = RARRAY_LEN(meta->column_values);
+  VALUE values;
 
-  /* By default, parse as Array of Arrays */
-  option = rb_hash_aref(options, ID2SYM(rb_intern("row_as_hash")));
-  if (option && (option != Qnil)) {
-    meta->row_as_hash = true;
+  if (!skipped) {
+    meta->num_result_rows++;
   }
 
-  /* :col_sep sets the column separator, default is comma (,) */
-  option = rb_hash_aref(options, ID2SYM(rb_intern("col_sep")));
-  if (option != Qnil) {
-    csv_set_delim(cp, (unsigned char)*StringValuePtr(option));
+  for (i = 0; i < num_columns; i++) {
+    values = RARRAY_AREF(meta->column_values, i);
+    if (values != Qnil && RARRAY_LEN(values) != meta->num_result_rows) {
+      rb_ary_resize(values, meta->num_result_rows);
+    }
   }
+}
 
-  /* :quote_char sets the character used for quoting data; default is double-quote (") */
-  option = rb_hash_aref(options, ID2SYM(rb_intern("quote_char")));
-  if (option != Qnil) {
-    csv_set_quote(cp, (unsigned char)*StringValuePtr(option));
+/* Interned columns. Strings of a column are looked up by their bytes in a dictionary, so that repeated values
+   share a single frozen String or Symbol instead of allocating a new String every time. */
+
+struct rcsv_intern_entry {
+  VALUE key;                  /* Frozen String, 0 marks free slots */
+  VALUE value;                /* key itself or its Symbol */
+};
+
+struct rcsv_intern_column {
+  struct rcsv_intern_entry * entries; /* Open addressing hash table, NULL if the column isn't interned */
+  size_t mask;                /* Number of slots - 1 */
+  size_t count;               /* Number of values in entries */
+  bool symbols;               /* Values are Symbols rather than Strings */
+};
+
+struct rcsv_intern {
+  struct rcsv_intern_column * columns;
+  long num_columns;
+};
+
+/* FNV-1a */
+static size_t rcsv_hash_bytes(const char * str, size_t len) {
+  uint64_t hash = 14695981039346656037ULL;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char)str[i]) * 1099511628211ULL;
   }
 
-  /* Specify how many rows to skip from the beginning of CSV */
-  option = rb_hash_aref(options, ID2SYM(rb_intern("offset_rows")));
-  if (option != Qnil) {
-    meta->offset_rows = (size_t)NUM2INT(option);
+  return (size_t)hash;
+}
+
+static void rcsv_intern_mark(void * data) {
+  struct rcsv_intern * intern = (struct rcsv_intern *)data;
+  struct rcsv_intern_column * column;
+  long i;
+  size_t j;
+
+  for (i = 0; i < intern->num_columns; i++) {
+    column = &intern->columns[i];
+    for (j = 0; column->entries != NULL && j <= column->mask; j++) {
+      if (column->entries[j].key) {
+        /* Keys are compared by their bytes, so they must not be moved by compaction */
+        rb_gc_mark(column->entries[j].key);
+        rb_gc_mark(column->entries[j].value);
+      }
+    }
   }
+}
 
-  /* Specify the character encoding of the input data */
-  option = rb_hash_aref(options, ID2SYM(rb_intern("output_encoding")));
-  if (option && (option != Qnil)) {
-    meta->encoding_index = RB_ENC_FIND_INDEX(StringValueCStr(option));
+static void rcsv_intern_free(void * data) {
+  struct rcsv_intern * intern = (struct rcsv_intern *)data;
+  long i;
+
+  for (i = 0; i < intern->num_columns; i++) {
+    xfree(intern->columns[i].entries);
   }
+  xfree(intern->columns);
+  xfree(intern);
+}
 
-  /* :only_rows is a list of values where row is only parsed
-     if its fields match those in the passed array.
-     [nil, nil, ["ABC", nil, 1]] skips all rows where 3rd column isn't equal to "ABC", nil or 1 */
-  option = rb_hash_aref(options, ID2SYM(rb_intern("only_rows")));
-  if (option != Qnil) {
-    meta->num_only_rows = (size_t)RARRAY_LEN(option);
-    meta->only_rows = (VALUE *)malloc(meta->num_only_rows * sizeof(VALUE));
+static size_t rcsv_intern_memsize(const void * data) {
+  const struct rcsv_intern * intern = (const struct rcsv_intern *)data;
+  size_t size = sizeof(struct rcsv_intern) + intern->num_columns * sizeof(struct rcsv_intern_column);
+  long i;
 
-    for (i = 0; i < meta->num_only_rows; i++) {
-      VALUE only_row = rb_ary_entry(option, i);
-      meta->only_rows[i] = validate_filter_row("only_rows", only_row);
+  for (i = 0; i < intern->num_columns; i++) {
+    if (intern->columns[i].entries != NULL) {
+      size += (intern->columns[i].mask + 1) * sizeof(struct rcsv_intern_entry);
     }
   }
 
-  /* :except_rows is a list of values where row is only parsed
-     if its fields don't match those in the passed array.
-     [nil, nil, ["ABC", nil, 1]] skips all rows where 3rd column is equal to "ABC", nil or 1 */
-  option = rb_hash_aref(options, ID2SYM(rb_intern("except_rows")));
-  if (option != Qnil) {
-    meta->num_except_rows = (size_t)RARRAY_LEN(option);
-    meta->except_rows = (VALUE *)malloc(meta->num_except_rows * sizeof(VALUE));
+  return size;
+}
 
-    for (i = 0; i < meta->num_except_rows; i++) {
-      VALUE except_row = rb_ary_entry(option, i);
-      meta->except_rows[i] = validate_filter_row("except_rows", except_row);
+static const rb_data_type_t rcsv_intern_type = {
+  "rcsv_intern",
+  { rcsv_intern_mark, rcsv_intern_free, rcsv_intern_memsize, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/* Builds dictionaries from the :intern option, an Array with true (frozen Strings), :symbol or nil per column */
+static VALUE rcsv_intern_new(VALUE option) {
+  struct rcsv_intern * intern;
+  VALUE self = TypedData_Make_Struct(0, struct rcsv_intern, &rcsv_intern_type, intern);
+  VALUE mode;
+  long i;
+
+  Check_Type(option, T_ARRAY);
+  intern->columns = ZALLOC_N(struct rcsv_intern_column, RARRAY_LEN(option));
+  intern->num_columns = RARRAY_LEN(option);
+
+  for (i = 0; i < intern->num_columns; i++) {
+    mode = RARRAY_AREF(option, i);
+    if (RTEST(mode)) {
+      intern->columns[i].symbols = (mode == ID2SYM(rb_intern("symbol")));
+      intern->columns[i].mask = 63;
+      intern->columns[i].entries = ZALLOC_N(struct rcsv_intern_entry, 64);
     }
   }
 
-  /* :row_defaults is an array of default values that are assigned to fields containing empty strings
-     according to matching field positions */
-  option = rb_hash_aref(options, ID2SYM(rb_intern("row_defaults")));
-  if (option != Qnil) {
-    meta->num_row_defaults = RARRAY_LEN(option);
-    meta->row_defaults = (VALUE*)malloc(meta->num_row_defaults * sizeof(VALUE*));
+  return self;
+}
 
-    for (i = 0; i < meta->num_row_defaults; i++) {
-      VALUE row_default = rb_ary_entry(option, i);
-      meta->row_defaults[i] = row_default;
-    }
+/* Returns the dictionary of a column, or NULL if it isn't interned */
+static struct rcsv_intern_column * rcsv_intern_column(VALUE intern, size_t col) {
+  struct rcsv_intern * data;
+
+  if (intern == Qnil) {
+    return NULL;
   }
 
-  /* :row_conversions specifies Ruby types that CSV field values should be converted into.
-     Each char of row_conversions string represents Ruby type for CSV field with matching position. */
+  data = (struct rcsv_intern *)RTYPEDDATA_DATA(intern);
+  if (col >= (size_t)data->num_columns || data->columns[col].entries == NULL) {
+    return NULL;
+  }
+
+  return &data->columns[col];
+}
+
+/* Returns the slot of a String in a column dictionary, which is either the String itself or a free slot */
+static struct rcsv_intern_entry * rcsv_intern_slot(struct rcsv_intern_column * column, const char * str, size_t len) {
+  size_t i = rcsv_hash_bytes(str, len) & column->mask;
+  struct rcsv_intern_entry * slot;
+
+  for (;; i = (i + 1) & column->mask) {
+    slot = &column->entries[i];
+    if (!slot->key || ((size_t)RSTRING_LEN(slot->key) == len && memcmp(RSTRING_PTR(slot->key), str, len) == 0)) {
+      return slot;
+    }
+  }
+}
+
+/* Doubles the number of slots of a column dictionary */
+static void rcsv_intern_grow(struct rcsv_intern_column * column) {
+  struct rcsv_intern_entry * entries = column->entries, * slot;
+  size_t i, num_slots = column->mask + 1;
+
+  column->entries = ZALLOC_N(struct rcsv_intern_entry, num_slots * 2);
+  column->mask = num_slots * 2 - 1;
+
+  for (i = 0; i < num_slots; i++) {
+    if (entries[i].key) {
+      slot = rcsv_intern_slot(column, RSTRING_PTR(entries[i].key), (size_t)RSTRING_LEN(entries[i].key));
+      *slot = entries[i];
+    }
+  }
+
+  xfree(entries);
+}
+
+/* Converts a non-empty field of an interned column */
+static VALUE rcsv_intern_field(struct rcsv_intern_column * column, const char * field_str, size_t field_size, int encoding_index) {
+  struct rcsv_intern_entry * slot = rcsv_intern_slot(column, field_str, field_size);
+  VALUE str, value;
+
+  if (slot->key) {
+    return slot->value;
+  }
+
+  str = ENCODED_STR_NEW(field_str, field_size, encoding_index);
+  value = column->symbols ? rb_str_intern(str) : str;
+  if (column->count >= RCSV_INTERN_LIMIT) { /* Too many distinct values to be worth keeping */
+    return value;
+  }
+
+  slot->key = rb_obj_freeze(str);
+  slot->value = value;
+  column->count++;
+
+  if (column->count * 2 > column->mask) {
+    rcsv_intern_grow(column);
+  }
+
+  return value;
+}
+
+/* Converts a field into the Ruby type specified by row_conversion, or into a String if row_conversion is 0.
+   Empty fields become row_default unless it is Qundef. Strings come from intern unless it is NULL.
+   Row and column are only used in error messages. */
+static VALUE rcsv_convert_field(const char * field_str, size_t field_size, char row_conversion, VALUE row_default,
+                                bool empty_field_is_nil, int encoding_index, struct rcsv_intern_column * intern,
+                                size_t row, size_t col) {
+  VALUE parsed_field = Qnil;
+
+  if (field_size == 0) {
+    /* Assigning appropriate default value if applicable. */
+    if (row_default != Qundef) {
+      return row_default;
+    } else if (empty_field_is_nil || field_str == NULL) { /* It depends on empty_field_is_nil if we convert empty strings to nils */
+      return Qnil;
+    } else {
+      return ENCODED_STR_NEW("", 0, encoding_index);
+    }
+  }
+
+  switch (row_conversion){
+    case 0: /* No conversion happens */
+    case 's': /* String */
+      if (intern != NULL) {
+        parsed_field = rcsv_intern_field(intern, field_str, field_size, encoding_index);
+      } else {
+        parsed_field = ENCODED_STR_NEW(field_str, field_size, encoding_index);
+      }
+      break;
+    case 'i': /* Integer */
+      if (!rcsv_parse_int(field_str, field_size, &parsed_field)) {
+        RAISE_WITH_LOCATION(row, col, field_str, field_size, "Bad Integer value.");
+      }
+      break;
+    case 'f': /* Float */
+      if (!rcsv_parse_float(field_str, field_size, &parsed_field)) {
+        RAISE_WITH_LOCATION(row, col, field_str, field_size, "Bad Float value.");
+      }
+      break;
+    case 'b': /* TrueClass/FalseClass */
+      switch (field_str[0]) {
+        case 't':
+        case 'T':
+        case '1':
+          parsed_field = Qtrue;
+          break;
+        case 'f':
+        case 'F':
+        case '0':
+          parsed_field = Qfalse;
+          break;
+        default:
+          RAISE_WITH_LOCATION(
+            row,
+            col,
+            field_str,
+            field_size,
+            "Bad Boolean value. Valid values are strings where the first character is T/t/1 for true or F/f/0 for false."
+          );
+      }
+      break;
+    default:
+      RAISE_WITH_LOCATION(row, col, field_str, field_size, "Unknown deserializer '%c'.", row_conversion);
+  }
+
+  return parsed_field;
+}
+
+/* Returns the conversion char specifier of a column, 0 if there is none */
+static char rcsv_column_conversion(struct rcsv_metadata * meta, size_t col) {
+  return (col < meta->num_row_conversions) ? (char)meta->row_conversions[col] : 0;
+}
+
+/* Converts the current field as specified by :row_conversions and :row_defaults */
+static VALUE rcsv_parse_field(struct rcsv_metadata * meta, const char * field_str, size_t field_size, char row_conversion) {
+  VALUE row_default = Qundef;
+
+  if (meta->current_col < meta->num_row_defaults) {
+    row_default = meta->row_defaults[meta->current_col];
+  }
+
+  return rcsv_convert_field(field_str, field_size, row_conversion, row_default,
+                            meta->empty_field_is_nil, meta->encoding_index, rcsv_intern_column(meta->intern, meta->current_col),
+                            meta->current_row, meta->current_col);
+}
+
+/* Compiled row filters. Fields are matched against the filter values as raw bytes wherever possible,
+   so that most fields of filtered columns are never turned into Ruby objects. Anything the matchers
+   can't decide on their own is converted and compared the Ruby way. */
+
+/* Results of rcsv_filter_match() */
+#define RCSV_FILTER_NO_MATCH 0
+#define RCSV_FILTER_MATCH 1
+#define RCSV_FILTER_UNKNOWN 2 /* The field has to be converted to tell */
+
+/* Integers up to this magnitude are exactly representable as doubles */
+#define RCSV_EXACT_INTEGER 9007199254740992LL
+
+/* Returns the slot of a String in the hash set, which is either the String itself or a free slot */
+static struct rcsv_filter_string * rcsv_filter_slot(const struct rcsv_filter * filter, const char * str, size_t len) {
+  size_t i = rcsv_hash_bytes(str, len) & filter->strings_mask;
+  struct rcsv_filter_string * slot;
+
+  for (;; i = (i + 1) & filter->strings_mask) {
+    slot = &filter->strings[i];
+    if (slot->str == NULL || (slot->len == len && memcmp(slot->str, str, len) == 0)) {
+      return slot;
+    }
+  }
+}
+
+/* Copies a String into filter-owned memory */
+static void rcsv_filter_copy(struct rcsv_filter_string * target, const char * str, size_t len) {
+  target->str = (char *)malloc(len);
+  if (target->str == NULL) {
+    rb_raise(rcsv_parse_error, "No memory");
+  }
+  memcpy(target->str, str, len);
+  target->len = len;
+}
+
+/* Converts an Integer or Float into a double, returns false if that can't be done exactly */
+static bool rcsv_filter_number(VALUE value, double * result) {
+  long long integer;
+
+  if (FIXNUM_P(value)) {
+    integer = FIX2LONG(value);
+    if (integer > RCSV_EXACT_INTEGER || integer < -RCSV_EXACT_INTEGER) {
+      return false;
+    }
+    *result = (double)integer;
+    return true;
+  } else if (RB_FLOAT_TYPE_P(value)) {
+    *result = RFLOAT_VALUE(value);
+    return true;
+  }
+
+  return false;
+}
+
+/* Returns true if a Regexp is /\A.../ with a plain literal after the anchor, which is then stored as a prefix */
+static bool rcsv_filter_prefix(struct rcsv_filter * filter, VALUE regexp) {
+  VALUE source = rb_funcall(regexp, rb_intern("source"), 0);
+  const char * str = RSTRING_PTR(source);
+  long i, len = RSTRING_LEN(source);
+
+  if (rb_reg_options(regexp) & (ONIG_OPTION_IGNORECASE | ONIG_OPTION_EXTEND | ONIG_OPTION_MULTILINE)) {
+    return false;
+  }
+
+  if (len < 3 || str[0] != '\\' || str[1] != 'A') {
+    return false;
+  }
+
+  for (i = 2; i < len; i++) {
+    if (!ISALNUM(str[i]) && strchr(" _-,:;/@%=<>!'\"&~`", str[i]) == NULL) {
+      return false;
+    }
+  }
+
+  rcsv_filter_copy(&filter->prefixes[filter->num_prefixes++], str + 2, (size_t)(len - 2));
+  return true;
+}
+
+/* Adds a filter value to the matchers of a column */
+static void rcsv_filter_add(struct rcsv_filter * filter, VALUE value, int encoding_index) {
+  struct rcsv_filter_string * slot;
+  struct rcsv_filter_range * range;
+  VALUE first, last;
+  int exclude_end;
+  double number;
+
+  if (value == Qtrue) {
+    filter->match_true = true;
+  } else if (value == Qfalse) {
+    filter->match_false = true;
+  } else if (value == Qnil) {
+    /* Only empty fields can become nil, and those are always converted */
+  } else if (RB_TYPE_P(value, T_STRING)) {
+#ifdef HAVE_RUBY_ENCODING_H
+    /* Non-ASCII Strings are only equal to fields of the same encoding */
+    if (!rb_enc_str_asciionly_p(value) &&
+        ENCODING_GET(value) != (encoding_index == -1 ? rb_ascii8bit_encindex() : encoding_index)) {
+      filter->strings_exact = false;
+      return;
+    }
+#endif
+    if (RSTRING_LEN(value) > 0) {
+      slot = rcsv_filter_slot(filter, RSTRING_PTR(value), (size_t)RSTRING_LEN(value));
+      if (slot->str == NULL) {
+        rcsv_filter_copy(slot, RSTRING_PTR(value), (size_t)RSTRING_LEN(value));
+      }
+    }
+  } else if (RB_TYPE_P(value, T_REGEXP)) {
+    if (!rcsv_filter_prefix(filter, value)) {
+      filter->strings_exact = false;
+    }
+  } else if (RB_FLOAT_TYPE_P(value) && isnan(RFLOAT_VALUE(value))) {
+    /* NaN isn't equal to anything */
+  } else if (rcsv_filter_number(value, &number)) {
+    filter->numbers[filter->num_numbers++] = number;
+  } else if (rb_range_values(value, &first, &last, &exclude_end) == Qtrue) {
+    range = &filter->ranges[filter->num_ranges];
+    if ((first == Qnil || rcsv_filter_number(first, &range->first)) &&
+        (last == Qnil || rcsv_filter_number(last, &range->last)) &&
+        (first != Qnil || last != Qnil)) {
+      if (first == Qnil) {
+        range->first = -HUGE_VAL;
+      }
+      if (last == Qnil) {
+        range->last = HUGE_VAL;
+      }
+      range->exclude_end = exclude_end && last != Qnil;
+      filter->num_ranges++;
+    } else { /* Ranges of Strings, Bignums and alike */
+      filter->strings_exact = false;
+      filter->numbers_exact = false;
+    }
+  } else { /* Bignums */
+    filter->numbers_exact = false;
+  }
+}
+
+static int rcsv_compare_doubles(const void * a, const void * b) {
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* Compiles the filter values of a column. The filter has to be zeroed beforehand. */
+static void rcsv_filter_compile(struct rcsv_filter * filter, VALUE values, char row_conversion, int encoding_index) {
+  size_t i, num_values = (size_t)RARRAY_LEN(values), num_slots = 4;
+
+  filter->values = values;
+  filter->row_conversion = row_conversion;
+  filter->strings_exact = true;
+  filter->numbers_exact = true;
+
+  while (num_slots < num_values * 2) {
+    num_slots *= 2;
+  }
+
+  filter->strings = (struct rcsv_filter_string *)calloc(num_slots, sizeof(struct rcsv_filter_string));
+  filter->strings_mask = num_slots - 1;
+  filter->prefixes = (struct rcsv_filter_string *)calloc(num_values + 1, sizeof(struct rcsv_filter_string));
+  filter->numbers = (double *)malloc((num_values + 1) * sizeof(double));
+  filter->ranges = (struct rcsv_filter_range *)malloc((num_values + 1) * sizeof(struct rcsv_filter_range));
+  if (filter->strings == NULL || filter->prefixes == NULL || filter->numbers == NULL || filter->ranges == NULL) {
+    rb_raise(rcsv_parse_error, "No memory");
+  }
+
+  for (i = 0; i < num_values; i++) {
+    rcsv_filter_add(filter, rb_ary_entry(values, (long)i), encoding_index);
+  }
+
+  qsort(filter->numbers, filter->num_numbers, sizeof(double), rcsv_compare_doubles);
+}
+
+static void rcsv_filter_free(struct rcsv_filter * filter) {
+  size_t i;
+
+  if (filter->strings != NULL) {
+    for (i = 0; i <= filter->strings_mask; i++) {
+      free(filter->strings[i].str);
+    }
+    free(filter->strings);
+  }
+
+  if (filter->prefixes != NULL) {
+    for (i = 0; i < filter->num_prefixes; i++) {
+      free(filter->prefixes[i].str);
+    }
+    free(filter->prefixes);
+  }
+
+  free(filter->numbers);
+  free(filter->ranges);
+}
+
+/* Returns true if a number is equal to a filter value or covered by a filter Range */
+static bool rcsv_filter_number_match(const struct rcsv_filter * filter, double number) {
+  size_t low = 0, high = filter->num_numbers, middle, i;
+  const struct rcsv_filter_range * range;
+
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    if (filter->numbers[middle] < number) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  if (low < filter->num_numbers && filter->numbers[low] == number) {
+    return true;
+  }
+
+  for (i = 0; i < filter->num_ranges; i++) {
+    range = &filter->ranges[i];
+    if (range->first <= number && (range->exclude_end ? number < range->last : number <= range->last)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Matches a raw field against compiled filter values. Doesn't touch Ruby objects, so that libcsv can call it
+   without the GVL. Empty fields are left to row_defaults and conversions. */
+static int rcsv_filter_match(const struct rcsv_filter * filter, const char * field_str, size_t field_size) {
+  int64_t integer;
+  double number;
+  size_t i;
+
+  if (field_str == NULL || field_size == 0) {
+    return RCSV_FILTER_UNKNOWN;
+  }
+
+  switch (filter->row_conversion) {
+    case 0:
+    case 's':
+      if (rcsv_filter_slot(filter, field_str, field_size)->str != NULL) {
+        return RCSV_FILTER_MATCH;
+      }
+
+      for (i = 0; i < filter->num_prefixes; i++) {
+        if (filter->prefixes[i].len <= field_size &&
+            memcmp(filter->prefixes[i].str, field_str, filter->prefixes[i].len) == 0) {
+          return RCSV_FILTER_MATCH;
+        }
+      }
+
+      return filter->strings_exact ? RCSV_FILTER_NO_MATCH : RCSV_FILTER_UNKNOWN;
+    case 'i':
+      if (rcsv_scan_int(field_str, field_size, &integer) != RCSV_NUMBER_VALID ||
+          integer > RCSV_EXACT_INTEGER || integer < -RCSV_EXACT_INTEGER) {
+        return RCSV_FILTER_UNKNOWN;
+      }
+      number = (double)integer;
+      break;
+    case 'f':
+      if (rcsv_scan_float(field_str, field_size, &number) != RCSV_NUMBER_VALID) {
+        return RCSV_FILTER_UNKNOWN;
+      }
+      break;
+    case 'b':
+      switch (field_str[0]) {
+        case 't':
+        case 'T':
+        case '1':
+          return filter->match_true ? RCSV_FILTER_MATCH : RCSV_FILTER_NO_MATCH;
+        case 'f':
+        case 'F':
+        case '0':
+          return filter->match_false ? RCSV_FILTER_MATCH : RCSV_FILTER_NO_MATCH;
+        default:
+          return RCSV_FILTER_UNKNOWN;
+      }
+    default:
+      return RCSV_FILTER_UNKNOWN;
+  }
+
+  if (rcsv_filter_number_match(filter, number)) {
+    return RCSV_FILTER_MATCH;
+  }
+
+  return filter->numbers_exact ? RCSV_FILTER_NO_MATCH : RCSV_FILTER_UNKNOWN;
+}
+
+/* Compares a converted field with filter values: Ranges match what they cover, Regexps match Strings
+   and everything else has to be equal */
+static bool rcsv_filter_includes(VALUE values, VALUE parsed_field) {
+  long i;
+  VALUE value;
+
+  for (i = 0; i < RARRAY_LEN(values); i++) {
+    value = RARRAY_AREF(values, i);
+    if (RB_TYPE_P(value, T_REGEXP)) {
+      if (RB_TYPE_P(parsed_field, T_STRING) && rb_reg_match(value, parsed_field) != Qnil) {
+        return true;
+      }
+    } else if (rb_obj_is_kind_of(value, rb_cRange)) {
+      if (RTEST(rb_funcall(value, rb_intern("==="), 1, parsed_field))) {
+        return true;
+      }
+    } else if (rb_equal(value, parsed_field)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Returns true if a field is matched by a compiled filter, converting it into *parsed_field if necessary */
+static bool rcsv_filter_matches(struct rcsv_metadata * meta, const struct rcsv_filter * filter,
+                                const char * field_str, size_t field_size, char row_conversion, VALUE * parsed_field) {
+  switch (rcsv_filter_match(filter, field_str, field_size)) {
+    case RCSV_FILTER_MATCH:
+      return true;
+    case RCSV_FILTER_NO_MATCH:
+      return false;
+    default:
+      if (*parsed_field == Qundef) {
+        *parsed_field = rcsv_parse_field(meta, field_str, field_size, row_conversion);
+      }
+      return rcsv_filter_includes(filter->values, *parsed_field);
+  }
+}
+
+/* Checks the current field against :only_rows and :except_rows, returns true if the row should be skipped.
+   The field is only converted into *parsed_field if the raw bytes aren't enough to tell. */
+static bool rcsv_filter_field(struct rcsv_metadata * meta, const char * field_str, size_t field_size,
+                              char row_conversion, VALUE * parsed_field) {
+  /* Filter by row values listed in meta->only_rows */
+  if ((meta->only_rows != NULL) &&
+      (meta->current_col < meta->num_only_rows) &&
+      (meta->only_rows[meta->current_col].values != Qnil) &&
+      (!rcsv_filter_matches(meta, &meta->only_rows[meta->current_col], field_str, field_size, row_conversion, parsed_field))) {
+    return true;
+  }
+
+  /* Filter out by row values listed in meta->except_rows */
+  if ((meta->except_rows != NULL) &&
+      (meta->current_col < meta->num_except_rows) &&
+      (meta->except_rows[meta->current_col].values != Qnil) &&
+      (rcsv_filter_matches(meta, &meta->except_rows[meta->current_col], field_str, field_size, row_conversion, parsed_field))) {
+    return true;
+  }
+
+  return false;
+}
+
+/* libcsv filter that rejects rows while they're being collected into batches, so that the rest of a rejected
+   row is skipped without being copied. Runs without the GVL, so only rows the raw bytes decide on are rejected;
+   end_of_field_callback() takes care of the others. */
+static int rcsv_reject_raw_field(const void * field, size_t field_size, size_t column, void * data) {
+  struct rcsv_metadata * meta = (struct rcsv_metadata *)data;
+
+  if (column < meta->num_only_rows && meta->only_rows[column].values != Qnil &&
+      rcsv_filter_match(&meta->only_rows[column], (const char *)field, field_size) == RCSV_FILTER_NO_MATCH) {
+    return 1;
+  }
+
+  if (column < meta->num_except_rows && meta->except_rows[column].values != Qnil &&
+      rcsv_filter_match(&meta->except_rows[column], (const char *)field, field_size) == RCSV_FILTER_MATCH) {
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Lazy rows. Raw fields of every row are appended to a backing String shared with neighbouring rows,
+   and the row only keeps their end offsets. Ruby objects are created on first access and cached. */
+
+/* Parse options that rows need in order to convert their fields after the parse is over */
+struct rcsv_row_layout {
+  VALUE row_conversions;      /* Frozen String of row conversion char specifiers, or Qnil */
+  VALUE row_defaults;         /* Frozen Array of row defaults, or Qnil */
+  VALUE column_names;         /* Frozen Array of column names, or Qnil */
+  VALUE column_positions;     /* Hash of column name => field position, or Qnil */
+  long * columns;             /* Column index of every field position within row_conversions */
+  long num_kept_columns;      /* Number of columns within row_conversions that aren't skipped */
+  VALUE intern;               /* Dictionaries of interned columns shared with the parse, or Qnil */
+  bool empty_field_is_nil;
+  int encoding_index;
+};
+
+struct rcsv_row {
+  VALUE layout;               /* Layout of the parse the row comes from */
+  VALUE buffer;               /* Backing String with raw fields */
+  VALUE * values;             /* Fields converted so far, Qundef for the rest. NULL until the first access. */
+  size_t offset;              /* Where the row starts in buffer */
+  size_t index;               /* Row index in the input, used in error messages */
+  long num_fields;
+  uint32_t ends[];            /* Field end offsets relative to offset, RCSV_ROW_NULL is set for NULL fields */
+};
+
+static void rcsv_row_layout_mark(void * data) {
+  struct rcsv_row_layout * layout = (struct rcsv_row_layout *)data;
+
+  rb_gc_mark(layout->row_conversions);
+  rb_gc_mark(layout->row_defaults);
+  rb_gc_mark(layout->column_names);
+  rb_gc_mark(layout->column_positions);
+  rb_gc_mark(layout->intern);
+}
+
+static void rcsv_row_layout_free(void * data) {
+  struct rcsv_row_layout * layout = (struct rcsv_row_layout *)data;
+
+  xfree(layout->columns);
+  xfree(layout);
+}
+
+static const rb_data_type_t rcsv_row_layout_type = {
+  "rcsv_row_layout",
+  { rcsv_row_layout_mark, rcsv_row_layout_free, NULL, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static void rcsv_row_mark(void * data) {
+  struct rcsv_row * row = (struct rcsv_row *)data;
+
+  rb_gc_mark(row->layout);
+  rb_gc_mark(row->buffer);
+  if (row->values != NULL) {
+    rb_gc_mark_locations(row->values, row->values + row->num_fields);
+  }
+}
+
+static void rcsv_row_free(void * data) {
+  struct rcsv_row * row = (struct rcsv_row *)data;
+
+  xfree(row->values);
+  xfree(row);
+}
+
+static size_t rcsv_row_memsize(const void * data) {
+  const struct rcsv_row * row = (const struct rcsv_row *)data;
+
+  return sizeof(struct rcsv_row) + row->num_fields * (sizeof(uint32_t) + (row->values != NULL ? sizeof(VALUE) : 0));
+}
+
+static const rb_data_type_t rcsv_row_type = {
+  "rcsv_row",
+  { rcsv_row_mark, rcsv_row_free, rcsv_row_memsize, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/* Builds the layout of lazy rows from raw_parse options */
+static VALUE rcsv_row_layout_new(VALUE options, struct rcsv_metadata * meta) {
+  struct rcsv_row_layout * layout;
+  VALUE self = TypedData_Make_Struct(0, struct rcsv_row_layout, &rcsv_row_layout_type, layout);
+  VALUE option, name;
+  const char * row_conversions = NULL;
+  long i, num_row_conversions = 0, position = 0;
+
+  layout->row_conversions = Qnil;
+  layout->row_defaults = Qnil;
+  layout->column_names = Qnil;
+  layout->column_positions = Qnil;
+  layout->intern = meta->intern;
+  layout->empty_field_is_nil = meta->empty_field_is_nil;
+  layout->encoding_index = meta->encoding_index;
+
   option = rb_hash_aref(options, ID2SYM(rb_intern("row_conversions")));
   if (option != Qnil) {
-    meta->num_row_conversions = RSTRING_LEN(option);
-    meta->row_conversions = StringValuePtr(option);
+    layout->row_conversions = rb_str_new_frozen(option);
+    row_conversions = RSTRING_PTR(layout->row_conversions);
+    num_row_conversions = RSTRING_LEN(layout->row_conversions);
+  }
+
+  option = rb_hash_aref(options, ID2SYM(rb_intern("row_defaults")));
+  if (option != Qnil) {
+    layout->row_defaults = rb_ary_freeze(rb_ary_dup(option));
+  }
+
+  /* Fields of skipped columns aren't stored, so field positions and column indexes differ */
+  layout->columns = ALLOC_N(long, num_row_conversions);
+  for (i = 0; i < num_row_conversions; i++) {
+    if (row_conversions[i] != ' ') {
+      layout->columns[layout->num_kept_columns++] = i;
+    }
+  }
+
+  option = rb_hash_aref(options, ID2SYM(rb_intern("column_names")));
+  if (option != Qnil) {
+    layout->column_names = rb_ary_freeze(rb_ary_dup(option));
+    layout->column_positions = rb_hash_new();
+
+    for (i = 0; i < RARRAY_LEN(layout->column_names); i++) {
+      if (i < num_row_conversions && row_conversions[i] == ' ') {
+        continue;
+      }
+
+      name = RARRAY_AREF(layout->column_names, i);
+      if (name != Qnil) {
+        rb_hash_aset(layout->column_positions, name, LONG2NUM(position));
+      }
+      position++;
+    }
+  }
+
+  return self;
+}
+
+/* Returns the column index of a field position */
+static long rcsv_row_column(struct rcsv_row_layout * layout, long position) {
+  if (position < layout->num_kept_columns) {
+    return layout->columns[position];
+  }
+
+  return position - layout->num_kept_columns + (layout->row_conversions == Qnil ? 0 : RSTRING_LEN(layout->row_conversions));
+}
+
+/* Appends a raw field to the backing String of the current lazy row */
+static void rcsv_append_lazy_field(struct rcsv_metadata * meta, const char * field_str, size_t field_size) {
+  uint32_t * row_ends;
+  size_t end;
+
+  if (meta->num_row_ends == meta->row_ends_size) {
+    row_ends = (uint32_t *)realloc(meta->row_ends, (meta->row_ends_size * 2 + 16) * sizeof(uint32_t));
+    if (row_ends == NULL) {
+      rb_raise(rcsv_parse_error, "No memory");
+    }
+    meta->row_ends = row_ends;
+    meta->row_ends_size = meta->row_ends_size * 2 + 16;
+  }
+
+  if (field_size > 0) {
+    rb_str_cat(meta->row_buffer, field_str, (long)field_size);
+  }
+
+  end = (size_t)RSTRING_LEN(meta->row_buffer) - meta->row_offset;
+  if (end >= RCSV_ROW_NULL) {
+    RAISE_WITH_LOCATION(meta->current_row, meta->current_col, field_str, field_size, "The row is too large for :lazy_rows.");
+  }
+
+  meta->row_ends[meta->num_row_ends++] = (uint32_t)end | (field_str == NULL ? RCSV_ROW_NULL : 0);
+}
+
+/* Finishes the current lazy row. Returns the new Rcsv::Row, or Qnil if the row has been filtered out. */
+static VALUE rcsv_end_lazy_row(struct rcsv_metadata * meta, bool skipped) {
+  struct rcsv_row * row;
+  VALUE self = Qnil;
+
+  if (skipped) {
+    rb_str_set_len(meta->row_buffer, (long)meta->row_offset);
+  } else {
+    row = (struct rcsv_row *)xmalloc(sizeof(struct rcsv_row) + meta->num_row_ends * sizeof(uint32_t));
+    row->layout = meta->row_layout;
+    row->buffer = meta->row_buffer;
+    row->values = NULL;
+    row->offset = meta->row_offset;
+    row->index = meta->current_row;
+    row->num_fields = (long)meta->num_row_ends;
+    memcpy(row->ends, meta->row_ends, meta->num_row_ends * sizeof(uint32_t));
+    self = TypedData_Wrap_Struct(rcsv_row_class, &rcsv_row_type, row);
+
+    /* Rows keep the full buffer alive, which is then frozen and never appended to again */
+    if (RSTRING_LEN(meta->row_buffer) >= RCSV_ROW_BUFFER_SIZE) {
+      rb_obj_freeze(meta->row_buffer);
+      meta->row_buffer = rb_str_buf_new(RCSV_ROW_BUFFER_SIZE);
+    }
+  }
+
+  meta->row_offset = (size_t)RSTRING_LEN(meta->row_buffer);
+  meta->num_row_ends = 0;
+  return self;
+}
+
+/* Returns the field at a position, converting and caching it on first access */
+static VALUE rcsv_row_field(struct rcsv_row * row, long position) {
+  struct rcsv_row_layout * layout = (struct rcsv_row_layout *)RTYPEDDATA_DATA(row->layout);
+  size_t start, end;
+  long i, column;
+  char row_conversion = 0;
+  VALUE row_default = Qundef;
+
+  if (row->values == NULL) {
+    row->values = ALLOC_N(VALUE, row->num_fields);
+    for (i = 0; i < row->num_fields; i++) {
+      row->values[i] = Qundef;
+    }
+  }
+
+  if (row->values[position] == Qundef) {
+    start = (position == 0) ? 0 : (row->ends[position - 1] & ~RCSV_ROW_NULL);
+    end = row->ends[position] & ~RCSV_ROW_NULL;
+    column = rcsv_row_column(layout, position);
+
+    if (layout->row_conversions != Qnil && column < RSTRING_LEN(layout->row_conversions)) {
+      row_conversion = RSTRING_PTR(layout->row_conversions)[column];
+    }
+
+    if (layout->row_defaults != Qnil && column < RARRAY_LEN(layout->row_defaults)) {
+      row_default = RARRAY_AREF(layout->row_defaults, column);
+    }
+
+    row->values[position] = rcsv_convert_field(
+      (row->ends[position] & RCSV_ROW_NULL) ? NULL : RSTRING_PTR(row->buffer) + row->offset + start,
+      end - start,
+      row_conversion,
+      row_default,
+      layout->empty_field_is_nil,
+      layout->encoding_index,
+      rcsv_intern_column(layout->intern, (size_t)column),
+      row->index,
+      (size_t)column
+    );
+  }
+
+  return row->values[position];
+}
+
+/* Filter rows need to be either nil or Arrays of Strings/bools/nil/numbers/Ranges/Regexps, so we validate this here */
+VALUE validate_filter_row(const char * filter_name, VALUE row) {
+  if (row == Qnil) {
+    return Qnil;
+  } else if (TYPE(row) == T_ARRAY) {
+    size_t j;
+    for (j = 0; j < (size_t)RARRAY_LEN(row); j++) {
+      switch (TYPE(rb_ary_entry(row, j))) {
+        case T_NIL:
+        case T_TRUE:
+        case T_FALSE:
+        case T_FLOAT:
+        case T_FIXNUM:
+        case T_BIGNUM:
+        case T_REGEXP:
+        case T_STRING:
+          break;
+        default:
+          if (rb_obj_is_kind_of(rb_ary_entry(row, j), rb_cRange)) {
+            break;
+          }
+          rb_raise(rcsv_parse_error,
+            ":%s can only accept nil or Array consisting of String, boolean, number, Range, Regexp or nil elements, but %s was provided.",
+            filter_name, RSTRING_PTR(rb_inspect(row)));
+      }
+    }
+    return row;
+  } else {
+    rb_raise(rcsv_parse_error,
+      ":%s can only accept nil or Array as an element, but %s was provided.",
+      filter_name, RSTRING_PTR(rb_inspect(row)));
+  }
+}
+
+/* Sets up column options: conversions, defaults, interning, filters, column names and row classes.
+   Called before parsing starts, or once the first row has been read if there is :configure. */
+static void rcsv_configure(struct rcsv_metadata * meta) {
+  VALUE options = meta->options;
+  VALUE option;
+  size_t i;
+
+  /* :row_defaults is an array of default values that are assigned to fields containing empty strings
+     according to matching field positions */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("row_defaults")));
+  if (option != Qnil) {
+    meta->num_row_defaults = RARRAY_LEN(option);
+    meta->row_defaults = (VALUE*)calloc(meta->num_row_defaults, sizeof(VALUE));
+
+    for (i = 0; i < meta->num_row_defaults; i++) {
+      VALUE row_default = rb_ary_entry(option, i);
+      meta->row_defaults[i] = row_default;
+    }
+  }
+
+  /* :intern makes String columns return the same frozen String (true) or Symbol (:symbol) for repeated values */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("intern")));
+  if (option != Qnil) {
+    meta->intern = rcsv_intern_new(option);
+  }
+
+  /* :row_conversions specifies Ruby types that CSV field values should be converted into.
+     Each char of row_conversions string represents Ruby type for CSV field with matching position. */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("row_conversions")));
+  if (option != Qnil) {
+    meta->num_row_conversions = RSTRING_LEN(option);
+    meta->row_conversions = StringValuePtr(option);
+
+    /* Skipped columns are only scanned by libcsv, they are neither copied nor passed to callbacks */
+    if (memchr(meta->row_conversions, ' ', meta->num_row_conversions) != NULL) {
+      meta->column_mask = (unsigned char *)malloc(meta->num_row_conversions);
+      if (meta->column_mask == NULL) {
+        rb_raise(rcsv_parse_error, "No memory");
+      }
+
+      for (i = 0; i < meta->num_row_conversions; i++) {
+        meta->column_mask[i] = (meta->row_conversions[i] != ' ');
+      }
+      csv_set_columns(meta->parser, meta->column_mask, meta->num_row_conversions);
+    }
+  }
+
+  /* :only_rows is a list of values where row is only parsed
+     if its fields match those in the passed array.
+     [nil, nil, ["ABC", nil, 1]] skips all rows where 3rd column isn't equal to "ABC", nil or 1.
+     Filters are compiled per column, so they have to be parsed after :row_conversions. */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("only_rows")));
+  if (option != Qnil) {
+    meta->num_only_rows = (size_t)RARRAY_LEN(option);
+    meta->only_rows = (struct rcsv_filter *)calloc(meta->num_only_rows, sizeof(struct rcsv_filter));
+    if (meta->only_rows == NULL) {
+      rb_raise(rcsv_parse_error, "No memory");
+    }
+
+    for (i = 0; i < meta->num_only_rows; i++) {
+      VALUE only_row = validate_filter_row("only_rows", rb_ary_entry(option, i));
+      meta->only_rows[i].values = Qnil;
+      if (only_row != Qnil) {
+        rcsv_filter_compile(&meta->only_rows[i], only_row, rcsv_column_conversion(meta, i), meta->encoding_index);
+      }
+    }
+  }
+
+  /* :except_rows is a list of values where row is only parsed
+     if its fields don't match those in the passed array.
+     [nil, nil, ["ABC", nil, 1]] skips all rows where 3rd column is equal to "ABC", nil or 1 */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("except_rows")));
+  if (option != Qnil) {
+    meta->num_except_rows = (size_t)RARRAY_LEN(option);
+    meta->except_rows = (struct rcsv_filter *)calloc(meta->num_except_rows, sizeof(struct rcsv_filter));
+    if (meta->except_rows == NULL) {
+      rb_raise(rcsv_parse_error, "No memory");
+    }
+
+    for (i = 0; i < meta->num_except_rows; i++) {
+      VALUE except_row = validate_filter_row("except_rows", rb_ary_entry(option, i));
+      meta->except_rows[i].values = Qnil;
+      if (except_row != Qnil) {
+        rcsv_filter_compile(&meta->except_rows[i], except_row, rcsv_column_conversion(meta, i), meta->encoding_index);
+      }
+    }
+  }
+
+ /* Column names should be declared explicitly when parsing fields as Hashes */
+  if (meta->row_as_hash && meta->result_columns == Qnil) { /* Only matters for hash results */
+    option = rb_hash_aref(options, ID2SYM(rb_intern("column_names")));
+    if (option == Qnil) {
+      rb_raise(rcsv_parse_error, ":row_as_hash requires :column_names to be set.");
+    } else {
+      meta->num_columns = (size_t)RARRAY_LEN(option);
+      meta->column_names = (VALUE*)calloc(meta->num_columns, sizeof(VALUE));
+
+      /* String keys are deduplicated up front, so that Hashes don't have to copy them for every row */
+      for (i = 0; i < meta->num_columns; i++) {
+        meta->column_names[i] = rb_ary_entry(option, i);
+        if (RB_TYPE_P(meta->column_names[i], T_STRING)) {
+          meta->column_names[i] = rb_funcall(meta->column_names[i], rb_intern("-@"), 0);
+        }
+      }
+    }
+  }
+
+  /* :row_class builds rows by passing their fields to row_class.new, Struct and Data classes are typical */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("row_class")));
+  if (option != Qnil) {
+    if (meta->row_as_hash || meta->result_columns != Qnil) {
+      rb_raise(rcsv_parse_error, ":row_class can't be combined with :row_as_hash or :result => :columns.");
+    } else if (!RB_TYPE_P(option, T_CLASS) || !rb_respond_to(option, rb_intern("members"))) {
+      rb_raise(rcsv_parse_error, ":row_class has to be a Struct or Data class, but %s was provided.",
+               RSTRING_PTR(rb_inspect(option)));
+    }
+
+    meta->row_class = option;
+    meta->row_class_is_struct = RTEST(rb_class_inherited_p(option, rb_cStruct));
+    meta->num_row_members = RARRAY_LEN(rb_funcall(option, rb_intern("members"), 0));
+  }
+
+  /* Columnar results are keyed by :column_names where available, and by column positions otherwise */
+  if (meta->result_columns != Qnil) {
+    option = rb_hash_aref(options, ID2SYM(rb_intern("column_names")));
+    if (option != Qnil) {
+      meta->num_columns = (size_t)RARRAY_LEN(option);
+      meta->column_names = (VALUE*)calloc(meta->num_columns, sizeof(VALUE));
+
+      for (i = 0; i < meta->num_columns; i++) {
+        meta->column_names[i] = rb_ary_entry(option, i);
+      }
+    }
+  }
+
+  /* :lazy_rows returns Rcsv::Row objects that only convert fields on access */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("lazy_rows")));
+  if (RTEST(option)) {
+    if (meta->result_columns != Qnil || meta->row_class != Qnil) {
+      rb_raise(rcsv_parse_error, ":lazy_rows can't be combined with :result => :columns or :row_class.");
+    }
+    meta->row_layout = rcsv_row_layout_new(options, meta);
+    meta->row_buffer = rb_str_buf_new(RCSV_ROW_BUFFER_SIZE);
+  }
+
+  /* Rows that compiled filters can reject by raw bytes alone are skipped by libcsv */
+  if (meta->only_rows != NULL || meta->except_rows != NULL) {
+    csv_set_filter(meta->parser, &rcsv_reject_raw_field, meta);
+  }
+}
+
+/* This procedure is called for every parsed field */
+void end_of_field_callback(void * field, size_t field_size, void * data) {
+  const char * field_str = (char *)field;
+  struct rcsv_metadata * meta = (struct rcsv_metadata *) data;
+  char row_conversion = 0;
+  VALUE parsed_field = Qundef;
+
+  /* No need to parse anything until the end of the line if skip_current_row is set */
+  if (meta->skip_current_row) {
+    return;
+  }
+
+  /* Fields of the first row are kept as they are until :configure has set column options up */
+  if (meta->configure != Qnil) {
+    rb_ary_push(meta->header, (field_str == NULL) ? Qnil : rb_str_new(field_str, (long)field_size));
+    return;
+  }
+
+  /* libcsv doesn't pass fields of skipped columns on */
+  while (meta->column_mask != NULL && meta->current_col < meta->num_row_conversions && !meta->column_mask[meta->current_col]) {
+    meta->current_col++;
+  }
+
+  /* Skip the row if its position is less than specifed offset, or past the limit */
+  if (meta->current_row < meta->offset_rows || meta->current_row >= meta->end_row) {
+    meta->skip_current_row = true;
+    return;
+  }
+
+  /* Get row conversion char specifier */
+  row_conversion = rcsv_column_conversion(meta, meta->current_col);
+
+  /* Convert the field from string into Ruby type specified by row_conversion */
+  if (row_conversion != ' ') { /* spacebar skips the column */
+    if (rcsv_filter_field(meta, field_str, field_size, row_conversion, &parsed_field)) {
+      meta->skip_current_row = true;
+      return;
+    }
+
+    /* Lazy rows only keep the raw field, even if filters had to convert it */
+    if (meta->row_layout != Qnil) {
+      rcsv_append_lazy_field(meta, field_str, field_size);
+      meta->current_col++;
+      return;
+    }
+
+    if (parsed_field == Qundef) {
+      parsed_field = rcsv_parse_field(meta, field_str, field_size, row_conversion);
+    }
+
+    /* Append the value to its column, or assign it to appropriate hash key if parsing into Hash */
+    if (meta->result_columns != Qnil) {
+      rcsv_append_column_value(meta, parsed_field);
+    } else if (meta->row_as_hash) {
+      if (meta->current_col >= meta->num_columns) {
+        RAISE_WITH_LOCATION(
+          meta->current_row,
+          meta->current_col,
+          field_str,
+          field_size,
+          "There are at least %d columns in a row, which is beyond the number of provided column names (%d).",
+          (int)meta->current_col + 1,
+          (int)meta->num_columns
+        );
+      } else {
+        /* Hashes are built in one go once the row is complete */
+        rb_ary_push(meta->last_entry, meta->column_names[meta->current_col]);
+        rb_ary_push(meta->last_entry, parsed_field);
+      }
+    } else { /* Parse into Array */
+      if (meta->row_class != Qnil && RARRAY_LEN(meta->last_entry) >= meta->num_row_members) {
+        RAISE_WITH_LOCATION(
+          meta->current_row,
+          meta->current_col,
+          field_str,
+          field_size,
+          "There are at least %d columns in a row, which is beyond the number of :row_class members (%d).",
+          (int)RARRAY_LEN(meta->last_entry) + 1,
+          (int)meta->num_row_members
+        );
+      }
+      rb_ary_push(meta->last_entry, parsed_field); /* last_entry << field */
+    }
+  }
+
+  /* Increment column counter */
+  meta->current_col++;
+  return;
+}
+
+/* Returns true if libcsv leaves fields of a column out */
+static bool rcsv_column_skipped(struct rcsv_metadata * meta, size_t col) {
+  return meta->column_mask != NULL && col < meta->num_row_conversions && !meta->column_mask[col];
+}
+
+/* Copies column options set up by rcsv_configure(), the arrays they point to are shared */
+static void rcsv_copy_configuration(struct rcsv_metadata * dst, const struct rcsv_metadata * src) {
+  dst->row_conversions = src->row_conversions;
+  dst->num_row_conversions = src->num_row_conversions;
+  dst->column_mask = src->column_mask;
+  dst->only_rows = src->only_rows;
+  dst->num_only_rows = src->num_only_rows;
+  dst->except_rows = src->except_rows;
+  dst->num_except_rows = src->num_except_rows;
+  dst->row_defaults = src->row_defaults;
+  dst->num_row_defaults = src->num_row_defaults;
+  dst->column_names = src->column_names;
+  dst->num_columns = src->num_columns;
+  dst->intern = src->intern;
+  dst->row_class = src->row_class;
+  dst->row_class_is_struct = src->row_class_is_struct;
+  dst->num_row_members = src->num_row_members;
+  dst->row_layout = src->row_layout;
+  dst->options = src->options;
+}
+
+/* Checks whether the plan has column options for the header that has just been read */
+static bool rcsv_plan_matches(struct rcsv_plan * plan, struct rcsv_metadata * meta) {
+  VALUE field, compiled_field;
+  long i;
+
+  if (!plan->is_compiled || plan->compiled.encoding_index != meta->encoding_index ||
+      RARRAY_LEN(plan->header) != RARRAY_LEN(meta->header)) {
+    return false;
+  }
+
+  for (i = 0; plan->header_fields && i < RARRAY_LEN(meta->header); i++) {
+    field = RARRAY_AREF(meta->header, i);
+    compiled_field = RARRAY_AREF(plan->header, i);
+    if ((field == Qnil || compiled_field == Qnil) ? field != compiled_field :
+        RSTRING_LEN(field) != RSTRING_LEN(compiled_field) ||
+        memcmp(RSTRING_PTR(field), RSTRING_PTR(compiled_field), RSTRING_LEN(field)) != 0) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Sets the parse up with the column options of the plan instead of calling :configure */
+static void rcsv_plan_install(struct rcsv_plan * plan, struct rcsv_metadata * meta) {
+  rcsv_copy_configuration(meta, &plan->compiled);
+  meta->shared_configuration = true;
+
+  if (meta->column_mask != NULL) {
+    csv_set_columns(meta->parser, meta->column_mask, meta->num_row_conversions);
+  }
+
+  if (meta->row_layout != Qnil) {
+    meta->row_buffer = rb_str_buf_new(RCSV_ROW_BUFFER_SIZE);
+  }
+
+  if (meta->only_rows != NULL || meta->except_rows != NULL) {
+    csv_set_filter(meta->parser, &rcsv_reject_raw_field, meta);
+  }
+}
+
+/* Passes the fields of the first row to :configure and sets up the options it returns. The first row is then
+   parsed as usual, so :offset_rows decides whether it is a header or data. */
+static void rcsv_end_header(struct rcsv_metadata * meta) {
+  VALUE configure = meta->configure;
+  VALUE fields, field, configured;
+  long i;
+
+  meta->configure = Qnil;
+
+  /* Compiled plans set up column options once for every header */
+  if (meta->plan != NULL && rcsv_plan_matches(meta->plan, meta)) {
+    rcsv_plan_install(meta->plan, meta);
+  } else {
+    fields = rb_ary_new_capa(RARRAY_LEN(meta->header));
+    for (i = 0; i < RARRAY_LEN(meta->header); i++) {
+      field = RARRAY_AREF(meta->header, i);
+      rb_ary_push(fields, (field == Qnil) ? Qnil :
+                  rcsv_convert_field(RSTRING_PTR(field), (size_t)RSTRING_LEN(field), 0, Qundef,
+                                     meta->empty_field_is_nil, meta->encoding_index, NULL, 0, (size_t)i));
+    }
+
+    configured = rb_funcall(configure, rb_intern("call"), 1, fields);
+    if (configured != Qnil) {
+      meta->options = rb_funcall(meta->options, rb_intern("merge"), 1, rb_convert_type(configured, T_HASH, "Hash", "to_hash"));
+    }
+    rcsv_configure(meta);
+  }
+
+  /* libcsv would have rejected the row if the raw filter does, without passing any of its fields on */
+  if (meta->only_rows != NULL || meta->except_rows != NULL) {
+    for (i = 0; i < RARRAY_LEN(meta->header) && !meta->skip_current_row; i++) {
+      field = RARRAY_AREF(meta->header, i);
+      meta->skip_current_row = (field != Qnil) && !rcsv_column_skipped(meta, (size_t)i) &&
+        rcsv_reject_raw_field(RSTRING_PTR(field), (size_t)RSTRING_LEN(field), (size_t)i, meta);
+    }
+  }
+
+  /* ... and it would have left out fields of skipped columns */
+  for (i = 0; i < RARRAY_LEN(meta->header); i++) {
+    if (rcsv_column_skipped(meta, (size_t)i)) {
+      continue;
+    }
+
+    field = RARRAY_AREF(meta->header, i);
+    if (field == Qnil) {
+      end_of_field_callback(NULL, 0, meta);
+    } else {
+      end_of_field_callback(RSTRING_PTR(field), (size_t)RSTRING_LEN(field), meta);
+    }
+  }
+
+  RB_GC_GUARD(configure);
+  meta->header = Qnil;
+}
+
+/* Builds a Hash or :row_class row from the fields collected in last_entry */
+static VALUE rcsv_build_row(struct rcsv_metadata * meta) {
+  VALUE row;
+#ifndef HAVE_RB_HASH_BULK_INSERT
+  long i;
+#endif
+
+  if (meta->row_as_hash) {
+#ifdef HAVE_RB_HASH_NEW_CAPA
+    row = rb_hash_new_capa(RARRAY_LEN(meta->last_entry) / 2);
+#else
+    row = rb_hash_new();
+#endif
+#ifdef HAVE_RB_HASH_BULK_INSERT
+    rb_hash_bulk_insert(RARRAY_LEN(meta->last_entry), RARRAY_CONST_PTR(meta->last_entry), row);
+#else
+    for (i = 0; i < RARRAY_LEN(meta->last_entry); i += 2) {
+      rb_hash_aset(row, RARRAY_AREF(meta->last_entry, i), RARRAY_AREF(meta->last_entry, i + 1));
+    }
+#endif
+    return row;
+  }
+
+  /* Missing fields of short rows are nil */
+  while (RARRAY_LEN(meta->last_entry) < meta->num_row_members) {
+    rb_ary_push(meta->last_entry, Qnil);
+  }
+
+  if (meta->row_class_is_struct) {
+    return rb_class_new_instance(RARRAY_LENINT(meta->last_entry), RARRAY_CONST_PTR(meta->last_entry), meta->row_class);
+  }
+
+  return rb_funcallv(meta->row_class, rb_intern("new"), RARRAY_LENINT(meta->last_entry), RARRAY_CONST_PTR(meta->last_entry));
+}
+
+/* Yields the rows collected for :batch_size in a new Array */
+static void rcsv_yield_batch(struct rcsv_metadata * meta) {
+  VALUE batch = meta->batch_rows;
+
+  meta->batch_rows = rb_ary_new_capa(meta->batch_size);
+  rb_yield(batch);
+}
+
+/* This procedure is called for every line ending */
+void end_of_line_callback(int last_char, void * data) {
+  struct rcsv_metadata * meta = (struct rcsv_metadata *) data;
+  VALUE row;
+
+  if (meta->configure != Qnil) {
+    rcsv_end_header(meta);
+  }
+
+  if (meta->current_row >= meta->end_row) {
+    meta->skip_current_row = true;
+  }
+
+  /* Columnar results have no row objects */
+  if (meta->result_columns != Qnil) {
+    rcsv_end_column_row(meta, meta->skip_current_row);
+    meta->skip_current_row = false;
+    meta->current_col = 0;
+    meta->current_row++;
+    return;
+  }
+
+  /* Lazy rows are only built once all of their fields are known */
+  if (meta->row_layout != Qnil) {
+    meta->last_entry = rcsv_end_lazy_row(meta, meta->skip_current_row);
+  }
+
+  /* If filters didn't match, current row parsing is reverted */
+  if (meta->skip_current_row) {
+    /* Do we wanna GC? */
+    meta->skip_current_row = false;
+  } else {
+    row = (meta->row_layout == Qnil && (meta->row_as_hash || meta->row_class != Qnil)) ? rcsv_build_row(meta) : meta->last_entry;
+
+    if (!rb_block_given_p()) {
+      rb_ary_push(*(meta->result), row);
+    } else if (meta->batch_size > 0) { /* STREAMING in batches */
+      rb_ary_push(meta->batch_rows, row);
+      if (RARRAY_LEN(meta->batch_rows) >= meta->batch_size) {
+        rcsv_yield_batch(meta);
+      }
+    } else { /* STREAMING */
+      rb_yield(row);
+    }
+  }
+
+  /* Re-initialize last_entry unless EOF reached. Lazy rows don't collect their fields in last_entry. */
+  if (meta->row_layout == Qnil && (meta->row_as_hash || meta->row_class != Qnil)) {
+    rb_ary_clear(meta->last_entry);
+  } else if (last_char != -1 && meta->row_layout == Qnil) {
+    meta->last_entry = rb_ary_new(); /* [] */
+  }
+
+  /* Resetting column counter */
+  meta->current_col = 0;
+
+  /* Incrementing row counter */
+  meta->current_row++;
+  return;
+}
+
+/* Compressed input. gzip (and zlib) input is inflated with zlib, zstd input is decompressed with libzstd where
+   it was available at build time. Decompressed blocks are parsed straight from native buffers that are reused
+   for the whole parse. When the whole input is in memory, a separate thread decompresses the next block while
+   the current one is being parsed. */
+
+/* Compression of the input, see :compression */
+#define RCSV_COMPRESSION_AUTO 0
+#define RCSV_COMPRESSION_NONE 1
+#define RCSV_COMPRESSION_GZIP 2
+#define RCSV_COMPRESSION_ZSTD 3
+
+/* Compression is detected from this many bytes at the start of the input */
+#define RCSV_MAGIC_SIZE 4
+
+/* Size of decompressed blocks if there is no :buffer_size */
+#define RCSV_DECOMPRESS_BUFFER_SIZE (1024 * 1024)
+
+struct rcsv_decompressor {
+  int compression;
+  bool started;               /* Some input has been decompressed */
+  bool stream_end;            /* The last compressed stream has been completed */
+#ifdef HAVE_ZLIB_H
+  z_stream zstream;
+  bool zstream_ready;         /* zstream has been initialized */
+#endif
+#ifdef HAVE_ZSTD_H
+  ZSTD_DStream * dstream;
+#endif
+  char * buffers[2];          /* Decompressed blocks, only the first one is used without a decompression thread */
+  size_t lengths[2];
+  size_t buffer_size;
+
+#ifdef HAVE_PTHREAD_H
+  /* Decompression thread */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool running;               /* The thread has been started and hasn't been joined yet */
+  const char * input;         /* Compressed input that the thread hasn't decompressed yet */
+  size_t input_len;
+  size_t filled;              /* Number of blocks decompressed, but not parsed yet */
+  size_t produced;            /* Number of blocks decompressed so far */
+  bool done;                  /* The thread has decompressed all of the input or has failed */
+  bool failed;                /* The input is corrupt */
+  bool cancelled;             /* The parse is over, the thread should stop */
+  bool interrupted;           /* The Ruby thread waiting for a block has been interrupted */
+#endif
+};
+
+/* Returns the compression that the first bytes of the input are compressed with */
+static int rcsv_detect_compression(const char * csv_string, size_t csv_string_len) {
+  const unsigned char * magic = (const unsigned char *)csv_string;
+
+  if (csv_string_len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+    return RCSV_COMPRESSION_GZIP;
+  } else if (csv_string_len >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+    return RCSV_COMPRESSION_ZSTD;
+  }
+
+  return RCSV_COMPRESSION_NONE;
+}
+
+/* Sets up decompression of the input, raising if the compression isn't supported by this build */
+static struct rcsv_decompressor * rcsv_decompressor_new(int compression, size_t buffer_size) {
+  struct rcsv_decompressor * decompressor;
+
+#ifndef HAVE_ZLIB_H
+  if (compression == RCSV_COMPRESSION_GZIP) {
+    rb_raise(rcsv_parse_error, "gzip input can't be decompressed, rcsv was built without zlib.");
+  }
+#endif
+#ifndef HAVE_ZSTD_H
+  if (compression == RCSV_COMPRESSION_ZSTD) {
+    rb_raise(rcsv_parse_error, "zstd input can't be decompressed, rcsv was built without libzstd.");
+  }
+#endif
+
+  decompressor = (struct rcsv_decompressor *)calloc(1, sizeof(struct rcsv_decompressor));
+  if (decompressor == NULL) {
+    rb_raise(rcsv_parse_error, "No memory");
+  }
+
+  decompressor->compression = compression;
+  decompressor->buffer_size = (buffer_size > 0) ? buffer_size : RCSV_DECOMPRESS_BUFFER_SIZE;
+  return decompressor;
+}
+
+/* Stops the decompression thread and frees everything */
+static void rcsv_decompressor_free(struct rcsv_decompressor * decompressor) {
+#ifdef HAVE_PTHREAD_H
+  if (decompressor->running) {
+    pthread_mutex_lock(&decompressor->lock);
+    decompressor->cancelled = true;
+    pthread_cond_broadcast(&decompressor->cond);
+    pthread_mutex_unlock(&decompressor->lock);
+
+    pthread_join(decompressor->thread, NULL);
+    pthread_cond_destroy(&decompressor->cond);
+    pthread_mutex_destroy(&decompressor->lock);
+  }
+#endif
+
+#ifdef HAVE_ZLIB_H
+  if (decompressor->zstream_ready) {
+    inflateEnd(&decompressor->zstream);
+  }
+#endif
+#ifdef HAVE_ZSTD_H
+  if (decompressor->dstream != NULL) {
+    ZSTD_freeDStream(decompressor->dstream);
+  }
+#endif
+
+  free(decompressor->buffers[0]);
+  free(decompressor->buffers[1]);
+  free(decompressor);
+}
+
+/* Allocates decompressed blocks and the decompression stream, returns false if there's no memory */
+static bool rcsv_decompressor_start(struct rcsv_decompressor * decompressor, int num_buffers) {
+  int i;
+
+  for (i = 0; i < num_buffers; i++) {
+    if (decompressor->buffers[i] == NULL && (decompressor->buffers[i] = (char *)malloc(decompressor->buffer_size)) == NULL) {
+      return false;
+    }
+  }
+
+  if (decompressor->started) {
+    return true;
+  }
+  decompressor->started = true;
+
+#ifdef HAVE_ZLIB_H
+  if (decompressor->compression == RCSV_COMPRESSION_GZIP) {
+    /* 15 + 32 accepts both gzip and zlib headers */
+    if (inflateInit2(&decompressor->zstream, 15 + 32) != Z_OK) {
+      return false;
+    }
+    decompressor->zstream_ready = true;
+  }
+#endif
+#ifdef HAVE_ZSTD_H
+  if (decompressor->compression == RCSV_COMPRESSION_ZSTD) {
+    if ((decompressor->dstream = ZSTD_createDStream()) == NULL) {
+      return false;
+    }
+    ZSTD_initDStream(decompressor->dstream);
+  }
+#endif
+
+  return true;
+}
+
+/* Decompresses as much of the input as fits into output, advancing the input past what has been consumed.
+   Doesn't touch Ruby objects, so that it can run on the decompression thread. Returns false if the input is corrupt. */
+static bool rcsv_decompress(struct rcsv_decompressor * decompressor, const char ** input, size_t * input_len,
+                            char * output, size_t output_size, size_t * produced) {
+  *produced = 0;
+
+#ifdef HAVE_ZLIB_H
+  if (decompressor->compression == RCSV_COMPRESSION_GZIP) {
+    z_stream * zstream = &decompressor->zstream;
+    int status;
+
+    while (*produced < output_size) {
+      /* Concatenated gzip members are decompressed one after another, as gunzip does */
+      if (decompressor->stream_end) {
+        if (*input_len == 0) {
+          break;
+        }
+        if (inflateReset(zstream) != Z_OK) {
+          return false;
+        }
+        decompressor->stream_end = false;
+      }
+
+      zstream->next_in = (Bytef *)*input;
+      zstream->avail_in = (uInt)((*input_len > UINT_MAX) ? UINT_MAX : *input_len);
+      zstream->next_out = (Bytef *)(output + *produced);
+      zstream->avail_out = (uInt)(((output_size - *produced) > UINT_MAX) ? UINT_MAX : (output_size - *produced));
+
+      status = inflate(zstream, Z_NO_FLUSH);
+
+      *input_len -= (size_t)((const char *)zstream->next_in - *input);
+      *input = (const char *)zstream->next_in;
+      *produced = (size_t)((char *)zstream->next_out - output);
+
+      if (status == Z_STREAM_END) {
+        decompressor->stream_end = true;
+      } else if (status == Z_BUF_ERROR || (status == Z_OK && *input_len == 0 && *produced < output_size)) {
+        break; /* Needs more input */
+      } else if (status != Z_OK) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+#endif
+
+#ifdef HAVE_ZSTD_H
+  if (decompressor->compression == RCSV_COMPRESSION_ZSTD) {
+    ZSTD_inBuffer in = { *input, *input_len, 0 };
+    ZSTD_outBuffer out = { output, output_size, 0 };
+    size_t status, in_pos, out_pos;
+
+    while (out.pos < out.size) {
+      in_pos = in.pos;
+      out_pos = out.pos;
+      status = ZSTD_decompressStream(decompressor->dstream, &out, &in);
+      if (ZSTD_isError(status)) {
+        return false;
+      }
+
+      if (in.pos == in_pos && out.pos == out_pos) {
+        break; /* Needs more input */
+      }
+
+      /* Frames may be concatenated too, 0 means that the last one so far has been completed */
+      decompressor->stream_end = (status == 0);
+    }
+
+    *input += in.pos;
+    *input_len -= in.pos;
+    *produced = out.pos;
+    return true;
+  }
+#endif
+
+  return false;
+}
+
+#ifdef HAVE_PTHREAD_H
+/* Decompression thread: fills both blocks in turn, waiting while they are being parsed */
+static void * rcsv_decompress_thread(void * data) {
+  struct rcsv_decompressor * decompressor = (struct rcsv_decompressor *)data;
+  size_t index, produced;
+  bool decompressed;
+
+  while (true) {
+    pthread_mutex_lock(&decompressor->lock);
+    while (decompressor->filled == 2 && !decompressor->cancelled) {
+      pthread_cond_wait(&decompressor->cond, &decompressor->lock);
+    }
+    if (decompressor->cancelled) {
+      pthread_mutex_unlock(&decompressor->lock);
+      return NULL;
+    }
+    index = decompressor->produced % 2;
+    pthread_mutex_unlock(&decompressor->lock);
+
+    decompressed = rcsv_decompress(decompressor, &decompressor->input, &decompressor->input_len,
+                                   decompressor->buffers[index], decompressor->buffer_size, &produced);
+
+    pthread_mutex_lock(&decompressor->lock);
+    if (!decompressed) {
+      decompressor->failed = true;
+      decompressor->done = true;
+    } else {
+      if (produced > 0) {
+        decompressor->lengths[index] = produced;
+        decompressor->produced++;
+        decompressor->filled++;
+      }
+      decompressor->done = (decompressor->input_len == 0 && produced < decompressor->buffer_size);
+    }
+    pthread_cond_broadcast(&decompressor->cond);
+    pthread_mutex_unlock(&decompressor->lock);
+
+    if (decompressor->done) {
+      return NULL;
+    }
+  }
+}
+
+#endif
+
+/* Frees column options set up by rcsv_configure() */
+static void rcsv_free_configuration(struct rcsv_metadata * meta) {
+  size_t i;
+
+  if (meta->only_rows != NULL) {
+    for (i = 0; i < meta->num_only_rows; i++) {
+      rcsv_filter_free(&meta->only_rows[i]);
+    }
+    free(meta->only_rows);
+  }
+
+  if (meta->except_rows != NULL) {
+    for (i = 0; i < meta->num_except_rows; i++) {
+      rcsv_filter_free(&meta->except_rows[i]);
+    }
+    free(meta->except_rows);
+  }
+
+  if (meta->row_defaults != NULL) {
+    free(meta->row_defaults);
+  }
+
+  if (meta->column_names != NULL) {
+    free(meta->column_names);
+  }
+
+  if (meta->column_mask != NULL) {
+    free(meta->column_mask);
+  }
+}
+
+/* All the possible free()'s should be listed here.
+   This function should be invoked before returning the result to Ruby or raising an exception. */
+void free_memory(struct csv_parser * cp, struct rcsv_metadata * meta) {
+  if (!meta->shared_configuration) {
+    rcsv_free_configuration(meta);
+  }
+
+  if (meta->row_ends != NULL) {
+    free(meta->row_ends);
+    meta->row_ends = NULL;
+  }
+
+  if (cp != NULL) {
+    csv_free(cp);
+  }
+
+  /* The decompression thread may still be reading the input, so it is stopped before the input is released */
+  if (meta->decompressor != NULL) {
+    rcsv_decompressor_free(meta->decompressor);
+    meta->decompressor = NULL;
+  }
+
+#ifdef HAVE_SYS_MMAN_H
+  if (meta->mapping != NULL) {
+    munmap(meta->mapping, meta->mapping_size);
+    meta->mapping = NULL;
+  }
+#endif
+
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+  if (meta->locked_buffer != Qnil) {
+    rb_io_buffer_unlock(meta->locked_buffer);
+    meta->locked_buffer = Qnil;
+  }
+#endif
+
+  if (meta->batch != NULL) {
+    csv_batch_free(meta->batch);
+    free(meta->batch);
+    meta->batch = NULL;
+  }
+}
+
+/* An rb_rescue()-compatible free_memory() wrapper that unpacks C pointers from Ruby's Fixnums */
+VALUE rcsv_free_memory(VALUE ensure_container) {
+  free_memory(
+    (struct csv_parser *)NUM2LONG(rb_ary_entry(ensure_container, 3)),
+    (struct rcsv_metadata *)NUM2LONG(rb_ary_entry(ensure_container, 2))
+  );
+
+  return Qnil;
+}
+
+/* Maps a regular file into memory so that it can be parsed without going through IO#read.
+   Returns the number of unread bytes and points *data to them, or returns 0 if csvio can't be mapped,
+   like pipes, sockets and IO-like objects, or has nothing left to read. */
+static size_t rcsv_map_file(VALUE csvio, struct rcsv_metadata * meta, char ** data) {
+#ifdef HAVE_SYS_MMAN_H
+  struct stat st;
+  off_t pos;
+  int fd;
+  void * mapping;
+
+  if (!rb_obj_is_kind_of(csvio, rb_cFile)) {
+    return 0;
+  }
+
+  fd = NUM2INT(rb_funcall(csvio, rb_intern("fileno"), 0));
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return 0;
+  }
+
+  /* IO#pos accounts for data buffered by Ruby, so parsing starts exactly where IO#read would */
+  pos = NUM2OFFT(rb_funcall(csvio, rb_intern("pos"), 0));
+  if (st.st_size <= pos) {
+    return 0;
+  }
+
+  mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapping == MAP_FAILED) {
+    return 0;
+  }
+
+#ifdef MADV_SEQUENTIAL
+  madvise(mapping, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+
+  meta->mapping = mapping;
+  meta->mapping_size = (size_t)st.st_size;
+
+  /* The file is consumed through the mapping, so leave it at EOF just like the IO#read loop does */
+  rb_funcall(csvio, rb_intern("seek"), 1, OFFT2NUM(st.st_size));
+
+  *data = (char *)mapping + pos;
+  return (size_t)(st.st_size - pos);
+#else
+  return 0;
+#endif
+}
+
+/* Raises Rcsv::ParseError describing the reason libcsv has stopped */
+static void rcsv_raise_csv_error(struct csv_parser * cp) {
+  int error = csv_error(cp);
+
+  switch(error) {
+    case CSV_EPARSE:
+      rb_raise(rcsv_parse_error, "Error when parsing malformed data");
+      break;
+    case CSV_ENOMEM:
+      rb_raise(rcsv_parse_error, "No memory");
+      break;
+    case CSV_ETOOBIG:
+      rb_raise(rcsv_parse_error, "Field data is too large");
+      break;
+    case CSV_EINVALID:
+      rb_raise(rcsv_parse_error, "%s", (const char *)csv_strerror(error));
+    break;
+    default:
+      rb_raise(rcsv_parse_error, "Failed due to unknown reason");
+  }
+}
+
+/* Runs csv_parse_batch(), possibly as an rb_thread_call_without_gvl() function */
+static void * rcsv_parse_batch(void * data) {
+  struct rcsv_batch_call * call = (struct rcsv_batch_call *)data;
+
+  call->parsed = csv_parse_batch(call->cp, call->input, call->input_len, call->batch);
+  return NULL;
+}
+
+/* Passes a field of the batch to end_of_field_callback() */
+static void rcsv_batch_field(struct csv_batch * batch, size_t i, const char * input, struct rcsv_metadata * meta) {
+  if (batch->flags[i] & CSV_FIELD_NULL) {
+    end_of_field_callback(NULL, 0, meta);
+  } else if (batch->flags[i] & CSV_FIELD_BUFFERED) {
+    end_of_field_callback(batch->buf + batch->offsets[i], batch->lengths[i], meta);
+  } else {
+    end_of_field_callback((void *)(input + batch->offsets[i]), batch->lengths[i], meta);
+  }
+}
+
+/* Parses input in batches of RCSV_BATCH_ROWS rows: libcsv collects field offsets, which are then turned
+   into Ruby objects by tight loops. With :release_gvl, other Ruby threads can run while libcsv is busy.
+   The first row is collected on its own while :configure is pending, since it sets libcsv up for the rest.
+   With header_only, parsing stops right after that. Returns the number of bytes parsed. */
+static size_t rcsv_parse_batches(struct csv_parser * cp, const char * csv_string, size_t csv_string_len,
+                                 struct rcsv_metadata * meta, bool header_only) {
+  struct rcsv_batch_call call;
+  struct csv_batch * batch = meta->batch;
+  size_t offset, field, row;
+
+  call.cp = cp;
+  call.batch = batch;
+
+  for (offset = 0; offset < csv_string_len; offset += call.parsed) {
+    if ((header_only && meta->configure == Qnil) || meta->current_row >= meta->end_row) {
+      break;
+    }
+
+    call.input = csv_string + offset;
+    call.input_len = csv_string_len - offset;
+    batch->max_rows = (meta->configure != Qnil) ? 1 : RCSV_BATCH_ROWS;
+
+    /* Parsing stops right after the last row within :limit_rows */
+    if (meta->end_row - meta->current_row < batch->max_rows) {
+      batch->max_rows = meta->end_row - meta->current_row;
+    }
+
+#ifdef HAVE_RUBY_THREAD_H
+    if (meta->release_gvl) {
+      rb_thread_call_without_gvl(rcsv_parse_batch, &call, NULL, NULL);
+    } else {
+      rcsv_parse_batch(&call);
+    }
+#else
+    rcsv_parse_batch(&call);
+#endif
+
+    field = 0;
+    for (row = 0; row < batch->rows; row++) {
+      for (; field < batch->row_ends[row]; field++) {
+        rcsv_batch_field(batch, field, call.input, meta);
+      }
+      if (batch->row_flags[row] & CSV_ROW_REJECTED) {
+        meta->skip_current_row = true;
+      }
+      end_of_line_callback(batch->row_terms[row], meta);
+    }
+
+    /* Fields of a row that continues past the input */
+    for (; field < batch->fields; field++) {
+      rcsv_batch_field(batch, field, call.input, meta);
+    }
+
+    if (csv_row_rejected(cp)) {
+      meta->skip_current_row = true;
+    }
+
+    if (csv_error(cp) != CSV_SUCCESS) {
+      rcsv_raise_csv_error(cp);
+    }
+  }
+
+  return offset;
+}
+
+#ifdef HAVE_RUBY_THREAD_H
+/* Blocking function for csv_parse_parallel() that lets other Ruby threads run while workers are busy */
+static void * rcsv_blocking_region(void * (*func)(void *), void * data) {
+  return rb_thread_call_without_gvl(func, data, NULL, NULL);
+}
+#endif
+
+/* Parses a piece of input, raising Rcsv::ParseError if libcsv fails */
+static void rcsv_parse_string(struct csv_parser * cp, const char * csv_string, size_t csv_string_len, int threads, size_t chunk_size, struct rcsv_metadata * meta) {
+  size_t offset;
+
+  /* csv_parse_parallel() tokenizes all of the input, so :limit_rows is parsed serially to stop after its last row */
+  if (threads <= 1 || meta->end_row != SIZE_MAX) {
+    rcsv_parse_batches(cp, csv_string, csv_string_len, meta, false);
+    return;
+  }
+
+  /* Column options have to be set up before the input is split between threads */
+  if (meta->configure != Qnil) {
+    offset = rcsv_parse_batches(cp, csv_string, csv_string_len, meta, true);
+    csv_string += offset;
+    csv_string_len -= offset;
+  }
+
+#ifdef HAVE_RUBY_THREAD_H
+  csv_set_blocking_func(cp, &rcsv_blocking_region);
+#endif
+
+  if (csv_string_len != csv_parse_parallel(cp, csv_string, csv_string_len, threads, chunk_size,
+                                           &end_of_field_callback, &end_of_line_callback, meta)) {
+    rcsv_raise_csv_error(cp);
+  }
+}
+
+/* Decompresses a piece of input on this thread, parsing every decompressed block */
+static void rcsv_decompress_string(struct csv_parser * cp, const char * csv_string, size_t csv_string_len,
+                                   size_t chunk_size, struct rcsv_metadata * meta) {
+  struct rcsv_decompressor * decompressor = meta->decompressor;
+  size_t produced;
+
+  if (!rcsv_decompressor_start(decompressor, 1)) {
+    rb_raise(rcsv_parse_error, "No memory");
+  }
+
+  do {
+    if (!rcsv_decompress(decompressor, &csv_string, &csv_string_len, decompressor->buffers[0], decompressor->buffer_size, &produced)) {
+      rb_raise(rcsv_parse_error, "Compressed input is corrupt.");
+    }
+    if (produced > 0) {
+      rcsv_parse_string(cp, decompressor->buffers[0], produced, 1, chunk_size, meta);
+    }
+  } while ((csv_string_len > 0 || produced == decompressor->buffer_size) && meta->current_row < meta->end_row);
+}
+
+#ifdef HAVE_PTHREAD_H
+/* Waits for the decompression thread to fill a block or to finish, possibly without the GVL */
+static void * rcsv_decompress_wait(void * data) {
+  struct rcsv_decompressor * decompressor = (struct rcsv_decompressor *)data;
+
+  pthread_mutex_lock(&decompressor->lock);
+  while (decompressor->filled == 0 && !decompressor->done && !decompressor->interrupted) {
+    pthread_cond_wait(&decompressor->cond, &decompressor->lock);
+  }
+  decompressor->interrupted = false;
+  pthread_mutex_unlock(&decompressor->lock);
+  return NULL;
+}
+
+/* Wakes the Ruby thread up from rcsv_decompress_wait() so that it can handle interrupts */
+static void rcsv_decompress_interrupt(void * data) {
+  struct rcsv_decompressor * decompressor = (struct rcsv_decompressor *)data;
+
+  pthread_mutex_lock(&decompressor->lock);
+  decompressor->interrupted = true;
+  pthread_cond_broadcast(&decompressor->cond);
+  pthread_mutex_unlock(&decompressor->lock);
+}
+
+/* Parses blocks that the decompression thread fills while the previous block is being parsed */
+static void rcsv_decompress_overlapped(struct csv_parser * cp, const char * csv_string, size_t csv_string_len,
+                                       size_t chunk_size, struct rcsv_metadata * meta) {
+  struct rcsv_decompressor * decompressor = meta->decompressor;
+  size_t parsed = 0, index;
+  bool filled, done;
+
+  if (!rcsv_decompressor_start(decompressor, 2)) {
+    rb_raise(rcsv_parse_error, "No memory");
+  }
+
+  decompressor->input = csv_string;
+  decompressor->input_len = csv_string_len;
+  pthread_mutex_init(&decompressor->lock, NULL);
+  pthread_cond_init(&decompressor->cond, NULL);
+  if (pthread_create(&decompressor->thread, NULL, rcsv_decompress_thread, decompressor) != 0) {
+    pthread_cond_destroy(&decompressor->cond);
+    pthread_mutex_destroy(&decompressor->lock);
+    rcsv_decompress_string(cp, csv_string, csv_string_len, chunk_size, meta);
+    return;
+  }
+  decompressor->running = true;
+
+  while (true) {
+#ifdef HAVE_RUBY_THREAD_H
+    rb_thread_call_without_gvl(rcsv_decompress_wait, decompressor, rcsv_decompress_interrupt, decompressor);
+#else
+    rcsv_decompress_wait(decompressor);
+#endif
+
+    pthread_mutex_lock(&decompressor->lock);
+    filled = (decompressor->filled > 0);
+    done = decompressor->done;
+    pthread_mutex_unlock(&decompressor->lock);
+    if (!filled) {
+      if (done) {
+        break;
+      }
+      /* Woken up by an interrupt, the decompression thread is stopped by free_memory() if it raises */
+      rb_thread_check_ints();
+      continue;
+    }
+
+    index = parsed % 2;
+    rcsv_parse_string(cp, decompressor->buffers[index], decompressor->lengths[index], 1, chunk_size, meta);
+    parsed++;
+
+    pthread_mutex_lock(&decompressor->lock);
+    decompressor->filled--;
+    pthread_cond_broadcast(&decompressor->cond);
+    pthread_mutex_unlock(&decompressor->lock);
+  }
+
+  pthread_join(decompressor->thread, NULL);
+  pthread_cond_destroy(&decompressor->cond);
+  pthread_mutex_destroy(&decompressor->lock);
+  decompressor->running = false;
+
+  if (decompressor->failed) {
+    rb_raise(rcsv_parse_error, "Compressed input is corrupt.");
+  }
+}
+#endif
+
+/* Parses a piece of input, decompressing it if necessary. Compression is detected from the first piece
+   unless :compression is given. complete is true if this is the whole input. */
+static void rcsv_parse_input(struct csv_parser * cp, const char * csv_string, size_t csv_string_len, int threads,
+                             size_t chunk_size, bool complete, struct rcsv_metadata * meta) {
+  if (meta->compression == RCSV_COMPRESSION_AUTO) {
+    meta->compression = rcsv_detect_compression(csv_string, csv_string_len);
+  }
+
+  if (meta->compression == RCSV_COMPRESSION_NONE) {
+    rcsv_parse_string(cp, csv_string, csv_string_len, threads, chunk_size, meta);
+    return;
+  }
+
+  /* Decompressed blocks are parsed serially */
+  if (meta->decompressor == NULL) {
+    meta->decompressor = rcsv_decompressor_new(meta->compression, chunk_size);
+  }
+
+#ifdef HAVE_PTHREAD_H
+  if (complete) {
+    rcsv_decompress_overlapped(cp, csv_string, csv_string_len, chunk_size, meta);
+    return;
+  }
+#endif
+
+  rcsv_decompress_string(cp, csv_string, csv_string_len, chunk_size, meta);
+}
+
+/* Raises if compressed input ends in the middle of a compressed stream */
+static void rcsv_decompress_finish(struct rcsv_metadata * meta) {
+  if (meta->decompressor != NULL && meta->decompressor->started && !meta->decompressor->stream_end &&
+      meta->current_row < meta->end_row) {
+    rb_raise(rcsv_parse_error, "Compressed input is truncated.");
+  }
+}
+
+/* Setting up some sane defaults */
+static void rcsv_init_metadata(struct rcsv_metadata * meta) {
+  meta->row_as_hash = false;
+  meta->empty_field_is_nil = false;
+  meta->skip_current_row = false;
+  meta->encoding_index = -1;
+  meta->num_columns = 0;
+  meta->current_col = 0;
+  meta->current_row = 0;
+  meta->offset_rows = 0;
+  meta->end_row = SIZE_MAX;
+  meta->num_only_rows = 0;
+  meta->num_except_rows = 0;
+  meta->num_row_defaults = 0;
+  meta->num_row_conversions = 0;
+  meta->only_rows = NULL;
+  meta->except_rows = NULL;
+  meta->row_defaults = NULL;
+  meta->row_conversions = NULL;
+  meta->column_mask = NULL;
+  meta->column_names = NULL;
+  meta->mapping = NULL;
+  meta->mapping_size = 0;
+  meta->batch = NULL;
+  meta->locked_buffer = Qnil;
+  meta->result_columns = Qnil;
+  meta->column_values = Qnil;
+  meta->num_result_rows = 0;
+  meta->release_gvl = false;
+  meta->compression = RCSV_COMPRESSION_AUTO;
+  meta->decompressor = NULL;
+  meta->row_layout = Qnil;
+  meta->row_class = Qnil;
+  meta->row_class_is_struct = false;
+  meta->num_row_members = 0;
+  meta->intern = Qnil;
+  meta->row_buffer = Qnil;
+  meta->row_offset = 0;
+  meta->row_ends = NULL;
+  meta->num_row_ends = 0;
+  meta->row_ends_size = 0;
+  meta->parser = NULL;
+  meta->options = Qnil;
+  meta->configure = Qnil;
+  meta->header = Qnil;
+  meta->plan = NULL;
+  meta->shared_configuration = false;
+  meta->batch_size = 0;
+  meta->batch_rows = Qnil;
+}
+
+/* Returns libcsv options, along with the options that are needed before libcsv is initialized */
+static unsigned char rcsv_csv_options(VALUE options, struct rcsv_metadata * meta, bool streaming) {
+  unsigned char csv_options = CSV_STRICT_FINI | CSV_ZERO_COPY;
+  VALUE option;
+
+  /* By default, parsing is strict */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("nostrict")));
+  if (!option || (option == Qnil)) {
+    csv_options |= CSV_STRICT;
+  }
+
+  /* By default, empty strings are treated as Nils and quoted empty strings are treated as empty Ruby strings */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("parse_empty_fields_as")));
+  if ((option == Qnil) || (option == ID2SYM(rb_intern("nil_or_string")))) {
+    csv_options |= CSV_EMPTY_IS_NULL;
+  } else if (option == ID2SYM(rb_intern("nil"))) {
+    meta->empty_field_is_nil = true;
+  } else if (option == ID2SYM(rb_intern("string"))) {
+    meta->empty_field_is_nil = false;
+  } else {
+    rb_raise(rcsv_parse_error, "The only valid options for :parse_empty_fields_as are :nil, :string and :nil_or_string, but %s was supplied.", RSTRING_PTR(rb_inspect(option)));
+  }
+
+  /* :result => :columns returns a Hash of column Arrays instead of an Array of rows */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("result")));
+  if (option == ID2SYM(rb_intern("columns"))) {
+    if (streaming) {
+      rb_raise(rcsv_parse_error, ":result => :columns can't be used for streaming.");
+    }
+    meta->result_columns = rb_hash_new();
+    meta->column_values = rb_ary_new();
+  } else if ((option != Qnil) && (option != ID2SYM(rb_intern("rows")))) {
+    rb_raise(rcsv_parse_error, "The only valid options for :result are :rows and :columns, but %s was supplied.", RSTRING_PTR(rb_inspect(option)));
+  }
+
+  return csv_options;
+}
+
+static void rcsv_init_batch(struct rcsv_metadata * meta) {
+  meta->batch = (struct csv_batch *)malloc(sizeof(struct csv_batch));
+  if ((meta->batch == NULL) || (csv_batch_init(meta->batch, RCSV_BATCH_ROWS) != 0)) {
+    free(meta->batch);
+    meta->batch = NULL;
+    rb_raise(rcsv_parse_error, "No memory");
+  }
+}
+
+/* Reads the options that aren't needed to initialize libcsv. cp has to be initialized already,
+   and free_memory() takes care of everything allocated here if it raises. */
+static void rcsv_setup(VALUE options, struct rcsv_metadata * meta, struct csv_parser * cp) {
+  VALUE option;
+
+  /* By default, parse as Array of Arrays */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("row_as_hash")));
+  if (option && (option != Qnil)) {
+    meta->row_as_hash = true;
+  }
+
+  /* :col_sep sets the column separator, default is comma (,) */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("col_sep")));
+  if (option != Qnil) {
+    csv_set_delim(cp, (unsigned char)*StringValuePtr(option));
+  }
+
+  /* :quote_char sets the character used for quoting data; default is double-quote (") */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("quote_char")));
+  if (option != Qnil) {
+    csv_set_quote(cp, (unsigned char)*StringValuePtr(option));
+  }
+
+  /* Specify how many rows to skip from the beginning of CSV */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("offset_rows")));
+  if (option != Qnil) {
+    meta->offset_rows = (size_t)NUM2INT(option);
+  }
+
+  /* :limit_rows stops parsing that many rows after :offset_rows */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("limit_rows")));
+  if (option != Qnil) {
+    meta->end_row = meta->offset_rows + NUM2SIZET(option);
+  }
+
+  /* Specify the character encoding of the input data */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("output_encoding")));
+  if (option && (option != Qnil)) {
+    meta->encoding_index = RB_ENC_FIND_INDEX(StringValueCStr(option));
+  }
+
+  meta->parser = cp;
+  meta->options = options;
+  meta->last_entry = rb_ary_new();
+
+  /* Column options are only known once the first row has been read if there is :configure */
+  meta->configure = rb_hash_aref(options, ID2SYM(rb_intern("configure")));
+  if (meta->configure == Qnil) {
+    rcsv_configure(meta);
+  } else {
+    meta->header = rb_ary_new();
+  }
+
+  /* :batch_size yields rows to the block in Arrays of up to that many rows */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("batch_size")));
+  if (option != Qnil) {
+    meta->batch_size = NUM2LONG(option);
+    if (meta->batch_size <= 0) {
+      rb_raise(rcsv_parse_error, ":batch_size has to be a positive number of rows, but %ld was supplied.", meta->batch_size);
+    }
+    meta->batch_rows = rb_ary_new_capa(meta->batch_size);
+  }
+
+  /* :release_gvl lets other Ruby threads run while libcsv scans the input */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("release_gvl")));
+  meta->release_gvl = RTEST(option);
+
+  /* :compression is detected from the first bytes of the input unless it's :gzip, :zstd or :none */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("compression")));
+  if ((option == Qnil) || (option == ID2SYM(rb_intern("auto")))) {
+    meta->compression = RCSV_COMPRESSION_AUTO;
+  } else if (option == ID2SYM(rb_intern("none"))) {
+    meta->compression = RCSV_COMPRESSION_NONE;
+  } else if (option == ID2SYM(rb_intern("gzip"))) {
+    meta->compression = RCSV_COMPRESSION_GZIP;
+  } else if (option == ID2SYM(rb_intern("zstd"))) {
+    meta->compression = RCSV_COMPRESSION_ZSTD;
+  } else {
+    rb_raise(rcsv_parse_error, "The only valid options for :compression are :auto, :gzip, :zstd and :none, but %s was supplied.", RSTRING_PTR(rb_inspect(option)));
+  }
+
+  rcsv_init_batch(meta);
+}
+
+/* Parses a chunk of streamed input. Chunks too short to tell the compression are collected in *head
+   until there are enough bytes. */
+static void rcsv_parse_chunk(struct csv_parser * cp, const char * csv_string, size_t csv_string_len, size_t chunk_size,
+                             VALUE * head, struct rcsv_metadata * meta) {
+  if (*head != Qnil || (meta->compression == RCSV_COMPRESSION_AUTO && csv_string_len < RCSV_MAGIC_SIZE)) {
+    *head = (*head == Qnil) ? rb_str_new(csv_string, csv_string_len) : rb_str_cat(*head, csv_string, csv_string_len);
+    if (RSTRING_LEN(*head) < RCSV_MAGIC_SIZE) {
+      return;
+    }
+    csv_string = RSTRING_PTR(*head);
+    csv_string_len = RSTRING_LEN(*head);
+  }
+
+  rcsv_parse_input(cp, csv_string, csv_string_len, 1, chunk_size, false, meta);
+  *head = Qnil;
+}
+
+/* Finishes parsing once there is no more input */
+static void rcsv_parse_end(struct csv_parser * cp, size_t chunk_size, VALUE * head, struct rcsv_metadata * meta) {
+  if (*head != Qnil) {
+    rcsv_parse_input(cp, RSTRING_PTR(*head), RSTRING_LEN(*head), 1, chunk_size, false, meta);
+    *head = Qnil;
+  }
+
+  rcsv_decompress_finish(meta);
+
+  /* Flushing libcsv's buffer */
+  csv_fini(cp, &end_of_field_callback, &end_of_line_callback, meta);
+
+  /* :configure is called even if there are no rows */
+  if (meta->configure != Qnil) {
+    rcsv_end_header(meta);
+  }
+
+  /* The last batch is usually a short one */
+  if (meta->batch_size > 0 && RARRAY_LEN(meta->batch_rows) > 0 && rb_block_given_p()) {
+    rcsv_yield_batch(meta);
+  }
+}
+
+/* An rb_rescue()-compatible Ruby pseudo-method that handles the actual parsing */
+VALUE rcsv_raw_parse(VALUE ensure_container) {
+  /* Unpacking multiple variables from a single Ruby VALUE */
+  VALUE options = rb_ary_entry(ensure_container, 0);
+  VALUE csvio   = rb_ary_entry(ensure_container, 1);
+  struct rcsv_metadata * meta = (struct rcsv_metadata *)NUM2LONG(rb_ary_entry(ensure_container, 2));
+  struct csv_parser * cp = (struct csv_parser *)NUM2LONG(rb_ary_entry(ensure_container, 3));
+
+  /* Helper temporary variables */
+  VALUE option, csvstr, buffer_size, outbuf, head = Qnil;
+  int threads;
+
+  /* libcsv-related temporary variables */
+  char * csv_string;
+  size_t csv_string_len, chunk_size;
+
+  /* IO buffer size can be controller via an option */
+  buffer_size = rb_hash_aref(options, ID2SYM(rb_intern("buffer_size")));
+
+  rcsv_setup(options, meta, cp);
+
+  /* :threads parses the whole input in chunks of :buffer_size bytes on several threads.
+     Callbacks are still called on this thread, so the result is the same as with serial parsing. */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("threads")));
+  threads = (option == Qnil) ? 1 : NUM2INT(option);
+  chunk_size = (buffer_size == Qnil) ? 0 : NUM2SIZET(buffer_size);
+
+  /* With :limit_rows, IO-like input is read in chunks until the last row rather than all at once */
+  if (meta->end_row != SIZE_MAX) {
+    threads = 1;
+  }
+
+  /* :header_data is parsed first when the input starts past its header, see Rcsv::Index */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("header_data")));
+  if (option != Qnil) {
+    rcsv_parse_input(cp, StringValuePtr(option), RSTRING_LEN(option), 1, chunk_size, false, meta);
+  }
+
+  if ((csv_string_len = rcsv_map_file(csvio, meta, &csv_string)) > 0) {
+    /* Regular files are parsed straight from the page cache, no Ruby Strings are allocated for the input */
+    rcsv_parse_input(cp, csv_string, csv_string_len, threads, chunk_size, true, meta);
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+  } else if (rb_obj_is_kind_of(csvio, rb_cIOBuffer)) {
+    /* IO::Buffer contents are parsed in place, the lock keeps them from being freed or resized meanwhile */
+    rb_io_buffer_lock(csvio);
+    meta->locked_buffer = csvio;
+    rb_io_buffer_get_bytes_for_reading(csvio, (const void **)&csv_string, &csv_string_len);
+
+    rcsv_parse_input(cp, csv_string, csv_string_len, threads, chunk_size, true, meta);
+#endif
+  } else if (threads > 1) {
+    csvstr = rb_funcall(csvio, rb_intern("read"), 0);
+    if ((csvstr != Qnil) && (RSTRING_LEN(csvstr) > 0)) {
+      csv_string = StringValuePtr(csvstr);
+      csv_string_len = RSTRING_LEN(csvstr);
+
+      rcsv_parse_input(cp, csv_string, csv_string_len, threads, chunk_size, true, meta);
+    }
+    RB_GC_GUARD(csvstr);
+  } else {
+    /* Every chunk is read into the same String where read takes an output buffer. Other IO-like objects
+       such as Zlib::GzipReader may take optional arguments too, but not the buffer. */
+    outbuf = Qnil;
+    if (rb_obj_is_kind_of(csvio, rb_cIO) ||
+        (rb_const_defined(rb_cObject, rb_intern("StringIO")) &&
+         rb_obj_is_kind_of(csvio, rb_const_get(rb_cObject, rb_intern("StringIO"))))) {
+      outbuf = rb_str_buf_new(chunk_size);
+    }
+
+    while (meta->current_row < meta->end_row) {
+      if (outbuf == Qnil) {
+        csvstr = rb_funcall(csvio, rb_intern("read"), 1, buffer_size);
+      } else {
+        csvstr = rb_funcall(csvio, rb_intern("read"), 2, buffer_size, outbuf);
+      }
+      if ((csvstr == Qnil) || (RSTRING_LEN(csvstr) == 0)) { break; }
+
+      /* Actual parsing and error handling */
+      rcsv_parse_chunk(cp, StringValuePtr(csvstr), RSTRING_LEN(csvstr), chunk_size, &head, meta);
+    }
+    RB_GC_GUARD(outbuf);
+  }
+
+  rcsv_parse_end(cp, chunk_size, &head, meta);
+  RB_GC_GUARD(head);
+
+  return Qnil;
+}
+
+/* Returns what raw_parse returns once parsing has finished */
+static VALUE rcsv_parse_result(struct rcsv_metadata * meta) {
+  VALUE last_row;
+
+  if (meta->result_columns != Qnil) {
+    return meta->result_columns;
+  }
+
+  /* Remove the last row if it's empty. That happens if CSV file ends with a newline. */
+  if (RARRAY_LEN(*(meta->result))) { /* meta.result.size != 0 */
+    last_row = rb_ary_entry(*(meta->result), -1);
+    if (meta->row_layout != Qnil ? ((struct rcsv_row *)RTYPEDDATA_DATA(last_row))->num_fields == 0 :
+        RB_TYPE_P(last_row, T_ARRAY) ? RARRAY_LEN(last_row) == 0 :
+        RB_TYPE_P(last_row, T_HASH) && RHASH_SIZE(last_row) == 0) {
+      rb_ary_pop(*(meta->result));
+    }
+  }
+
+  if (rb_block_given_p()) {
+    return Qnil; /* STREAMING */
+  } else {
+    return *(meta->result); /* Return accumulated result */
+  }
+}
+
+/* Rcsv::Pool wraps a libcsv buffer pool that can be shared by many parses */
+static void rcsv_pool_free(void * pool) {
+  csv_pool_destroy((struct csv_pool *)pool);
+  xfree(pool);
+}
+
+static VALUE rcsv_pool_alloc(VALUE klass) {
+  struct csv_pool * pool;
+  VALUE self = Data_Make_Struct(klass, struct csv_pool, NULL, rcsv_pool_free, pool);
+
+  csv_pool_init(pool);
+  return self;
+}
+
+/* Unwraps the :pool option, raising if it is not an Rcsv::Pool */
+static struct csv_pool * rcsv_get_pool(VALUE option) {
+  struct csv_pool * pool;
+
+  if (!rb_obj_is_kind_of(option, rcsv_pool_class)) {
+    rb_raise(rcsv_parse_error, ":pool can only accept an instance of Rcsv::Pool, but %s was provided.", RSTRING_PTR(rb_inspect(option)));
+  }
+
+  Data_Get_Struct(option, struct csv_pool, pool);
+  return pool;
+}
+
+/* Rcsv::Pool#stats returns allocation statistics of all the parses that have used the pool */
+static VALUE rb_rcsv_pool_stats(VALUE self) {
+  struct csv_pool * pool;
+  VALUE stats = rb_hash_new();
+
+  Data_Get_Struct(self, struct csv_pool, pool);
+
+  rb_hash_aset(stats, ID2SYM(rb_intern("allocations")), SIZET2NUM(pool->allocations));
+  rb_hash_aset(stats, ID2SYM(rb_intern("reuses")), SIZET2NUM(pool->reuses));
+  rb_hash_aset(stats, ID2SYM(rb_intern("parses")), SIZET2NUM(pool->releases));
+  rb_hash_aset(stats, ID2SYM(rb_intern("peak_buffer_size")), SIZET2NUM(pool->peak_size));
+  rb_hash_aset(stats, ID2SYM(rb_intern("cached_buffer_size")), SIZET2NUM(pool->size));
+
+  return stats;
+}
+
+/* Rcsv::Row is a lazy row returned with :lazy_rows */
+static struct rcsv_row * rcsv_get_row(VALUE self) {
+  return (struct rcsv_row *)rb_check_typeddata(self, &rcsv_row_type);
+}
+
+/* Rcsv::Row#[] accepts a field position or a column name */
+static VALUE rb_rcsv_row_aref(VALUE self, VALUE key) {
+  struct rcsv_row * row = rcsv_get_row(self);
+  struct rcsv_row_layout * layout = (struct rcsv_row_layout *)RTYPEDDATA_DATA(row->layout);
+  long position;
+
+  if (RB_INTEGER_TYPE_P(key)) {
+    position = NUM2LONG(key);
+    if (position < 0) {
+      position += row->num_fields;
+    }
+  } else {
+    key = (layout->column_positions == Qnil) ? Qnil : rb_hash_lookup(layout->column_positions, key);
+    if (key == Qnil) {
+      return Qnil;
+    }
+    position = NUM2LONG(key);
+  }
+
+  if (position < 0 || position >= row->num_fields) {
+    return Qnil;
+  }
+
+  return rcsv_row_field(row, position);
+}
+
+/* Rcsv::Row#size returns the number of fields */
+static VALUE rb_rcsv_row_size(VALUE self) {
+  return LONG2NUM(rcsv_get_row(self)->num_fields);
+}
+
+/* Rcsv::Row#to_a converts all the fields, returning what :lazy_rows would have returned otherwise */
+static VALUE rb_rcsv_row_to_a(VALUE self) {
+  struct rcsv_row * row = rcsv_get_row(self);
+  VALUE result = rb_ary_new_capa(row->num_fields);
+  long i;
+
+  for (i = 0; i < row->num_fields; i++) {
+    rb_ary_push(result, rcsv_row_field(row, i));
+  }
+
+  return result;
+}
+
+/* Rcsv::Row#to_h keys all the fields by their column names, just like :row_as_hash */
+static VALUE rb_rcsv_row_to_h(VALUE self) {
+  struct rcsv_row * row = rcsv_get_row(self);
+  struct rcsv_row_layout * layout = (struct rcsv_row_layout *)RTYPEDDATA_DATA(row->layout);
+  long i, column, num_columns = (layout->column_names == Qnil) ? 0 : RARRAY_LEN(layout->column_names);
+  VALUE result = rb_hash_new();
+
+  for (i = 0; i < row->num_fields; i++) {
+    column = rcsv_row_column(layout, i);
+    if (column >= num_columns) {
+      rb_raise(rcsv_parse_error,
+        "There are at least %d columns in a row, which is beyond the number of provided column names (%d).",
+        (int)column + 1, (int)num_columns);
+    }
+    rb_hash_aset(result, RARRAY_AREF(layout->column_names, column), rcsv_row_field(row, i));
+  }
+
+  return result;
+}
+
+static VALUE rcsv_row_enum_size(VALUE self, VALUE args, VALUE eobj) {
+  return rb_rcsv_row_size(self);
+}
+
+/* Rcsv::Row#each yields every field */
+static VALUE rb_rcsv_row_each(VALUE self) {
+  struct rcsv_row * row = rcsv_get_row(self);
+  long i;
+
+  RETURN_SIZED_ENUMERATOR(self, 0, 0, rcsv_row_enum_size);
+
+  for (i = 0; i < row->num_fields; i++) {
+    rb_yield(rcsv_row_field(row, i));
+  }
+
+  return self;
+}
+
+static VALUE rb_rcsv_row_inspect(VALUE self) {
+  return rb_sprintf("#<%"PRIsVALUE" %"PRIsVALUE">", rb_class_name(CLASS_OF(self)), rb_inspect(rb_rcsv_row_to_a(self)));
+}
+
+/* C API */
+
+/* The main method that handles parsing */
+static VALUE rb_rcsv_raw_parse(int argc, VALUE * argv, VALUE self) {
+  struct rcsv_metadata meta;
+  VALUE csvio, options, option;
+  VALUE ensure_container = rb_ary_new(); /* [] */
+
+  struct csv_parser cp;
+  struct csv_pool * pool = NULL;
+  unsigned char csv_options;
+
+  rcsv_init_metadata(&meta);
+  meta.result = (VALUE[]){rb_ary_new()}; /* [] */
+
+  /* csvio is required, options is optional (pun intended) */
+  rb_scan_args(argc, argv, "11", &csvio, &options);
+
+  /* options ||= {} */
+  if (NIL_P(options)) {
+    options = rb_hash_new();
+  }
+
+  /* First of all, we parse libcsv-related params so that it fails early if something is wrong with them */
+  csv_options = rcsv_csv_options(options, &meta, rb_block_given_p());
+
+  /* :pool makes parses share the entry buffer and allocation statistics */
+  option = rb_hash_aref(options, ID2SYM(rb_intern("pool")));
+  if (option != Qnil) {
+    pool = rcsv_get_pool(option);
+  }
+
+  /* rb_ensure() only expects callback functions to accept and return VALUEs */
+  /* This ugly hack converts C pointers into Ruby Fixnums in order to pass them in Array */
+  rb_ary_push(ensure_container, options);               /* [options] */
+  rb_ary_push(ensure_container, csvio);                 /* [options, csvio] */
+  rb_ary_push(ensure_container, LONG2NUM((long)&meta)); /* [options, csvio, &meta] */
+  rb_ary_push(ensure_container, LONG2NUM((long)&cp));   /* [options, csvio, &meta, &cp] */
+
+  /* Try to initialize libcsv */
+  if (csv_init(&cp, csv_options) == -1) {
+    rb_raise(rcsv_parse_error, "Couldn't initialize libcsv");
+  }
+
+  if (pool != NULL) {
+    csv_set_pool(&cp, pool);
+  }
+
+  /* From now on, cp handles allocated data and should be free'd on exit or exception */
+  rb_ensure(rcsv_raw_parse, ensure_container, rcsv_free_memory, ensure_container);
+
+  return rcsv_parse_result(&meta);
+}
+
+/* Row offset index. Rcsv.raw_index scans the input with csv_parse_batch() without building any fields:
+   a filter rejects every row, and batches stop right after the rows that start a sample. libcsv keeps track
+   of quoting, so recorded offsets always point at the start of a record, even with newlines in quoted fields. */
+
+/* Scan state of Rcsv.raw_index */
+struct rcsv_index_scan {
+  VALUE offsets;        /* 64-bit little-endian byte offsets of rows 0, every, 2 * every, ... */
+  size_t every;         /* Number of rows between offsets */
+  size_t rows;          /* Rows scanned so far */
+  size_t next_row;      /* The row that ends next where the scan has to stop */
+  uint64_t start;       /* Byte offset of the first row */
+  uint64_t position;    /* Byte offset of the input scanned so far */
+  uint64_t header_end;  /* Byte offset right after the first row */
+};
+
+/* libcsv filter that rejects every row, so that the batch doesn't keep any fields */
+static int rcsv_index_reject(const void * field, size_t field_size, size_t column, void * data) {
+  return 1;
+}
+
+/* Counts the last row at csv_fini() if it isn't followed by a newline */
+static void rcsv_index_count(int last_char, void * data) {
+  ((struct rcsv_index_scan *)data)->rows++;
+}
+
+/* Records the offset of the next row once the scan has stopped right after next_row */
+static void rcsv_index_row(struct rcsv_index_scan * scan, uint64_t position) {
+  char bytes[8];
+  int i;
+
+  if (scan->rows == 1) {
+    scan->header_end = position;
+  }
+
+  if (scan->rows % scan->every == 0) {
+    for (i = 0; i < 8; i++) {
+      bytes[i] = (char)(position >> (8 * i));
+    }
+    rb_str_cat(scan->offsets, bytes, 8);
+  }
+
+  scan->next_row = (scan->rows / scan->every + 1) * scan->every;
+}
+
+/* Scans a piece of input, raising Rcsv::ParseError if libcsv fails */
+static void rcsv_index_string(struct csv_parser * cp, const char * csv_string, size_t csv_string_len,
+                              struct rcsv_index_scan * scan, struct rcsv_metadata * meta) {
+  struct csv_batch * batch = meta->batch;
+  size_t offset, parsed;
+
+  if (scan->rows == 0 && scan->position == scan->start && rcsv_detect_compression(csv_string, csv_string_len) != RCSV_COMPRESSION_NONE) {
+    rb_raise(rcsv_parse_error, "Compressed input can't be indexed.");
+  }
+
+  for (offset = 0; offset < csv_string_len; offset += parsed) {
+    batch->max_rows = scan->next_row - scan->rows;
+    if (batch->max_rows > RCSV_BATCH_ROWS) {
+      batch->max_rows = RCSV_BATCH_ROWS;
+    }
+
+    parsed = csv_parse_batch(cp, csv_string + offset, csv_string_len - offset, batch);
+    if (csv_error(cp) != CSV_SUCCESS) {
+      rcsv_raise_csv_error(cp);
+    }
+
+    scan->rows += batch->rows;
+    if (scan->rows == scan->next_row) {
+      rcsv_index_row(scan, scan->position + offset + parsed);
+    }
+  }
+
+  scan->position += csv_string_len;
+}
+
+/* An rb_ensure()-compatible function that scans the whole input */
+VALUE rcsv_raw_index(VALUE ensure_container) {
+  VALUE options = rb_ary_entry(ensure_container, 0);
+  VALUE csvio   = rb_ary_entry(ensure_container, 1);
+  struct rcsv_metadata * meta = (struct rcsv_metadata *)NUM2LONG(rb_ary_entry(ensure_container, 2));
+  struct csv_parser * cp = (struct csv_parser *)NUM2LONG(rb_ary_entry(ensure_container, 3));
+  struct rcsv_index_scan * scan = (struct rcsv_index_scan *)NUM2LONG(rb_ary_entry(ensure_container, 4));
+
+  VALUE option, csvstr, buffer_size;
+  char * csv_string;
+  size_t csv_string_len;
+
+  option = rb_hash_aref(options, ID2SYM(rb_intern("col_sep")));
+  if (option != Qnil) {
+    csv_set_delim(cp, (unsigned char)*StringValuePtr(option));
+  }
+
+  option = rb_hash_aref(options, ID2SYM(rb_intern("quote_char")));
+  if (option != Qnil) {
+    csv_set_quote(cp, (unsigned char)*StringValuePtr(option));
+  }
+
+  csv_set_filter(cp, &rcsv_index_reject, NULL);
+  rcsv_init_batch(meta);
+
+  buffer_size = rb_hash_aref(options, ID2SYM(rb_intern("buffer_size")));
+
+  if ((csv_string_len = rcsv_map_file(csvio, meta, &csv_string)) > 0) {
+    rcsv_index_string(cp, csv_string, csv_string_len, scan, meta);
+  } else {
+    while (true) {
+      csvstr = rb_funcall(csvio, rb_intern("read"), 1, buffer_size);
+      if ((csvstr == Qnil) || (RSTRING_LEN(csvstr) == 0)) { break; }
+
+      rcsv_index_string(cp, StringValuePtr(csvstr), RSTRING_LEN(csvstr), scan, meta);
+    }
+  }
+
+  if (csv_fini(cp, NULL, &rcsv_index_count, scan) != 0) {
+    rcsv_raise_csv_error(cp);
+  }
+
+  if (scan->rows == scan->next_row) {
+    rcsv_index_row(scan, scan->position);
+  } else if (scan->rows == 0) {
+    scan->header_end = scan->position;
+  }
+
+  return Qnil;
+}
+
+/* def Rcsv.raw_index(io, options = {}); ...; end
+   Returns [offsets, rows, end position, header end position], see Rcsv.build_index */
+static VALUE rb_rcsv_raw_index(int argc, VALUE * argv, VALUE self) {
+  struct rcsv_metadata meta;
+  struct rcsv_index_scan scan;
+  struct csv_parser cp;
+  VALUE csvio, options, option;
+  VALUE ensure_container = rb_ary_new(); /* [] */
+  long samples;
+
+  rb_scan_args(argc, argv, "11", &csvio, &options);
+
+  if (NIL_P(options)) {
+    options = rb_hash_new();
+  }
+
+  rcsv_init_metadata(&meta);
+
+  option = rb_hash_aref(options, ID2SYM(rb_intern("every")));
+  scan.every = (option == Qnil) ? 1 : NUM2SIZET(option);
+  if (scan.every == 0) {
+    rb_raise(rcsv_parse_error, ":every has to be a positive number of rows.");
+  }
+
+  option = rb_hash_aref(options, ID2SYM(rb_intern("position")));
+  scan.start = (option == Qnil) ? 0 : NUM2ULL(option);
+  scan.position = scan.start;
+  scan.header_end = scan.start;
+  scan.rows = 0;
+  scan.offsets = rb_str_buf_new(8 * 16);
+  rb_enc_associate_index(scan.offsets, rb_ascii8bit_encindex());
+
+  /* Row 0 starts where the scan does. The scan stops after the first row too, to find where the header ends. */
+  rcsv_index_row(&scan, scan.start);
+  scan.next_row = 1;
+
+  rb_ary_push(ensure_container, options);
+  rb_ary_push(ensure_container, csvio);
+  rb_ary_push(ensure_container, LONG2NUM((long)&meta));
+  rb_ary_push(ensure_container, LONG2NUM((long)&cp));
+  rb_ary_push(ensure_container, LONG2NUM((long)&scan));
+
+  if (csv_init(&cp, rcsv_csv_options(options, &meta, false)) == -1) {
+    rb_raise(rcsv_parse_error, "Couldn't initialize libcsv");
+  }
+
+  rb_ensure(rcsv_raw_index, ensure_container, rcsv_free_memory, ensure_container);
+
+  /* The last offset is only kept if a row starts there */
+  samples = (scan.rows == 0) ? 1 : (long)((scan.rows - 1) / scan.every + 1);
+  if (RSTRING_LEN(scan.offsets) > 8 * samples) {
+    rb_str_set_len(scan.offsets, 8 * samples);
+  }
+
+  return rb_ary_new_from_args(4, scan.offsets, SIZET2NUM(scan.rows), ULL2NUM(scan.position), ULL2NUM(scan.header_end));
+}
+
+/* Rcsv::Parser keeps a parse open across calls, so that input can be fed to it as it arrives.
+   Only the unfinished row stays in memory between chunks, and nothing is parsed on other threads. */
+
+#define RCSV_PARSER_NEW 0      /* Allocated, but libcsv hasn't been initialized yet */
+#define RCSV_PARSER_READY 1    /* Waiting for more input */
+#define RCSV_PARSER_BUSY 2     /* Parsing. A parse that raised or was broken out of stays busy for good. */
+#define RCSV_PARSER_FINISHED 3 /* All the input has been parsed and the memory has been freed */
+
+/* Amount of input that #each reads at once if there is no :buffer_size */
+#define RCSV_PARSER_READ_SIZE (1024 * 1024)
+
+struct rcsv_parser {
+  struct csv_parser cp;
+  struct rcsv_metadata meta;
+  VALUE source;               /* Object that #each reads input from, Qnil if input is fed */
+  VALUE rows;                 /* Rows completed since the last #feed, unless they are yielded */
+  VALUE head;                 /* Input that is too short to tell the compression yet */
+  VALUE buffer_size;          /* Amount of input that #each reads at once */
+  size_t chunk_size;
+  int state;
+};
+
+static void rcsv_metadata_mark_filters(struct rcsv_filter * filters, size_t num_filters) {
+  size_t i;
+
+  if (filters != NULL) {
+    for (i = 0; i < num_filters; i++) {
+      rb_gc_mark(filters[i].values);
+    }
+  }
+}
+
+/* Marks the objects that metadata kept on the heap refers to */
+static void rcsv_metadata_mark(struct rcsv_metadata * meta) {
+  size_t i;
+
+  rb_gc_mark(meta->last_entry);
+  rb_gc_mark(meta->row_class);
+  rb_gc_mark(meta->result_columns);
+  rb_gc_mark(meta->column_values);
+  rb_gc_mark(meta->row_layout);
+  rb_gc_mark(meta->row_buffer);
+  rb_gc_mark(meta->intern);
+  rb_gc_mark(meta->locked_buffer);
+  rb_gc_mark(meta->options);
+  rb_gc_mark(meta->configure);
+  rb_gc_mark(meta->header);
+  rb_gc_mark(meta->batch_rows);
+
+  if (meta->row_defaults != NULL) {
+    for (i = 0; i < meta->num_row_defaults; i++) {
+      rb_gc_mark(meta->row_defaults[i]);
+    }
+  }
+
+  if (meta->column_names != NULL) {
+    for (i = 0; i < meta->num_columns; i++) {
+      rb_gc_mark(meta->column_names[i]);
+    }
+  }
+
+  rcsv_metadata_mark_filters(meta->only_rows, meta->num_only_rows);
+  rcsv_metadata_mark_filters(meta->except_rows, meta->num_except_rows);
+}
+
+static void rcsv_parser_mark(void * data) {
+  struct rcsv_parser * parser = (struct rcsv_parser *)data;
+
+  rb_gc_mark(parser->source);
+  rb_gc_mark(parser->rows);
+  rb_gc_mark(parser->head);
+  rb_gc_mark(parser->buffer_size);
+
+  /* Everything the metadata refers to is gone once the parse has finished */
+  if (parser->state != RCSV_PARSER_FINISHED) {
+    rcsv_metadata_mark(&parser->meta);
+  }
+}
+
+static void rcsv_parser_free(void * data) {
+  struct rcsv_parser * parser = (struct rcsv_parser *)data;
+
+  if (parser->state == RCSV_PARSER_READY || parser->state == RCSV_PARSER_BUSY) {
+    /* The pool may have been swept already, the entry buffer is simply freed */
+    parser->cp.pool = NULL;
+    free_memory(&parser->cp, &parser->meta);
+  }
+
+  xfree(parser);
+}
+
+static const rb_data_type_t rcsv_parser_type = {
+  "rcsv_parser",
+  { rcsv_parser_mark, rcsv_parser_free, NULL, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE rcsv_parser_alloc(VALUE klass) {
+  struct rcsv_parser * parser;
+  VALUE self = TypedData_Make_Struct(klass, struct rcsv_parser, &rcsv_parser_type, parser);
+
+  rcsv_init_metadata(&parser->meta);
+  parser->source = Qnil;
+  parser->rows = rb_ary_new();
+  parser->head = Qnil;
+  parser->buffer_size = Qnil;
+  parser->chunk_size = 0;
+  parser->state = RCSV_PARSER_NEW;
+  parser->meta.result = &parser->rows;
+  return self;
+}
+
+/* Returns the parser, which is busy until rcsv_parser_done() is called */
+static struct rcsv_parser * rcsv_parser_enter(VALUE self) {
+  struct rcsv_parser * parser = (struct rcsv_parser *)rb_check_typeddata(self, &rcsv_parser_type);
+
+  switch (parser->state) {
+  case RCSV_PARSER_NEW:
+    rb_raise(rb_eRuntimeError, "Rcsv::Parser hasn't been initialized");
+  case RCSV_PARSER_BUSY:
+    rb_raise(rcsv_parse_error, "Rcsv::Parser is already parsing, or its parse was interrupted.");
+  case RCSV_PARSER_FINISHED:
+    rb_raise(rcsv_parse_error, "Rcsv::Parser has already finished.");
+  }
+
+  parser->state = RCSV_PARSER_BUSY;
+  return parser;
+}
+
+/* Returns the rows completed so far, or nil if they have been yielded */
+static VALUE rcsv_parser_done(struct rcsv_parser * parser, int state) {
+  VALUE rows = parser->rows;
+
+  parser->state = state;
+  if (rb_block_given_p()) {
+    return Qnil;
+  }
+
+  parser->rows = rb_ary_new();
+  return rows;
+}
+
+/* def setup(source, raw_options); ...; end
+   Takes the options of Rcsv.raw_parse, except for :threads. :result => :columns isn't supported. */
+static VALUE rb_rcsv_parser_setup(VALUE self, VALUE source, VALUE options) {
+  struct rcsv_parser * parser = (struct rcsv_parser *)rb_check_typeddata(self, &rcsv_parser_type);
+  struct csv_pool * pool = NULL;
+  unsigned char csv_options;
+  VALUE option;
+
+  if (parser->state != RCSV_PARSER_NEW) {
+    rb_raise(rb_eRuntimeError, "Rcsv::Parser has already been initialized");
+  }
+
+  /* Options are read again once :configure has been called, so later changes to the Hash don't matter */
+  options = rb_hash_dup(rb_convert_type(options, T_HASH, "Hash", "to_hash"));
+  csv_options = rcsv_csv_options(options, &parser->meta, true);
+
+  option = rb_hash_aref(options, ID2SYM(rb_intern("pool")));
+  if (option != Qnil) {
+    pool = rcsv_get_pool(option);
+  }
+
+  if (csv_init(&parser->cp, csv_options) == -1) {
+    rb_raise(rcsv_parse_error, "Couldn't initialize libcsv");
+  }
+
+  if (pool != NULL) {
+    csv_set_pool(&parser->cp, pool);
+  }
+
+  /* From now on, the parser is freed along with the object, and it can't be used if setting up fails */
+  parser->state = RCSV_PARSER_BUSY;
+  parser->source = source;
+  parser->buffer_size = rb_hash_aref(options, ID2SYM(rb_intern("buffer_size")));
+  parser->chunk_size = (parser->buffer_size == Qnil) ? 0 : NUM2SIZET(parser->buffer_size);
+
+  rcsv_setup(options, &parser->meta, &parser->cp);
+  parser->state = RCSV_PARSER_READY;
+
+  return self;
+}
+
+/* def feed(chunk); ...; end
+   Parses the next chunk of input, yielding completed rows or returning them if there is no block */
+static VALUE rb_rcsv_parser_feed(VALUE self, VALUE chunk) {
+  struct rcsv_parser * parser;
+
+  /* Fields are parsed in place, so the chunk is frozen in case the block modifies the original */
+  chunk = rb_str_new_frozen(StringValue(chunk));
+  parser = rcsv_parser_enter(self);
+
+  rcsv_parse_chunk(&parser->cp, RSTRING_PTR(chunk), RSTRING_LEN(chunk), parser->chunk_size,
+                   &parser->head, &parser->meta);
+  RB_GC_GUARD(chunk);
+
+  return rcsv_parser_done(parser, RCSV_PARSER_READY);
+}
+
+/* def finish; ...; end
+   Parses the last row of the input, which doesn't have to end with a newline */
+static VALUE rb_rcsv_parser_finish(VALUE self) {
+  struct rcsv_parser * parser = rcsv_parser_enter(self);
+
+  rcsv_parse_end(&parser->cp, parser->chunk_size, &parser->head, &parser->meta);
+  free_memory(&parser->cp, &parser->meta);
+
+  return rcsv_parser_done(parser, RCSV_PARSER_FINISHED);
+}
+
+/* Reads the next chunk of the source, nil at the end */
+static VALUE rcsv_parser_read(VALUE self) {
+  struct rcsv_parser * parser = (struct rcsv_parser *)RTYPEDDATA_DATA(self);
+  VALUE size = (parser->buffer_size == Qnil) ? SIZET2NUM(RCSV_PARSER_READ_SIZE) : parser->buffer_size;
+
+  /* readpartial returns whatever has arrived so far, so rows of pipes and sockets come out as soon as possible */
+  if (rb_respond_to(parser->source, rb_intern("readpartial"))) {
+    return rb_funcall(parser->source, rb_intern("readpartial"), 1, size);
+  }
+
+  return rb_funcall(parser->source, rb_intern("read"), 1, size);
+}
+
+static VALUE rcsv_parser_eof(VALUE self, VALUE error) {
+  return Qnil;
+}
+
+/* def each; ...; end
+   Reads the source until it ends, yielding every row. Without a block, returns an Enumerator, whose #next
+   reads no more of the source than it needs for the next row. */
+static VALUE rb_rcsv_parser_each(VALUE self) {
+  struct rcsv_parser * parser = (struct rcsv_parser *)rb_check_typeddata(self, &rcsv_parser_type);
+  VALUE chunk;
+
+  RETURN_ENUMERATOR(self, 0, 0);
+
+  if (parser->state != RCSV_PARSER_NEW && parser->source == Qnil) {
+    rb_raise(rcsv_parse_error, "Rcsv::Parser has no source to read from, its rows are returned by #feed and #finish.");
+  }
+
+  while (true) {
+    chunk = rb_rescue2(rcsv_parser_read, self, rcsv_parser_eof, Qnil, rb_eEOFError, (VALUE)0);
+    if ((chunk == Qnil) || (RSTRING_LEN(chunk) == 0)) {
+      break;
+    }
+    rb_rcsv_parser_feed(self, chunk);
+  }
+
+  rb_rcsv_parser_finish(self);
+  return self;
+}
+
+/* Rcsv::Plan parses Strings with options that have been validated and set up once by Rcsv.compile.
+   Parses start from copies of a set up libcsv parser and metadata, so no options are looked up per parse.
+   Column options that depend on the header are set up by the first parse, and shared by later parses
+   whose headers are the same. */
+
+/* A parse started from a plan */
+struct rcsv_plan_call {
+  struct rcsv_plan * plan;
+  struct csv_parser * cp;
+  struct rcsv_metadata * meta;
+  VALUE csv_data;
+  VALUE header;
+};
+
+static void rcsv_plan_mark(void * data) {
+  struct rcsv_plan * plan = (struct rcsv_plan *)data;
+
+  rcsv_metadata_mark(&plan->meta);
+  if (plan->is_compiled) {
+    rcsv_metadata_mark(&plan->compiled);
+  }
+  rb_gc_mark(plan->header);
+  rb_gc_mark(plan->pool);
+}
+
+static void rcsv_plan_free(void * data) {
+  struct rcsv_plan * plan = (struct rcsv_plan *)data;
+
+  if (plan->meta.parser != NULL) {
+    free_memory(&plan->cp, &plan->meta);
+  }
+  if (plan->is_compiled) {
+    rcsv_free_configuration(&plan->compiled);
+  }
+
+  xfree(plan);
+}
+
+static const rb_data_type_t rcsv_plan_type = {
+  "rcsv_plan",
+  { rcsv_plan_mark, rcsv_plan_free, NULL, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE rcsv_plan_alloc(VALUE klass) {
+  struct rcsv_plan * plan;
+  VALUE self = TypedData_Make_Struct(klass, struct rcsv_plan, &rcsv_plan_type, plan);
+
+  rcsv_init_metadata(&plan->meta);
+  rcsv_init_metadata(&plan->compiled);
+  plan->is_compiled = false;
+  plan->header = Qnil;
+  plan->header_fields = false;
+  plan->fixed_encoding = false;
+  plan->columns_result = false;
+  plan->pool = Qnil;
+  plan->threads = 1;
+  plan->chunk_size = 0;
+  return self;
+}
+
+static struct rcsv_plan * rcsv_get_plan(VALUE self) {
+  struct rcsv_plan * plan = (struct rcsv_plan *)rb_check_typeddata(self, &rcsv_plan_type);
+
+  if (plan->meta.parser == NULL) {
+    rb_raise(rb_eRuntimeError, "Rcsv::Plan hasn't been initialized");
+  }
+
+  return plan;
+}
+
+/* def setup(raw_options, header_fields); ...; end
+   Takes the options of Rcsv.raw_parse. With header_fields, column options depend on the fields of the header,
+   otherwise only on their number. */
+static VALUE rb_rcsv_plan_setup(VALUE self, VALUE options, VALUE header_fields) {
+  struct rcsv_plan * plan = (struct rcsv_plan *)rb_check_typeddata(self, &rcsv_plan_type);
+  unsigned char csv_options;
+  VALUE option;
+
+  if (plan->meta.parser != NULL) {
+    rb_raise(rb_eRuntimeError, "Rcsv::Plan has already been initialized");
+  }
+
+  options = rb_hash_dup(rb_convert_type(options, T_HASH, "Hash", "to_hash"));
+  csv_options = rcsv_csv_options(options, &plan->meta, false);
+
+  plan->pool = rb_hash_aref(options, ID2SYM(rb_intern("pool")));
+  if (plan->pool != Qnil) {
+    rcsv_get_pool(plan->pool);
+  }
+
+  if (csv_init(&plan->cp, csv_options) == -1) {
+    rb_raise(rcsv_parse_error, "Couldn't initialize libcsv");
+  }
+
+  /* From now on, the plan is freed along with the object */
+  plan->meta.parser = &plan->cp;
+  rcsv_setup(options, &plan->meta, &plan->cp);
+
+  option = rb_hash_aref(options, ID2SYM(rb_intern("threads")));
+  plan->threads = (option == Qnil) ? 1 : NUM2INT(option);
+  option = rb_hash_aref(options, ID2SYM(rb_intern("buffer_size")));
+  plan->chunk_size = (option == Qnil) ? 0 : NUM2SIZET(option);
+  plan->header_fields = RTEST(header_fields);
+  plan->fixed_encoding = (plan->meta.encoding_index != -1);
+  plan->columns_result = (plan->meta.result_columns != Qnil);
+
+  return self;
+}
+
+/* Starts a parse from the plan. cp and meta only have to be freed once this has returned. */
+static void rcsv_plan_start(struct rcsv_plan_call * call, VALUE * result) {
+  struct rcsv_plan * plan = call->plan;
+  struct rcsv_metadata * meta = call->meta;
+
+  if (plan->columns_result && rb_block_given_p()) {
+    rb_raise(rcsv_parse_error, ":result => :columns can't be used for streaming.");
+  }
+
+  /* The set up parser owns no buffers, since it has never parsed, so it can be copied */
+  *call->cp = plan->cp;
+  *meta = plan->meta;
+  meta->parser = call->cp;
+  meta->plan = plan;
+  meta->result = result;
+  meta->batch = NULL;
+  meta->row_ends = NULL;
+  meta->row_ends_size = 0;
+
+#ifdef HAVE_RUBY_ENCODING_H
+  if (!plan->fixed_encoding) {
+    meta->encoding_index = ENCODING_GET(call->csv_data);
+  }
+#endif
+
+  /* Column options of the set up metadata are shared, unless they are only set up once the header is known */
+  meta->shared_configuration = (plan->meta.configure == Qnil);
+
+  meta->last_entry = rb_ary_new();
+  if (meta->configure != Qnil) {
+    meta->header = call->header = rb_ary_new();
+  }
+  if (plan->columns_result) {
+    meta->result_columns = rb_hash_new();
+    meta->column_values = rb_ary_new();
+  }
+  if (meta->row_layout != Qnil) {
+    meta->row_buffer = rb_str_buf_new(RCSV_ROW_BUFFER_SIZE);
+  }
+  if (meta->batch_size > 0) {
+    meta->batch_rows = rb_ary_new_capa(meta->batch_size);
+  }
+  if (meta->only_rows != NULL || meta->except_rows != NULL) {
+    csv_set_filter(call->cp, &rcsv_reject_raw_field, meta);
+  }
+
+  rcsv_init_batch(meta);
+
+  /* Nothing raises from here on, the pool's buffer is given back by free_memory() */
+  if (plan->pool != Qnil) {
+    csv_set_pool(call->cp, rcsv_get_pool(plan->pool));
+  }
+}
+
+/* An rb_ensure()-compatible function that parses the whole String */
+static VALUE rcsv_plan_parse(VALUE data) {
+  struct rcsv_plan_call * call = (struct rcsv_plan_call *)data;
+  struct rcsv_plan * plan = call->plan;
+  struct rcsv_metadata * meta = call->meta;
+  VALUE head = Qnil;
+
+  rcsv_parse_input(call->cp, RSTRING_PTR(call->csv_data), RSTRING_LEN(call->csv_data), plan->threads,
+                   plan->chunk_size, true, meta);
+  rcsv_parse_end(call->cp, plan->chunk_size, &head, meta);
+
+  /* The first parse that has set column options up for a header leaves them to the plan */
+  if (!plan->is_compiled && !meta->shared_configuration && call->header != Qnil && RARRAY_LEN(call->header) > 0) {
+    rcsv_copy_configuration(&plan->compiled, meta);
+    plan->compiled.encoding_index = meta->encoding_index;
+    plan->header = call->header;
+    plan->is_compiled = true;
+    meta->shared_configuration = true;
+  }
+
+  return Qnil;
+}
+
+static VALUE rcsv_plan_free_parse(VALUE data) {
+  struct rcsv_plan_call * call = (struct rcsv_plan_call *)data;
+
+  free_memory(call->cp, call->meta);
+  return Qnil;
+}
+
+/* def parse(csv_string); ...; end
+   Parses the bytes of the String in place, returning or yielding rows like Rcsv.parse */
+static VALUE rb_rcsv_plan_parse(VALUE self, VALUE csv_data) {
+  struct rcsv_plan * plan = rcsv_get_plan(self);
+  struct rcsv_plan_call call;
+  struct rcsv_metadata meta;
+  struct csv_parser cp;
+  VALUE result = rb_ary_new();
+
+  /* Fields are parsed in place, so the String is frozen in case the block modifies the original */
+  call.plan = plan;
+  call.cp = &cp;
+  call.meta = &meta;
+  call.csv_data = rb_str_new_frozen(StringValue(csv_data));
+  call.header = Qnil;
+
+  rcsv_plan_start(&call, &result);
+  rb_ensure(rcsv_plan_parse, (VALUE)&call, rcsv_plan_free_parse, (VALUE)&call);
+
+  RB_GC_GUARD(self);
+  RB_GC_GUARD(call.csv_data);
+  RB_GC_GUARD(call.header);
+  return rcsv_parse_result(&meta);
+}
+
+/* Rcsv::Files parses many files, which native worker threads read and tokenize without the GVL: every file
+   is collected into batches of fields by csv_parse_batch(). Rows are built from the collected fields on the Ruby
+   thread, one file at a time, by the same callbacks as any other parse. Workers don't know column options that
+   depend on the header, so every field is collected, and the column mask and the filter that libcsv would have
+   applied are applied while the rows are built. */
+
+/* Rows collected by a worker in a single batch */
+#define RCSV_FILES_BATCH_ROWS (16 * 1024)
+
+/* Number of files that are tokenized by default, see :threads of Rcsv.parse_files */
+#define RCSV_FILES_THREADS 4
+
+/* Fields collected by a csv_parse_batch() call, offsets of fields that aren't buffered are relative to input */
+struct rcsv_file_batch {
+  struct csv_batch batch;
+  const char * input;
+};
+
+/* A file and the fields collected from it */
+struct rcsv_file {
+  char * path;
+  int error;                  /* errno if the file couldn't be read */
+  int status;                 /* csv_error() if libcsv has failed */
+  bool compressed;            /* Compressed files are parsed on the Ruby thread */
+  char * data;                /* Contents of the file */
+  size_t size;
+  bool mapped;                /* data is mapped rather than read into memory */
+  struct rcsv_file_batch * batches;
+  size_t num_batches;
+  char * last_field;          /* The field csv_fini() passes on if the file doesn't end with a newline */
+  size_t last_field_size;
+  bool last_field_null;
+  bool last_row;              /* csv_fini() has ended a row */
+  bool returned;              /* #next has returned the file */
+  bool parsed;                /* #parse has been called for the file */
+};
+
+struct rcsv_files {
+  struct rcsv_file * files;
+  size_t num_files;
+  VALUE options;              /* raw_parse options of every file */
+  unsigned char csv_options;
+  unsigned char delim;
+  unsigned char quote;
+  size_t end_row;             /* Files are tokenized up to this row, see :limit_rows */
+  size_t * finished;          /* Indexes of files in the order they have been tokenized */
+  size_t num_finished;
+  size_t next_finished;       /* Files that #next has returned */
+  size_t next_file;           /* Files that workers have taken */
+  size_t num_parsed;          /* Files that #parse is done with */
+  size_t max_pending;         /* Workers don't take more files while this many are tokenized but not parsed */
+  int num_workers;
+  bool closed;
+#ifdef HAVE_PTHREAD_H
+  pthread_t * workers;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool cancelled;             /* Workers should stop */
+  bool interrupted;           /* The Ruby thread waiting in #next has been interrupted */
+#endif
+};
+
+/* A field of the row that is being built */
+struct rcsv_files_field {
+  const char * str;           /* NULL for NULL fields */
+  size_t size;
+};
+
+/* A file that #parse builds rows from */
+struct rcsv_files_call {
+  struct rcsv_files * files;
+  struct rcsv_file * file;
+  struct csv_parser cp;
+  bool cp_ready;
+  struct rcsv_metadata meta;
+  VALUE result;
+  VALUE io;                   /* The compressed file */
+  struct rcsv_files_field * fields;
+  size_t num_fields;
+  size_t fields_size;
+};
+
+/* Reads a file into memory, mapping regular files where mmap() is available. Returns errno on failure. */
+static int rcsv_file_read(struct rcsv_file * file) {
+  FILE * stream;
+  size_t size = 0, read;
+  char * data;
+#ifdef HAVE_SYS_MMAN_H
+  struct stat st;
+  int fd;
+  void * mapping;
+
+  if ((fd = open(file->path, O_RDONLY)) == -1) {
+    return errno;
+  }
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    if (st.st_size == 0) {
+      close(fd);
+      return 0;
+    }
+
+    mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+      madvise(mapping, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+      close(fd);
+      file->data = (char *)mapping;
+      file->size = (size_t)st.st_size;
+      file->mapped = true;
+      return 0;
+    }
+  }
+  close(fd);
+#endif
+
+  if ((stream = fopen(file->path, "rb")) == NULL) {
+    return errno;
+  }
+
+  do {
+    if ((data = (char *)realloc(file->data, size + RCSV_PARSER_READ_SIZE)) == NULL) {
+      fclose(stream);
+      return ENOMEM;
+    }
+    file->data = data;
+    read = fread(file->data + size, 1, RCSV_PARSER_READ_SIZE, stream);
+    size += read;
+  } while (read == RCSV_PARSER_READ_SIZE);
+
+  if (ferror(stream)) {
+    fclose(stream);
+    return EIO;
+  }
+
+  fclose(stream);
+  file->size = size;
+  return 0;
+}
+
+/* Keeps the field that csv_fini() passes on */
+static void rcsv_file_last_field(void * field, size_t field_size, void * data) {
+  struct rcsv_file * file = (struct rcsv_file *)data;
+
+  file->last_field_null = (field == NULL);
+  if (field != NULL && field_size > 0 && (file->last_field = (char *)malloc(field_size)) != NULL) {
+    memcpy(file->last_field, field, field_size);
+    file->last_field_size = field_size;
+  } else if (field_size > 0) {
+    file->status = CSV_ENOMEM;
+  }
+}
+
+static void rcsv_file_last_row(int last_char, void * data) {
+  ((struct rcsv_file *)data)->last_row = true;
+}
+
+/* Reads a file and collects its fields. Doesn't touch Ruby objects, so that it can run on worker threads. */
+static void rcsv_file_tokenize(struct rcsv_files * files, struct rcsv_file * file) {
+  struct csv_parser cp;
+  struct rcsv_file_batch * batches;
+  size_t offset = 0, batches_size = 0, rows = 0, max_rows;
+
+  if ((file->error = rcsv_file_read(file)) != 0 || file->size == 0) {
+    return;
+  }
+
+  /* Compressed files are left to the decompression of the usual parse */
+  if (rcsv_detect_compression(file->data, file->size) != RCSV_COMPRESSION_NONE) {
+    file->compressed = true;
+    return;
+  }
+
+  if (csv_init(&cp, files->csv_options) == -1) {
+    file->status = CSV_ENOMEM;
+    return;
+  }
+  csv_set_delim(&cp, files->delim);
+  csv_set_quote(&cp, files->quote);
+
+  /* Like rcsv_parse_batches(), tokenizing stops right after the last row within :limit_rows */
+  while (offset < file->size && rows < files->end_row) {
+    if (file->num_batches == batches_size) {
+      batches_size = batches_size ? batches_size * 2 : 4;
+      if ((batches = (struct rcsv_file_batch *)realloc(file->batches, batches_size * sizeof(struct rcsv_file_batch))) == NULL) {
+        file->status = CSV_ENOMEM;
+        break;
+      }
+      file->batches = batches;
+    }
+
+    max_rows = (files->end_row - rows < RCSV_FILES_BATCH_ROWS) ? files->end_row - rows : RCSV_FILES_BATCH_ROWS;
+    if (csv_batch_init(&file->batches[file->num_batches].batch, max_rows) != 0) {
+      file->status = CSV_ENOMEM;
+      break;
+    }
+    file->batches[file->num_batches].input = file->data + offset;
+    offset += csv_parse_batch(&cp, file->data + offset, file->size - offset, &file->batches[file->num_batches].batch);
+    rows += file->batches[file->num_batches].batch.rows;
+    file->num_batches++;
+
+    if (csv_error(&cp) != CSV_SUCCESS) {
+      file->status = csv_error(&cp);
+      break;
+    }
+  }
+
+  /* Like rcsv_parse_end(), a quoted field that isn't closed at the end of strict input is dropped */
+  if (file->status == CSV_SUCCESS && rows < files->end_row) {
+    csv_fini(&cp, &rcsv_file_last_field, &rcsv_file_last_row, file);
+  }
+
+  csv_free(&cp);
+}
+
+/* Frees the contents and the fields of a file */
+static void rcsv_file_free(struct rcsv_file * file) {
+  size_t i;
+
+  for (i = 0; i < file->num_batches; i++) {
+    csv_batch_free(&file->batches[i].batch);
+  }
+  free(file->batches);
+  file->batches = NULL;
+  file->num_batches = 0;
+
+#ifdef HAVE_SYS_MMAN_H
+  if (file->mapped) {
+    munmap(file->data, file->size);
+    file->data = NULL;
+  }
+#endif
+  free(file->data);
+  file->data = NULL;
+
+  free(file->last_field);
+  file->last_field = NULL;
+}
+
+#ifdef HAVE_PTHREAD_H
+/* Worker thread: takes files in order while not too many of them wait to be parsed */
+static void * rcsv_files_worker(void * data) {
+  struct rcsv_files * files = (struct rcsv_files *)data;
+  size_t index;
+
+  pthread_mutex_lock(&files->lock);
+  while (!files->cancelled && files->next_file < files->num_files) {
+    if (files->next_file - files->num_parsed >= files->max_pending) {
+      pthread_cond_wait(&files->cond, &files->lock);
+      continue;
+    }
+
+    index = files->next_file++;
+    pthread_mutex_unlock(&files->lock);
+
+    rcsv_file_tokenize(files, &files->files[index]);
+
+    pthread_mutex_lock(&files->lock);
+    files->finished[files->num_finished++] = index;
+    pthread_cond_broadcast(&files->cond);
+  }
+  pthread_mutex_unlock(&files->lock);
+
+  return NULL;
+}
+
+/* Waits for a worker to finish a file, without the GVL */
+static void * rcsv_files_wait(void * data) {
+  struct rcsv_files * files = (struct rcsv_files *)data;
+
+  pthread_mutex_lock(&files->lock);
+  while (files->next_finished == files->num_finished && !files->interrupted) {
+    pthread_cond_wait(&files->cond, &files->lock);
+  }
+  files->interrupted = false;
+  pthread_mutex_unlock(&files->lock);
+  return NULL;
+}
+
+/* Wakes the Ruby thread up from rcsv_files_wait() so that it can handle interrupts */
+static void rcsv_files_interrupt(void * data) {
+  struct rcsv_files * files = (struct rcsv_files *)data;
+
+  pthread_mutex_lock(&files->lock);
+  files->interrupted = true;
+  pthread_cond_broadcast(&files->cond);
+  pthread_mutex_unlock(&files->lock);
+}
+#endif
+
+/* Tokenizes the next file on this thread if there are no workers */
+static void * rcsv_files_tokenize_next(void * data) {
+  struct rcsv_files * files = (struct rcsv_files *)data;
+  size_t index = files->next_file++;
+
+  rcsv_file_tokenize(files, &files->files[index]);
+  files->finished[files->num_finished++] = index;
+  return NULL;
+}
+
+/* Stops the workers and frees everything but the object itself */
+static void rcsv_files_close(struct rcsv_files * files) {
+  size_t i;
+
+  if (files->closed) {
+    return;
+  }
+  files->closed = true;
+
+#ifdef HAVE_PTHREAD_H
+  if (files->num_workers > 0) {
+    pthread_mutex_lock(&files->lock);
+    files->cancelled = true;
+    pthread_cond_broadcast(&files->cond);
+    pthread_mutex_unlock(&files->lock);
+
+    for (i = 0; i < (size_t)files->num_workers; i++) {
+      pthread_join(files->workers[i], NULL);
+    }
+    pthread_cond_destroy(&files->cond);
+    pthread_mutex_destroy(&files->lock);
+  }
+  free(files->workers);
+  files->workers = NULL;
+#endif
+
+  for (i = 0; i < files->num_files; i++) {
+    rcsv_file_free(&files->files[i]);
+    free(files->files[i].path);
+  }
+  free(files->files);
+  files->files = NULL;
+  files->num_files = 0;
+
+  free(files->finished);
+  files->finished = NULL;
+}
+
+static void rcsv_files_mark(void * data) {
+  rb_gc_mark(((struct rcsv_files *)data)->options);
+}
+
+static void rcsv_files_free(void * data) {
+  rcsv_files_close((struct rcsv_files *)data);
+  xfree(data);
+}
+
+static const rb_data_type_t rcsv_files_type = {
+  "rcsv_files",
+  { rcsv_files_mark, rcsv_files_free, NULL, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE rcsv_files_alloc(VALUE klass) {
+  struct rcsv_files * files;
+  VALUE self = TypedData_Make_Struct(klass, struct rcsv_files, &rcsv_files_type, files);
+
+  files->options = Qnil;
+  files->closed = true;
+  return self;
+}
+
+static struct rcsv_files * rcsv_get_files(VALUE self) {
+  struct rcsv_files * files = (struct rcsv_files *)rb_check_typeddata(self, &rcsv_files_type);
+
+  if (files->closed) {
+    rb_raise(rcsv_parse_error, "Rcsv::Files has been closed.");
+  }
+
+  return files;
+}
+
+/* def setup(paths, raw_options, threads); ...; end
+   Starts tokenizing the files on up to threads worker threads */
+static VALUE rb_rcsv_files_setup(VALUE self, VALUE paths, VALUE options, VALUE threads) {
+  struct rcsv_files * files = (struct rcsv_files *)rb_check_typeddata(self, &rcsv_files_type);
+  struct rcsv_metadata meta;
+  VALUE option, path;
+  long i;
+  int num_workers = (threads == Qnil) ? RCSV_FILES_THREADS : NUM2INT(threads);
+
+  if (files->options != Qnil) {
+    rb_raise(rb_eRuntimeError, "Rcsv::Files has already been initialized");
+  }
+  if (num_workers < 1) {
+    rb_raise(rcsv_parse_error, ":threads has to be a positive number of threads, but %d was supplied.", num_workers);
+  }
+
+  /* Options are validated once, every file gets a copy of the libcsv settings */
+  paths = rb_ary_dup(rb_convert_type(paths, T_ARRAY, "Array", "to_ary"));
+  for (i = 0; i < RARRAY_LEN(paths); i++) {
+    path = RARRAY_AREF(paths, i);
+    Check_Type(path, T_STRING);
+    if (memchr(RSTRING_PTR(path), '\0', (size_t)RSTRING_LEN(path)) != NULL) {
+      rb_raise(rb_eArgError, "path contains null byte");
+    }
+  }
+  files->options = rb_hash_dup(rb_convert_type(options, T_HASH, "Hash", "to_hash"));
+
+  rcsv_init_metadata(&meta);
+  files->csv_options = rcsv_csv_options(files->options, &meta, false);
+  files->delim = CSV_COMMA;
+  files->quote = CSV_QUOTE;
+
+  option = rb_hash_aref(files->options, ID2SYM(rb_intern("col_sep")));
+  if (option != Qnil) {
+    files->delim = (unsigned char)*StringValuePtr(option);
+  }
+  option = rb_hash_aref(files->options, ID2SYM(rb_intern("quote_char")));
+  if (option != Qnil) {
+    files->quote = (unsigned char)*StringValuePtr(option);
+  }
+
+  files->end_row = SIZE_MAX;
+  option = rb_hash_aref(files->options, ID2SYM(rb_intern("limit_rows")));
+  if (option != Qnil) {
+    files->end_row = NUM2SIZET(option);
+    option = rb_hash_aref(files->options, ID2SYM(rb_intern("offset_rows")));
+    if (option != Qnil) {
+      files->end_row += (size_t)NUM2INT(option);
+    }
+  }
+
+  files->num_files = (size_t)RARRAY_LEN(paths);
+  files->files = (struct rcsv_file *)calloc(files->num_files ? files->num_files : 1, sizeof(struct rcsv_file));
+  files->finished = (size_t *)calloc(files->num_files ? files->num_files : 1, sizeof(size_t));
+  files->closed = false;
+  if (files->files == NULL || files->finished == NULL) {
+    rcsv_files_close(files);
+    rb_raise(rcsv_parse_error, "No memory");
+  }
+
+  for (i = 0; i < RARRAY_LEN(paths); i++) {
+    files->files[i].path = strdup(RSTRING_PTR(RARRAY_AREF(paths, i)));
+    if (files->files[i].path == NULL) {
+      rcsv_files_close(files);
+      rb_raise(rcsv_parse_error, "No memory");
+    }
+  }
+
+  if ((size_t)num_workers > files->num_files) {
+    num_workers = (int)files->num_files;
+  }
+  files->max_pending = 2 * (size_t)num_workers;
+
+#ifdef HAVE_PTHREAD_H
+  if (num_workers > 0 && (files->workers = (pthread_t *)malloc(num_workers * sizeof(pthread_t))) != NULL) {
+    pthread_mutex_init(&files->lock, NULL);
+    pthread_cond_init(&files->cond, NULL);
+    for (files->num_workers = 0; files->num_workers < num_workers; files->num_workers++) {
+      if (pthread_create(&files->workers[files->num_workers], NULL, rcsv_files_worker, files) != 0) {
+        break;
+      }
+    }
+    if (files->num_workers == 0) {
+      pthread_cond_destroy(&files->cond);
+      pthread_mutex_destroy(&files->lock);
+    }
+  }
+#endif
+
+  RB_GC_GUARD(paths);
+  return self;
+}
+
+/* Returns the index of the next tokenized file */
+static VALUE rcsv_files_return(struct rcsv_files * files) {
+  size_t index = files->finished[files->next_finished++];
+
+  files->files[index].returned = true;
+  return SIZET2NUM(index);
+}
+
+/* def next; ...; end
+   Waits for a file to be tokenized and returns its index, nil once all of them have been returned */
+static VALUE rb_rcsv_files_next(VALUE self) {
+  struct rcsv_files * files = rcsv_get_files(self);
+
+  if (files->next_finished == files->num_files) {
+    return Qnil;
+  }
+
+#ifdef HAVE_PTHREAD_H
+  if (files->num_workers > 0) {
+    while (true) {
+#ifdef HAVE_RUBY_THREAD_H
+      rb_thread_call_without_gvl(rcsv_files_wait, files, rcsv_files_interrupt, files);
+#else
+      rcsv_files_wait(files);
+#endif
+      pthread_mutex_lock(&files->lock);
+      if (files->next_finished < files->num_finished) {
+        pthread_mutex_unlock(&files->lock);
+        break;
+      }
+      pthread_mutex_unlock(&files->lock);
+      rb_thread_check_ints();
+    }
+
+    return rcsv_files_return(files);
+  }
+#endif
+
+#ifdef HAVE_RUBY_THREAD_H
+  rb_thread_call_without_gvl(rcsv_files_tokenize_next, files, NULL, NULL);
+#else
+  rcsv_files_tokenize_next(files);
+#endif
+
+  return rcsv_files_return(files);
+}
+
+/* Returns true if libcsv would have filtered rows by now. It has no filter until column options have been set up. */
+static bool rcsv_files_filtered(struct rcsv_metadata * meta) {
+  return meta->configure == Qnil && (meta->only_rows != NULL || meta->except_rows != NULL);
+}
+
+/* Passes the fields of a row to end_of_field_callback(). The column mask and the filter are applied the way
+   csv_parse_batch() and rcsv_parse_batches() would have applied them, but the last field of an unterminated row
+   is passed on by csv_fini(), which doesn't filter. */
+static void rcsv_files_fields(struct rcsv_files_call * call, size_t num_filtered) {
+  struct rcsv_metadata * meta = &call->meta;
+  struct rcsv_files_field * field;
+  size_t col;
+
+  if (rcsv_files_filtered(meta)) {
+    for (col = 0; col < num_filtered && !meta->skip_current_row; col++) {
+      field = &call->fields[col];
+      meta->skip_current_row = !rcsv_column_skipped(meta, col) && rcsv_reject_raw_field(field->str, field->size, col, meta);
+    }
+  }
+
+  for (col = 0; col < call->num_fields && !meta->skip_current_row; col++) {
+    if (!rcsv_column_skipped(meta, col)) {
+      end_of_field_callback((void *)call->fields[col].str, call->fields[col].size, meta);
+    }
+  }
+
+  call->num_fields = 0;
+}
+
+/* Appends a field to the row that is being built */
+static void rcsv_files_field(struct rcsv_files_call * call, const char * field_str, size_t field_size) {
+  struct rcsv_files_field * fields;
+
+  if (call->num_fields == call->fields_size) {
+    call->fields_size = call->fields_size ? call->fields_size * 2 : 64;
+    if ((fields = (struct rcsv_files_field *)realloc(call->fields, call->fields_size * sizeof(struct rcsv_files_field))) == NULL) {
+      rb_raise(rcsv_parse_error, "No memory");
+    }
+    call->fields = fields;
+  }
+
+  call->fields[call->num_fields].str = field_str;
+  call->fields[call->num_fields].size = field_size;
+  call->num_fields++;
+}
+
+/* Appends a field of a batch to the row that is being built */
+static void rcsv_files_batch_field(struct rcsv_files_call * call, struct csv_batch * batch, size_t i, const char * input) {
+  if (batch->flags[i] & CSV_FIELD_NULL) {
+    rcsv_files_field(call, NULL, 0);
+  } else if (batch->flags[i] & CSV_FIELD_BUFFERED) {
+    rcsv_files_field(call, (const char *)batch->buf + batch->offsets[i], batch->lengths[i]);
+  } else {
+    rcsv_files_field(call, input + batch->offsets[i], batch->lengths[i]);
   }
+}
 
- /* Column names should be declared explicitly when parsing fields as Hashes */
-  if (meta->row_as_hash) { /* Only matters for hash results */
-    option = rb_hash_aref(options, ID2SYM(rb_intern("column_names")));
-    if (option == Qnil) {
-      rb_raise(rcsv_parse_error, ":row_as_hash requires :column_names to be set.");
-    } else {
-      meta->last_entry = rb_hash_new();
+/* Parses a compressed file just like Rcsv.raw_parse does */
+static VALUE rcsv_files_parse_io(VALUE data) {
+  struct rcsv_files_call * call = (struct rcsv_files_call *)data;
+  VALUE argv[2];
 
-      meta->num_columns = (size_t)RARRAY_LEN(option);
-      meta->column_names = (VALUE*)malloc(meta->num_columns * sizeof(VALUE*));
+  argv[0] = call->io;
+  argv[1] = call->files->options;
+  return rb_rcsv_raw_parse(2, argv, Qnil);
+}
 
-      for (i = 0; i < meta->num_columns; i++) {
-        meta->column_names[i] = rb_ary_entry(option, i);
+/* An rb_ensure()-compatible function that builds the rows of a file */
+static VALUE rcsv_files_parse(VALUE data) {
+  struct rcsv_files_call * call = (struct rcsv_files_call *)data;
+  struct rcsv_file * file = call->file;
+  struct csv_batch * batch;
+  const char * input;
+  size_t i, field, row, col;
+
+  if (file->error != 0) {
+    rb_syserr_fail(file->error, file->path);
+  }
+
+  if (file->compressed) {
+    call->io = rb_file_open(file->path, "rb");
+    return rb_ensure(rcsv_files_parse_io, data, rb_io_close, call->io);
+  }
+
+  if (csv_init(&call->cp, rcsv_csv_options(call->files->options, &call->meta, false)) == -1) {
+    rb_raise(rcsv_parse_error, "Couldn't initialize libcsv");
+  }
+  call->cp_ready = true;
+  rcsv_setup(call->files->options, &call->meta, &call->cp);
+
+  for (i = 0; i < file->num_batches; i++) {
+    batch = &file->batches[i].batch;
+    input = file->batches[i].input;
+
+    field = 0;
+    for (row = 0; row < batch->rows; row++) {
+      /* Rows that can't be rejected are passed on as they are, unless they continue from the previous batch */
+      if (call->num_fields == 0 && !rcsv_files_filtered(&call->meta)) {
+        for (col = 0; field < batch->row_ends[row]; field++, col++) {
+          if (!rcsv_column_skipped(&call->meta, col)) {
+            rcsv_batch_field(batch, field, input, &call->meta);
+          }
+        }
+      } else {
+        for (; field < batch->row_ends[row]; field++) {
+          rcsv_files_batch_field(call, batch, field, input);
+        }
+        rcsv_files_fields(call, call->num_fields);
       }
+
+      end_of_line_callback(batch->row_terms[row], &call->meta);
+    }
+
+    /* Fields past the last row belong to a row that continues in the next batch */
+    for (; field < batch->fields; field++) {
+      rcsv_files_batch_field(call, batch, field, input);
     }
+  }
+
+  if (file->last_row) {
+    rcsv_files_field(call, file->last_field_null ? NULL : (file->last_field ? file->last_field : ""), file->last_field_size);
+    rcsv_files_fields(call, call->num_fields - 1);
+    end_of_line_callback(-1, &call->meta);
   } else {
-    meta->last_entry = rb_ary_new();
+    /* Fields of a row that csv_fini() has dropped are still passed on, just like they are by the usual parse */
+    rcsv_files_fields(call, call->num_fields);
+  }
+
+  /* Rows up to a malformed one have been built, just like they are by the usual parse */
+  if (file->status != CSV_SUCCESS) {
+    call->cp.status = file->status;
+    rcsv_raise_csv_error(&call->cp);
   }
 
-  while(true) {
-    csvstr = rb_funcall(csvio, rb_intern("read"), 1, buffer_size);
-    if ((csvstr == Qnil) || (RSTRING_LEN(csvstr) == 0)) { break; }
+  /* :configure is called even if there are no rows */
+  if (call->meta.configure != Qnil) {
+    rcsv_end_header(&call->meta);
+  }
 
-    csv_string = StringValuePtr(csvstr);
-    csv_string_len = strlen(csv_string);
+  return rcsv_parse_result(&call->meta);
+}
 
-    /* Actual parsing and error handling */
-    if (csv_string_len != csv_parse(cp, csv_string, csv_string_len,
-                                    &end_of_field_callback, &end_of_line_callback, meta)) {
-      error = csv_error(cp);
-      switch(error) {
-        case CSV_EPARSE:
-          rb_raise(rcsv_parse_error, "Error when parsing malformed data");
-          break;
-        case CSV_ENOMEM:
-          rb_raise(rcsv_parse_error, "No memory");
-          break;
-        case CSV_ETOOBIG:
-          rb_raise(rcsv_parse_error, "Field data is too large");
-          break;
-        case CSV_EINVALID:
-          rb_raise(rcsv_parse_error, "%s", (const char *)csv_strerror(error));
-        break;
-        default:
-          rb_raise(rcsv_parse_error, "Failed due to unknown reason");
+/* Frees the parse and the fields of the file, letting workers take more files */
+static VALUE rcsv_files_release(VALUE data) {
+  struct rcsv_files_call * call = (struct rcsv_files_call *)data;
+  struct rcsv_files * files = call->files;
+
+  free_memory(call->cp_ready ? &call->cp : NULL, &call->meta);
+  free(call->fields);
+  rcsv_file_free(call->file);
+
+#ifdef HAVE_PTHREAD_H
+  if (files->num_workers > 0) {
+    pthread_mutex_lock(&files->lock);
+    files->num_parsed++;
+    pthread_cond_broadcast(&files->cond);
+    pthread_mutex_unlock(&files->lock);
+    return Qnil;
+  }
+#endif
+
+  files->num_parsed++;
+  return Qnil;
+}
+
+/* def parse(index); ...; end
+   Returns the rows of a file that #next has returned, raising if it couldn't be read or parsed */
+static VALUE rb_rcsv_files_parse(VALUE self, VALUE index) {
+  struct rcsv_files * files = rcsv_get_files(self);
+  struct rcsv_files_call call;
+  size_t i = NUM2SIZET(index);
+
+  if (i >= files->num_files || !files->files[i].returned || files->files[i].parsed) {
+    rb_raise(rcsv_parse_error, "File %lu hasn't been returned by Rcsv::Files#next, or has been parsed already.", (unsigned long)i);
+  }
+  files->files[i].parsed = true;
+
+  memset(&call, 0, sizeof(call));
+  call.files = files;
+  call.file = &files->files[i];
+  call.result = rb_ary_new();
+  call.io = Qnil;
+  rcsv_init_metadata(&call.meta);
+  call.meta.result = &call.result;
+
+  return rb_ensure(rcsv_files_parse, (VALUE)&call, rcsv_files_release, (VALUE)&call);
+}
+
+/* def close; ...; end
+   Stops the workers and frees the files that haven't been parsed */
+static VALUE rb_rcsv_files_close(VALUE self) {
+  rcsv_files_close((struct rcsv_files *)rb_check_typeddata(self, &rcsv_files_type));
+  return Qnil;
+}
+
+/* Writer. Fields are scanned for characters that need quoting once, escaped with csv_write2() straight into
+   String blocks, and blocks are handed to the IO together once enough output has been buffered. */
+
+/* Size of a single block of output */
+#define RCSV_WRITE_BLOCK_SIZE (64 * 1024)
+
+/* Default amount of output that is buffered before it is written, see :buffer_size write option */
+#define RCSV_WRITE_BUFFER_SIZE (1024 * 1024)
+
+struct rcsv_writer {
+  VALUE self;                 /* Rcsv instance, its #process formats columns that have a :formatter */
+  VALUE column_separator;
+  VALUE newline_delimiter;
+  VALUE columns;              /* Array of column options, or Qnil */
+  VALUE io;                   /* IO that output is written to, Qnil for #generate_row */
+  VALUE buffer;               /* Block that rows are currently written to */
+  VALUE blocks;               /* Full blocks that haven't been written yet */
+  size_t buffered;            /* Number of bytes in blocks */
+  size_t buffer_size;         /* Output is written once this many bytes are buffered */
+  bool writev;                /* io.write accepts several Strings at once */
+  bool ascii_only;            /* Nothing but ASCII has been written to buffer, so its encoding isn't settled yet */
+  unsigned char quote;
+  bool quotable[256];         /* Bytes that make a field quoted: ASCII separator, newline delimiter and quote characters */
+  VALUE quotable_chars;       /* Multibyte separator and newline delimiter characters, they are searched for as a whole */
+};
+
+/* Starts a new block. Like String#<<, it takes the encoding of the first non-ASCII String written to it. */
+static void rcsv_writer_reset(struct rcsv_writer * writer, long capacity) {
+  writer->buffer = rb_str_buf_new(capacity);
+#ifdef HAVE_RUBY_ENCODING_H
+  rb_enc_associate(writer->buffer, rb_utf8_encoding());
+#endif
+  writer->ascii_only = true;
+}
+
+/* Makes fields that contain any character of str quoted. ASCII characters are looked up by byte, multibyte
+   ones are kept whole so that fields sharing some of their bytes aren't quoted. */
+static void rcsv_writer_quotable(struct rcsv_writer * writer, VALUE str) {
+  VALUE chars = rb_funcall(str, rb_intern("chars"), 0);
+  VALUE chr;
+  long i;
+
+  for (i = 0; i < RARRAY_LEN(chars); i++) {
+    chr = RARRAY_AREF(chars, i);
+    if (RSTRING_LEN(chr) == 1 && !((unsigned char)RSTRING_PTR(chr)[0] & 0x80)) {
+      writer->quotable[(unsigned char)RSTRING_PTR(chr)[0]] = true;
+    } else {
+      rb_ary_push(writer->quotable_chars, chr);
+    }
+  }
+
+  RB_GC_GUARD(chars);
+}
+
+/* Returns true if the field contains a multibyte character that makes it quoted */
+static bool rcsv_writer_quotable_chars(struct rcsv_writer * writer, const char * field_str, size_t field_size) {
+  const char * found, * end = field_str + field_size;
+  VALUE chr;
+  long i;
+
+  for (i = 0; i < RARRAY_LEN(writer->quotable_chars); i++) {
+    chr = RARRAY_AREF(writer->quotable_chars, i);
+    for (found = field_str; (found = memchr(found, RSTRING_PTR(chr)[0], (size_t)(end - found))) != NULL; found++) {
+      if ((size_t)(end - found) >= (size_t)RSTRING_LEN(chr) && memcmp(found, RSTRING_PTR(chr), RSTRING_LEN(chr)) == 0) {
+        return true;
       }
     }
   }
 
-  /* Flushing libcsv's buffer */
-  csv_fini(cp, &end_of_field_callback, &end_of_line_callback, meta);
+  return false;
+}
 
-  return Qnil;
+/* Reads the write options of an Rcsv instance */
+static void rcsv_writer_init(struct rcsv_writer * writer, VALUE self, VALUE io) {
+  VALUE options = rb_ivar_get(self, rb_intern("@write_options"));
+  VALUE option;
+
+  writer->self = self;
+  writer->io = io;
+  writer->column_separator = rb_hash_aref(options, ID2SYM(rb_intern("column_separator")));
+  writer->newline_delimiter = rb_hash_aref(options, ID2SYM(rb_intern("newline_delimiter")));
+  writer->columns = rb_hash_aref(options, ID2SYM(rb_intern("columns")));
+  StringValue(writer->column_separator);
+  StringValue(writer->newline_delimiter);
+
+  writer->quote = '"';
+  memset(writer->quotable, 0, sizeof(writer->quotable));
+  writer->quotable[writer->quote] = true;
+  writer->quotable_chars = rb_ary_new();
+  rcsv_writer_quotable(writer, writer->column_separator);
+  rcsv_writer_quotable(writer, writer->newline_delimiter);
+
+  option = rb_hash_aref(options, ID2SYM(rb_intern("buffer_size")));
+  writer->buffer_size = (option == Qnil) ? RCSV_WRITE_BUFFER_SIZE : NUM2SIZET(option);
+  writer->blocks = rb_ary_new();
+  writer->buffered = 0;
+
+  /* IO#write and StringIO#write take any number of Strings, other IO-like objects may only take one */
+  writer->writev = (io != Qnil) && (rb_obj_method_arity(io, rb_intern("write")) < 0);
+
+  rcsv_writer_reset(writer, (io == Qnil) ? 128 : RCSV_WRITE_BLOCK_SIZE);
 }
 
-/* C API */
+/* Settles the encoding of the buffer on the first non-ASCII String, later ones have to be compatible with it.
+   Like String#<<, raises Encoding::CompatibilityError otherwise. */
+static void rcsv_writer_encoding(struct rcsv_writer * writer, VALUE str) {
+#ifdef HAVE_RUBY_ENCODING_H
+  if (writer->ascii_only) {
+    rb_enc_associate(writer->buffer, rb_enc_get(str));
+    writer->ascii_only = false;
+  } else {
+    rb_enc_check(writer->buffer, str);
+  }
+#endif
+}
 
-/* The main method that handles parsing */
-static VALUE rb_rcsv_raw_parse(int argc, VALUE * argv, VALUE self) {
-  struct rcsv_metadata meta;
-  VALUE csvio, options, option;
-  VALUE ensure_container = rb_ary_new(); /* [] */
+/* Appends bytes of a String to the buffer as they are */
+static void rcsv_writer_cat(struct rcsv_writer * writer, VALUE str) {
+#ifdef HAVE_RUBY_ENCODING_H
+  if (!rb_enc_str_asciionly_p(str)) {
+    rcsv_writer_encoding(writer, str);
+  }
+#endif
 
-  struct csv_parser cp;
-  unsigned char csv_options = CSV_STRICT_FINI | CSV_APPEND_NULL;
-
-  /* Setting up some sane defaults */
-  meta.row_as_hash = false;
-  meta.empty_field_is_nil = false;
-  meta.skip_current_row = false;
-  meta.encoding_index = -1;
-  meta.num_columns = 0;
-  meta.current_col = 0;
-  meta.current_row = 0;
-  meta.offset_rows = 0;
-  meta.num_only_rows = 0;
-  meta.num_except_rows = 0;
-  meta.num_row_defaults = 0;
-  meta.num_row_conversions = 0;
-  meta.only_rows = NULL;
-  meta.except_rows = NULL;
-  meta.row_defaults = NULL;
-  meta.row_conversions = NULL;
-  meta.column_names = NULL;
-  meta.result = (VALUE[]){rb_ary_new()}; /* [] */
+  rb_str_cat(writer->buffer, RSTRING_PTR(str), RSTRING_LEN(str));
+}
 
-  /* csvio is required, options is optional (pun intended) */
-  rb_scan_args(argc, argv, "11", &csvio, &options);
+/* Appends a field, quoting it if it contains separator, newline delimiter or quote characters.
+   str is the String the bytes come from, if any, and only matters for the encoding of the buffer. */
+static void rcsv_writer_bytes(struct rcsv_writer * writer, const char * field_str, size_t field_size, VALUE str) {
+  const unsigned char * bytes = (const unsigned char *)field_str;
+  unsigned char high = 0;
+  bool quoted = false;
+  size_t i, length, capacity;
 
-  /* options ||= {} */
-  if (NIL_P(options)) {
-    options = rb_hash_new();
+  for (i = 0; i < field_size; i++) {
+    quoted |= writer->quotable[bytes[i]];
+    high |= bytes[i];
   }
 
-  /* First of all, we parse libcsv-related params so that it fails early if something is wrong with them */
+  if ((high & 0x80) && str != Qnil) {
+    rcsv_writer_encoding(writer, str);
+  }
 
-  /* By default, parsing is strict */
-  option = rb_hash_aref(options, ID2SYM(rb_intern("nostrict")));
-  if (!option || (option == Qnil)) {
-    csv_options |= CSV_STRICT;
+  if (!quoted && RARRAY_LEN(writer->quotable_chars) > 0) {
+    quoted = rcsv_writer_quotable_chars(writer, field_str, field_size);
   }
 
-  /* By default, empty strings are treated as Nils and quoted empty strings are treated as empty Ruby strings */
-  option = rb_hash_aref(options, ID2SYM(rb_intern("parse_empty_fields_as")));
-  if ((option == Qnil) || (option == ID2SYM(rb_intern("nil_or_string")))) {
-    csv_options |= CSV_EMPTY_IS_NULL;
-  } else if (option == ID2SYM(rb_intern("nil"))) {
-    meta.empty_field_is_nil = true;
-  } else if (option == ID2SYM(rb_intern("string"))) {
-    meta.empty_field_is_nil = false;
+  if (quoted) {
+    length = (size_t)RSTRING_LEN(writer->buffer);
+    capacity = field_size * 2 + 2; /* Every character may be a quote */
+    rb_str_modify_expand(writer->buffer, (long)capacity);
+    rb_str_set_len(writer->buffer, (long)(length + csv_write2(RSTRING_PTR(writer->buffer) + length, capacity,
+                                                              field_str, field_size, writer->quote)));
   } else {
-    rb_raise(rcsv_parse_error, "The only valid options for :parse_empty_fields_as are :nil, :string and :nil_or_string, but %s was supplied.", RSTRING_PTR(rb_inspect(option)));
+    rb_str_cat(writer->buffer, field_str, (long)field_size);
   }
+}
 
-  /* rb_ensure() only expects callback functions to accept and return VALUEs */
-  /* This ugly hack converts C pointers into Ruby Fixnums in order to pass them in Array */
-  rb_ary_push(ensure_container, options);               /* [options] */
-  rb_ary_push(ensure_container, csvio);                 /* [options, csvio] */
-  rb_ary_push(ensure_container, LONG2NUM((long)&meta)); /* [options, csvio, &meta] */
-  rb_ary_push(ensure_container, LONG2NUM((long)&cp));   /* [options, csvio, &meta, &cp] */
+/* Appends a field, formatted by Rcsv#process if its column has a :formatter */
+static void rcsv_writer_field(struct rcsv_writer * writer, VALUE field, VALUE column_options) {
+  char digits[24];
+  VALUE str;
 
-  /* Try to initialize libcsv */
-  if (csv_init(&cp, csv_options) == -1) {
-    rb_raise(rcsv_parse_error, "Couldn't initialize libcsv");
+  if (field == Qnil) {
+    return;
   }
 
-  /* From now on, cp handles allocated data and should be free'd on exit or exception */
-  rb_ensure(rcsv_raw_parse, ensure_container, rcsv_free_memory, ensure_container);
+  if (column_options != Qnil &&
+      (!RB_TYPE_P(column_options, T_HASH) || RTEST(rb_hash_aref(column_options, ID2SYM(rb_intern("formatter")))))) {
+    str = rb_funcall(writer->self, rb_intern("process"), 2, field, column_options);
+    StringValue(str);
+  } else if (RB_TYPE_P(field, T_STRING)) {
+    str = field;
+  } else if (FIXNUM_P(field)) {
+    rcsv_writer_bytes(writer, digits, (size_t)snprintf(digits, sizeof(digits), "%ld", FIX2LONG(field)), Qnil);
+    return;
+  } else if (field == Qtrue) {
+    rcsv_writer_bytes(writer, "true", 4, Qnil);
+    return;
+  } else if (field == Qfalse) {
+    rcsv_writer_bytes(writer, "false", 5, Qnil);
+    return;
+  } else if (SYMBOL_P(field)) {
+    str = rb_sym2str(field);
+  } else {
+    str = rb_obj_as_string(field);
+  }
 
-  /* Remove the last row if it's empty. That happens if CSV file ends with a newline. */
-  if (RARRAY_LEN(*(meta.result)) && /* meta.result.size != 0 */
-      RARRAY_LEN(rb_ary_entry(*(meta.result), -1)) == 0) {
-    rb_ary_pop(*(meta.result));
+  rcsv_writer_bytes(writer, RSTRING_PTR(str), (size_t)RSTRING_LEN(str), str);
+  RB_GC_GUARD(str);
+}
+
+/* Passes everything buffered so far to the IO, in a single io.write call where possible */
+static VALUE rcsv_writer_flush(VALUE data) {
+  struct rcsv_writer * writer = (struct rcsv_writer *)data;
+  VALUE blocks = writer->blocks;
+  long i;
+
+  if (RSTRING_LEN(writer->buffer) > 0) {
+    rb_ary_push(blocks, writer->buffer);
+    rcsv_writer_reset(writer, RCSV_WRITE_BLOCK_SIZE);
   }
 
-  if (rb_block_given_p()) {
-    return Qnil; /* STREAMING */
+  if (RARRAY_LEN(blocks) == 0) {
+    return Qnil;
+  }
+
+  /* Blocks are handed over to the IO, new ones are used from now on */
+  writer->blocks = rb_ary_new();
+  writer->buffered = 0;
+
+  if (writer->writev) {
+    rb_funcallv(writer->io, rb_intern("write"), RARRAY_LENINT(blocks), RARRAY_CONST_PTR(blocks));
+  } else {
+    for (i = 0; i < RARRAY_LEN(blocks); i++) {
+      rb_io_write(writer->io, RARRAY_AREF(blocks, i));
+    }
+  }
+
+  RB_GC_GUARD(blocks);
+  return Qnil;
+}
+
+/* Finishes a row: starts a new block if the current one is full, and writes output once enough is buffered */
+static void rcsv_writer_end_row(struct rcsv_writer * writer) {
+  rcsv_writer_cat(writer, writer->newline_delimiter);
+
+  if (writer->io == Qnil) {
+    return;
+  }
+
+  if (RSTRING_LEN(writer->buffer) >= RCSV_WRITE_BLOCK_SIZE) {
+    writer->buffered += (size_t)RSTRING_LEN(writer->buffer);
+    rb_ary_push(writer->blocks, writer->buffer);
+    rcsv_writer_reset(writer, RCSV_WRITE_BLOCK_SIZE);
+  }
+
+  if (writer->buffered + (size_t)RSTRING_LEN(writer->buffer) >= writer->buffer_size) {
+    rcsv_writer_flush((VALUE)writer);
+  }
+}
+
+/* Fields of a row that rcsv_writer_fields() appends */
+struct rcsv_writer_row_call {
+  struct rcsv_writer * writer;
+  VALUE fields;               /* The row, or the columns of columnar input */
+  long row;                   /* Row of columnar input, -1 if fields is the row */
+};
+
+/* An rb_protect()-compatible function that appends fields joined by the column separator */
+static VALUE rcsv_writer_fields(VALUE data) {
+  struct rcsv_writer_row_call * call = (struct rcsv_writer_row_call *)data;
+  struct rcsv_writer * writer = call->writer;
+  VALUE field;
+  long i;
+
+  for (i = 0; i < RARRAY_LEN(call->fields); i++) {
+    if (i > 0) {
+      rcsv_writer_cat(writer, writer->column_separator);
+    }
+    field = (call->row < 0) ? RARRAY_AREF(call->fields, i) : rb_ary_entry(RARRAY_AREF(call->fields, i), call->row);
+    rcsv_writer_field(writer, field, (writer->columns == Qnil) ? Qnil : rb_ary_entry(writer->columns, i));
+  }
+
+  return Qnil;
+}
+
+/* Appends a row followed by the newline delimiter. If a field raises, the part of the row that has been
+   appended is removed again, so that a half-written row is never flushed. */
+static void rcsv_writer_append_row(struct rcsv_writer_row_call * call) {
+  struct rcsv_writer * writer = call->writer;
+  long length = RSTRING_LEN(writer->buffer);
+  bool ascii_only = writer->ascii_only;
+  int state;
+
+  rb_protect(rcsv_writer_fields, (VALUE)call, &state);
+
+  if (state) {
+    rb_str_set_len(writer->buffer, length);
+#ifdef HAVE_RUBY_ENCODING_H
+    if (ascii_only && !writer->ascii_only) {
+      rb_enc_associate(writer->buffer, rb_utf8_encoding());
+      writer->ascii_only = true;
+    }
+#endif
+    rb_jump_tag(state);
+  }
+
+  rcsv_writer_end_row(writer);
+}
+
+/* Appends a row: fields joined by the column separator and followed by the newline delimiter */
+static void rcsv_writer_row(struct rcsv_writer * writer, VALUE row) {
+  struct rcsv_writer_row_call call;
+
+  call.writer = writer;
+  call.fields = rb_convert_type(row, T_ARRAY, "Array", "to_a");
+  call.row = -1;
+  rcsv_writer_append_row(&call);
+  RB_GC_GUARD(call.fields);
+}
+
+/* Appends rows of columnar input, a Hash of column => Array of values as returned by :result => :columns.
+   Short columns are padded with empty fields. */
+static void rcsv_writer_columns(struct rcsv_writer * writer, VALUE input) {
+  struct rcsv_writer_row_call call;
+  VALUE columns = rb_funcall(input, rb_intern("values"), 0);
+  long i, num_rows = 0;
+
+  for (i = 0; i < RARRAY_LEN(columns); i++) {
+    rb_ary_store(columns, i, rb_convert_type(RARRAY_AREF(columns, i), T_ARRAY, "Array", "to_a"));
+    if (RARRAY_LEN(RARRAY_AREF(columns, i)) > num_rows) {
+      num_rows = RARRAY_LEN(RARRAY_AREF(columns, i));
+    }
+  }
+
+  call.writer = writer;
+  call.fields = columns;
+  for (call.row = 0; call.row < num_rows; call.row++) {
+    rcsv_writer_append_row(&call);
+  }
+  RB_GC_GUARD(columns);
+}
+
+/* rb_block_call() function that appends a row of an Enumerable */
+static VALUE rcsv_writer_each_row(RB_BLOCK_CALL_FUNC_ARGLIST(row, data)) {
+  rcsv_writer_row((struct rcsv_writer *)data, row);
+  return Qnil;
+}
+
+/* Arguments of rcsv_writer_rows(), passed through rb_ensure() */
+struct rcsv_writer_rows_call {
+  struct rcsv_writer * writer;
+  VALUE rows;
+};
+
+/* Appends an Array or Enumerable of rows, or columnar input if it's a Hash */
+static VALUE rcsv_writer_rows(VALUE data) {
+  struct rcsv_writer * writer = ((struct rcsv_writer_rows_call *)data)->writer;
+  VALUE rows = ((struct rcsv_writer_rows_call *)data)->rows;
+  long i;
+
+  if (RB_TYPE_P(rows, T_HASH)) {
+    rcsv_writer_columns(writer, rows);
+  } else if (RB_TYPE_P(rows, T_ARRAY)) {
+    for (i = 0; i < RARRAY_LEN(rows); i++) {
+      rcsv_writer_row(writer, RARRAY_AREF(rows, i));
+    }
   } else {
-    return *(meta.result); /* Return accumulated result */
+    rb_block_call(rows, rb_intern("each"), 0, NULL, rcsv_writer_each_row, (VALUE)writer);
+  }
+
+  return Qnil;
+}
+
+/* Writes rows yielded by the block until it returns nil or false */
+static VALUE rcsv_writer_yielded_rows(VALUE data) {
+  struct rcsv_writer * writer = (struct rcsv_writer *)data;
+  VALUE row;
+
+  while (RTEST(row = rb_yield_values(0))) {
+    rcsv_writer_row(writer, row);
+  }
+
+  return Qnil;
+}
+
+/* Writes the header if the :header write option is set */
+static void rcsv_writer_header(struct rcsv_writer * writer) {
+  VALUE options = rb_ivar_get(writer->self, rb_intern("@write_options"));
+
+  if (RTEST(rb_hash_aref(options, ID2SYM(rb_intern("header"))))) {
+    rcsv_writer_cat(writer, rb_funcall(writer->self, rb_intern("generate_header"), 0));
+  }
+}
+
+/* def write(io); while row = yield; ...; end; end
+   Rows that have been buffered are written even if the block raises. */
+static VALUE rb_rcsv_write(VALUE self, VALUE io) {
+  struct rcsv_writer writer;
+
+  rcsv_writer_init(&writer, self, io);
+  rcsv_writer_header(&writer);
+  rb_ensure(rcsv_writer_yielded_rows, (VALUE)&writer, rcsv_writer_flush, (VALUE)&writer);
+  return Qnil;
+}
+
+/* def write_rows(io, rows); ...; end */
+static VALUE rb_rcsv_write_rows(VALUE self, VALUE io, VALUE rows) {
+  struct rcsv_writer writer;
+  struct rcsv_writer_rows_call call;
+
+  rcsv_writer_init(&writer, self, io);
+  rcsv_writer_header(&writer);
+  call.writer = &writer;
+  call.rows = rows;
+  rb_ensure(rcsv_writer_rows, (VALUE)&call, rcsv_writer_flush, (VALUE)&writer);
+  RB_GC_GUARD(rows);
+  return Qnil;
+}
+
+/* def generate_row(row); ...; end */
+static VALUE rb_rcsv_generate_row(VALUE self, VALUE row) {
+  struct rcsv_writer writer;
+
+  rcsv_writer_init(&writer, self, Qnil);
+  rcsv_writer_row(&writer, row);
+  return writer.buffer;
+}
+
+/* Rcsv::Writer keeps a writer between calls, so that rows can be added one by one or in batches */
+
+static void rcsv_writer_mark(void * data) {
+  struct rcsv_writer * writer = (struct rcsv_writer *)data;
+
+  rb_gc_mark(writer->self);
+  rb_gc_mark(writer->column_separator);
+  rb_gc_mark(writer->newline_delimiter);
+  rb_gc_mark(writer->columns);
+  rb_gc_mark(writer->io);
+  rb_gc_mark(writer->buffer);
+  rb_gc_mark(writer->blocks);
+  rb_gc_mark(writer->quotable_chars);
+}
+
+static const rb_data_type_t rcsv_writer_type = {
+  "rcsv_writer",
+  { rcsv_writer_mark, RUBY_TYPED_DEFAULT_FREE, NULL, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE rcsv_writer_alloc(VALUE klass) {
+  struct rcsv_writer * writer;
+  VALUE self = TypedData_Make_Struct(klass, struct rcsv_writer, &rcsv_writer_type, writer);
+
+  writer->self = Qnil;
+  writer->column_separator = Qnil;
+  writer->newline_delimiter = Qnil;
+  writer->columns = Qnil;
+  writer->io = Qnil;
+  writer->buffer = Qnil;
+  writer->blocks = Qnil;
+  writer->quotable_chars = Qnil;
+  return self;
+}
+
+static struct rcsv_writer * rcsv_get_writer(VALUE self) {
+  struct rcsv_writer * writer = (struct rcsv_writer *)rb_check_typeddata(self, &rcsv_writer_type);
+
+  if (writer->io == Qnil) {
+    rb_raise(rb_eRuntimeError, "Rcsv::Writer hasn't been initialized");
+  }
+
+  return writer;
+}
+
+/* def initialize(io, write_options = {}); ...; end
+   Takes the same options as Rcsv.new, the header is buffered right away if :header is set. */
+static VALUE rb_rcsv_writer_initialize(int argc, VALUE * argv, VALUE self) {
+  struct rcsv_writer * writer = (struct rcsv_writer *)rb_check_typeddata(self, &rcsv_writer_type);
+  VALUE io, options, rcsv;
+
+  rb_scan_args(argc, argv, "11", &io, &options);
+  if (NIL_P(options)) {
+    options = rb_hash_new();
   }
+
+  rcsv = rb_class_new_instance(1, &options, rb_path2class("Rcsv"));
+  rcsv_writer_init(writer, rcsv, io);
+  rcsv_writer_header(writer);
+  return self;
+}
+
+/* def <<(row); ...; end */
+static VALUE rb_rcsv_writer_append(VALUE self, VALUE row) {
+  rcsv_writer_row(rcsv_get_writer(self), row);
+  return self;
+}
+
+/* def write_rows(rows); ...; end */
+static VALUE rb_rcsv_writer_write_rows(VALUE self, VALUE rows) {
+  struct rcsv_writer_rows_call call;
+
+  call.writer = rcsv_get_writer(self);
+  call.rows = rows;
+  rcsv_writer_rows((VALUE)&call);
+  RB_GC_GUARD(rows);
+  return self;
+}
+
+/* def flush; ...; end */
+static VALUE rb_rcsv_writer_flush(VALUE self) {
+  rcsv_writer_flush((VALUE)rcsv_get_writer(self));
+  return self;
 }
 
 /* Define Ruby API */
@@ -545,4 +4931,60 @@ void Init_rcsv(void) {
 
   /* def Rcsv.raw_parse; ...; end */
   rb_define_singleton_method(klass, "raw_parse", rb_rcsv_raw_parse, -1);
+
+  /* def Rcsv.raw_index; ...; end */
+  rb_define_singleton_method(klass, "raw_index", rb_rcsv_raw_index, -1);
+
+  /* def write(io); ...; end; def write_rows(io, rows); ...; end; def generate_row(row); ...; end */
+  rb_define_method(klass, "write", rb_rcsv_write, 1);
+  rb_define_method(klass, "write_rows", rb_rcsv_write_rows, 2);
+  rb_define_method(klass, "generate_row", rb_rcsv_generate_row, 1);
+
+  /* class Rcsv::Writer; def <<(row); ...; end; def write_rows(rows); ...; end; def flush; ...; end; end */
+  rcsv_writer_class = rb_define_class_under(klass, "Writer", rb_cObject);
+  rb_define_alloc_func(rcsv_writer_class, rcsv_writer_alloc);
+  rb_define_method(rcsv_writer_class, "initialize", rb_rcsv_writer_initialize, -1);
+  rb_define_method(rcsv_writer_class, "<<", rb_rcsv_writer_append, 1);
+  rb_define_method(rcsv_writer_class, "write_rows", rb_rcsv_writer_write_rows, 1);
+  rb_define_method(rcsv_writer_class, "flush", rb_rcsv_writer_flush, 0);
+
+  /* class Rcsv::Parser; include Enumerable; def feed(chunk); ...; end; def finish; ...; end; def each; ...; end; end */
+  rcsv_parser_class = rb_define_class_under(klass, "Parser", rb_cObject);
+  rb_define_alloc_func(rcsv_parser_class, rcsv_parser_alloc);
+  rb_include_module(rcsv_parser_class, rb_mEnumerable);
+  rb_define_private_method(rcsv_parser_class, "setup", rb_rcsv_parser_setup, 2);
+  rb_define_method(rcsv_parser_class, "feed", rb_rcsv_parser_feed, 1);
+  rb_define_method(rcsv_parser_class, "finish", rb_rcsv_parser_finish, 0);
+  rb_define_method(rcsv_parser_class, "each", rb_rcsv_parser_each, 0);
+
+  /* class Rcsv::Plan; def parse(csv_string); ...; end; end */
+  rcsv_plan_class = rb_define_class_under(klass, "Plan", rb_cObject);
+  rb_define_alloc_func(rcsv_plan_class, rcsv_plan_alloc);
+  rb_define_private_method(rcsv_plan_class, "setup", rb_rcsv_plan_setup, 2);
+  rb_define_method(rcsv_plan_class, "parse", rb_rcsv_plan_parse, 1);
+
+  /* class Rcsv::Files; def next; ...; end; def parse(index); ...; end; def close; ...; end; end */
+  rcsv_files_class = rb_define_class_under(klass, "Files", rb_cObject);
+  rb_define_alloc_func(rcsv_files_class, rcsv_files_alloc);
+  rb_define_private_method(rcsv_files_class, "setup", rb_rcsv_files_setup, 3);
+  rb_define_method(rcsv_files_class, "next", rb_rcsv_files_next, 0);
+  rb_define_method(rcsv_files_class, "parse", rb_rcsv_files_parse, 1);
+  rb_define_method(rcsv_files_class, "close", rb_rcsv_files_close, 0);
+
+  /* class Rcsv::Pool; def stats; ...; end; end */
+  rcsv_pool_class = rb_define_class_under(klass, "Pool", rb_cObject);
+  rb_define_alloc_func(rcsv_pool_class, rcsv_pool_alloc);
+  rb_define_method(rcsv_pool_class, "stats", rb_rcsv_pool_stats, 0);
+
+  /* class Rcsv::Row; include Enumerable; def [](key); ...; end; ...; end */
+  rcsv_row_class = rb_define_class_under(klass, "Row", rb_cObject);
+  rb_undef_alloc_func(rcsv_row_class);
+  rb_include_module(rcsv_row_class, rb_mEnumerable);
+  rb_define_method(rcsv_row_class, "[]", rb_rcsv_row_aref, 1);
+  rb_define_method(rcsv_row_class, "size", rb_rcsv_row_size, 0);
+  rb_define_method(rcsv_row_class, "length", rb_rcsv_row_size, 0);
+  rb_define_method(rcsv_row_class, "to_a", rb_rcsv_row_to_a, 0);
+  rb_define_method(rcsv_row_class, "to_h", rb_rcsv_row_to_h, 0);
+  rb_define_method(rcsv_row_class, "each", rb_rcsv_row_each, 0);
+  rb_define_method(rcsv_row_class, "inspect", rb_rcsv_row_inspect, 0);
 }
@@ -21,63 +21,121 @@ class Rcsv
           #:alias => :a, # only for hashes
           #:type => :int,
           #:default => 100,
-          #:match => '10'
+          #:match => '10',
+          #:intern => true # or :symbol
         #},
         #...
       #}
     #}
 
+    if defined?(Pathname) && csv_data.is_a?(Pathname)
+      return File.open(csv_data) { |file| self.parse(file, options, &block) }
+    end
+
+    csv_data = self.csv_source(csv_data)
+    raw_options = self.raw_options(options)
+
+    if csv_data.respond_to?(:external_encoding)
+      raw_options[:output_encoding] = csv_data.external_encoding.to_s
+    end
+
+    options[:index].seek(csv_data, options, raw_options) if options[:index]
+
+    return self.raw_parse(csv_data, raw_options, &block)
+  end
+
+  # Scans csv_data from its current position and returns an Rcsv::Index of the byte offsets of every
+  # :every-th record, which Rcsv.parse takes as :index to start at :offset_rows without parsing the rows before
+  def self.build_index(csv_data, options = {})
+    if defined?(Pathname) && csv_data.is_a?(Pathname)
+      return File.open(csv_data) { |file| self.build_index(file, options) }
+    end
+
+    csv_data = self.csv_source(csv_data)
+    raw_options = {
+      :col_sep => options[:column_separator] && options[:column_separator][0] || ',',
+      :quote_char => options[:quote_char] && options[:quote_char][0] || '"',
+      :nostrict => options[:nostrict],
+      :buffer_size => options[:buffer_size] || 1024 * 1024, # 1 MiB
+      :every => options[:every] || Index::DEFAULT_EVERY,
+      :position => csv_data.respond_to?(:pos) ? csv_data.pos : 0
+    }
+
+    offsets, rows, size, header_end = self.raw_index(csv_data, raw_options)
+    Index.new(offsets, raw_options[:every], rows, size, header_end, raw_options[:col_sep], raw_options[:quote_char])
+  end
+
+  # Wraps String input into StringIO, other input has to respond to #read
+  def self.csv_source(csv_data)
+    if csv_data.is_a?(String)
+      StringIO.new(csv_data)
+    elsif !csv_data.respond_to?(:read)
+      inspected_csv_data = csv_data.inspect
+      raise ParseError.new("Supplied CSV object #{inspected_csv_data[0..127]}#{inspected_csv_data.size > 128 ? '...' : ''} is neither String nor looks like IO object.")
+    else
+      csv_data
+    end
+  end
+  private_class_method :csv_source
+
+  # Turns parse options into raw_parse options, except for :output_encoding
+  def self.raw_options(options)
     options[:header] ||= :use
     raw_options = {}
 
     raw_options[:col_sep] = options[:column_separator] && options[:column_separator][0] || ','
     raw_options[:quote_char] = options[:quote_char] && options[:quote_char][0] || '"'
     raw_options[:offset_rows] = options[:offset_rows] || 0
+    raw_options[:limit_rows] = options[:limit_rows]
     raw_options[:nostrict] = options[:nostrict]
     raw_options[:parse_empty_fields_as] = options[:parse_empty_fields_as]
     raw_options[:buffer_size] = options[:buffer_size] || 1024 * 1024 # 1 MiB
+    raw_options[:pool] = options[:pool]
+    raw_options[:threads] = options[:threads]
+    raw_options[:release_gvl] = options[:release_gvl]
+    raw_options[:compression] = options[:compression]
+    raw_options[:batch_size] = options[:batch_size]
 
-    if csv_data.is_a?(String)
-      csv_data = StringIO.new(csv_data)
-    elsif !(csv_data.respond_to?(:each_line) && csv_data.respond_to?(:read))
-      inspected_csv_data = csv_data.inspect
-      raise ParseError.new("Supplied CSV object #{inspected_csv_data[0..127]}#{inspected_csv_data.size > 128 ? '...' : ''} is neither String nor looks like IO object.")
-    end
-
-    if csv_data.respond_to?(:external_encoding)
-      raw_options[:output_encoding] = csv_data.external_encoding.to_s
-    end
+    raw_options[:row_as_hash] = options[:row_as_hash]
+    raw_options[:result] = options[:result]
+    raw_options[:lazy_rows] = options[:lazy_rows]
 
-    initial_position = csv_data.pos
+    # The header is the first row of the input, it is passed to :configure by the C parser within the same pass
+    raw_options[:offset_rows] += 1 unless options[:header] == :none
 
-    case options[:header]
-    when :use
-      header = self.raw_parse(StringIO.new(csv_data.each_line.first), raw_options).first
-      raw_options[:offset_rows] += 1
-    when :skip
-      header = (0..(csv_data.each_line.first.split(raw_options[:col_sep]).count)).to_a
-      raw_options[:offset_rows] += 1
-    when :none
-      header = (0..(csv_data.each_line.first.split(raw_options[:col_sep]).count)).to_a
+    if options[:columns] || options[:row_as_hash] || options[:result] == :columns || options[:lazy_rows] || options[:row_as]
+      raw_options[:configure] = lambda { |first_row|
+        header = options[:header] == :use ? first_row : (0..first_row.size).to_a
+        column_options(header, options)
+      }
     end
 
-    raw_options[:row_as_hash] = options[:row_as_hash] # Setting after header parsing
+    return raw_options
+  end
+  private_class_method :raw_options
+
+  # Turns :columns options into raw_parse options, column positions are taken from the header
+  def self.column_options(header, options)
+    raw_options = {}
+    keyed = options[:row_as_hash] || options[:result] == :columns || options[:lazy_rows] || options[:row_as]
 
     if options[:columns]
       only_rows = []
       except_rows = []
       row_defaults = []
+      intern = []
       column_names = []
       row_conversions = ''
 
       header.each do |column_header|
         column_options = options[:columns][column_header]
         if column_options
-          if (options[:row_as_hash])
+          if keyed
             column_names << (column_options[:alias] || column_header)
           end
 
           row_defaults << column_options[:default] || nil
+          intern << column_options[:intern]
 
           only_rows << case column_options[:match]
           when Array
@@ -114,27 +172,222 @@ class Rcsv
         elsif options[:only_listed_columns]
           column_names << nil
           row_defaults << nil
+          intern << nil
           only_rows << nil
           except_rows << nil
           row_conversions << ' '
         else
           column_names << column_header
           row_defaults << nil
+          intern << nil
           only_rows << nil
           except_rows << nil
           row_conversions << 's'
         end
       end
 
-      raw_options[:column_names] = column_names if options[:row_as_hash]
+      raw_options[:column_names] = column_names if keyed
       raw_options[:only_rows] = only_rows unless only_rows.compact.empty?
       raw_options[:except_rows] = except_rows unless except_rows.compact.empty?
       raw_options[:row_defaults] = row_defaults unless row_defaults.compact.empty?
+      raw_options[:intern] = intern unless intern.compact.empty?
       raw_options[:row_conversions] = row_conversions
+    elsif keyed
+      raw_options[:column_names] = header
     end
 
-    csv_data.pos = initial_position
-    return self.raw_parse(csv_data, raw_options, &block)
+    if options[:row_as]
+      raw_options[:row_class] = row_class(options[:row_as], raw_options[:column_names], raw_options[:row_conversions])
+    end
+
+    return raw_options
+  end
+  private_class_method :column_options
+
+  # Generates the class of :row_as rows, members are named after columns that aren't skipped
+  def self.row_class(row_as, column_names, row_conversions)
+    members = column_names.each_with_index.map { |name, i|
+      name.to_s.to_sym unless row_conversions && row_conversions[i] == ' '
+    }.compact
+
+    if row_as == Struct
+      Struct.new(*members)
+    elsif defined?(Data) && row_as == Data
+      Data.define(*members)
+    else
+      row_as
+    end
+  end
+  private_class_method :row_class
+
+  # Parses many files with the same options, reading and tokenizing them on :threads native threads (4 by default)
+  # while rows of finished files are built. Yields every file as it is done, with its rows, or with the
+  # Rcsv::ParseError or SystemCallError that parsing it has raised. Returns a Hash of path => rows or error
+  # in the order of paths if there is no block.
+  def self.parse_files(paths, options = {})
+    paths = paths.map(&:to_s)
+    raw_options = self.raw_options(options)
+    raw_options[:output_encoding] = (options[:output_encoding] || Encoding.default_external).to_s
+    raw_options.delete(:threads)
+
+    results = {}
+    files = Files.new(paths, raw_options, options[:threads])
+    begin
+      while (index = files.next)
+        rows = begin
+          files.parse(index)
+        rescue ParseError, SystemCallError => error
+          error
+        end
+
+        if block_given?
+          yield paths[index], rows
+        else
+          results[paths[index]] = rows
+        end
+      end
+    ensure
+      files.close
+    end
+
+    return block_given? ? nil : paths.each_with_object({}) { |path, ordered| ordered[path] = results[path] }
+  end
+
+  # Validates options once and returns a frozen Rcsv::Plan, whose #parse(csv_string) parses Strings with them
+  def self.compile(options = {})
+    Plan.new(options)
+  end
+
+  # Column options that depend on the header are set up for the header of the first parsed String.
+  # #parse(csv_string) is defined by the C extension.
+  class Plan
+    def initialize(options = {})
+      options = options.dup
+      raw_options = Rcsv.send(:raw_options, options)
+      raw_options[:output_encoding] = options[:output_encoding].to_s if options[:output_encoding]
+
+      setup(raw_options, options[:header] == :use)
+      freeze
+    end
+  end
+
+  # Byte offsets of every #every-th record of an input, including the header, as returned by Rcsv.build_index.
+  # Offsets are taken from the records libcsv finds, so newlines within quoted fields don't throw them off.
+  class Index
+    DEFAULT_EVERY = 10_000
+    MAGIC = "RCSVIDX1".b
+    LAYOUT = "a8Q<4a1a1" # magic, every, rows, size, header end, column separator, quote char
+    LAYOUT_SIZE = 42
+
+    attr_reader :every, :rows, :size, :column_separator, :quote_char
+
+    # Reads an index written by #dump
+    def self.load(data)
+      data = data.b
+      unless data.bytesize >= LAYOUT_SIZE && data.start_with?(MAGIC)
+        raise ParseError.new("Supplied data is not an Rcsv::Index dump.")
+      end
+
+      _, every, rows, size, header_end, column_separator, quote_char = data.unpack(LAYOUT)
+      offsets = data.byteslice(LAYOUT_SIZE..-1)
+      if every == 0 || offsets.bytesize != [(rows + every - 1) / every, 1].max * 8
+        raise ParseError.new("Supplied Rcsv::Index dump is corrupted.")
+      end
+
+      new(offsets, every, rows, size, header_end, column_separator, quote_char)
+    end
+
+    def self._load(data)
+      load(data)
+    end
+
+    def initialize(offsets, every, rows, size, header_end, column_separator, quote_char)
+      @offsets = offsets.b.freeze
+      @every = every
+      @rows = rows
+      @size = size
+      @header_end = header_end
+      @column_separator = column_separator
+      @quote_char = quote_char
+      freeze
+    end
+
+    # Byte offset of a record, rounded down to the closest record an offset has been kept for
+    def offset(record)
+      sample = [record / @every, @offsets.bytesize / 8 - 1].min
+      @offsets.unpack1("Q<", :offset => sample * 8)
+    end
+
+    # Returns the index as a binary String that .load reads back
+    def dump
+      [MAGIC, @every, @rows, @size, @header_end, @column_separator, @quote_char].pack(LAYOUT) << @offsets
+    end
+
+    def _dump(level)
+      dump
+    end
+
+    def inspect
+      "#<#{self.class} rows=#{@rows} every=#{@every} size=#{@size}>"
+    end
+
+    # Positions csv_data at the closest record before the first one to parse and adjusts :offset_rows
+    # to what is left to skip from there. The header is passed to the C parser as :header_data
+    # if column options depend on it.
+    def seek(csv_data, options, raw_options)
+      record = raw_options[:offset_rows]
+      sample = [record / @every, @offsets.bytesize / 8 - 1].min
+      return if sample <= 0
+
+      if (raw_options[:col_sep] != @column_separator) || (raw_options[:quote_char] != @quote_char)
+        raise ParseError.new("Supplied index was built with different :column_separator or :quote_char.")
+      end
+
+      unless csv_data.respond_to?(:seek) && csv_data.respond_to?(:size) && csv_data.size == @size
+        raise ParseError.new("Supplied index was built for a different input.")
+      end
+
+      raw_options[:offset_rows] = record - sample * @every
+
+      if raw_options[:configure] && options[:header] != :none
+        csv_data.seek(offset(0))
+        raw_options[:header_data] = csv_data.read(@header_end - offset(0))
+        raw_options[:offset_rows] += 1
+      end
+
+      csv_data.seek(offset(sample * @every))
+    end
+  end
+
+  # Files of Rcsv.parse_files, which are tokenized by native worker threads while #parse(index) builds the rows
+  # of those #next has returned. #next, #parse(index) and #close are defined by the C extension.
+  class Files
+    def initialize(paths, raw_options, threads = nil)
+      setup(paths, raw_options, threads)
+    end
+  end
+
+  # Rcsv::Parser.new(io, options) parses io with #each, Rcsv::Parser.new(options) parses chunks passed to #feed.
+  # Takes the same options as Rcsv.parse, except for :threads and :result => :columns.
+  # #feed(chunk), #finish and #each are defined by the C extension.
+  class Parser
+    def initialize(csv_data = nil, options = {})
+      csv_data, options = nil, csv_data if csv_data.is_a?(Hash)
+
+      csv_data = Rcsv.send(:csv_source, csv_data) unless csv_data.nil?
+      raw_options = Rcsv.send(:raw_options, options)
+
+      # Fed chunks are in the default external encoding unless :output_encoding is given
+      raw_options[:output_encoding] = if options[:output_encoding]
+        options[:output_encoding].to_s
+      elsif csv_data.respond_to?(:external_encoding)
+        csv_data.external_encoding.to_s
+      else
+        Encoding.default_external.to_s
+      end
+
+      setup(csv_data, raw_options)
+    end
   end
 
   def initialize(write_options = {})
@@ -142,22 +395,9 @@ class Rcsv
     @write_options[:column_separator] ||= ','
     @write_options[:newline_delimiter] ||= $INPUT_RECORD_SEPARATOR
     @write_options[:header] ||= false
-
-    @quote = '"'
-    @escaped_quote = @quote * 2
-    @quotable_chars = Regexp.new('[%s%s%s]' % [
-      Regexp.escape(@write_options[:column_separator]),
-      Regexp.escape(@write_options[:newline_delimiter]),
-      Regexp.escape(@quote)
-    ])
   end
 
-  def write(io, &block)
-    io.write generate_header if @write_options[:header]
-    while row = yield
-      io.write generate_row(row)
-    end
-  end
+  # #write(io) { row } and #generate_row(row) are defined by the C extension
 
   def generate_header
     return @write_options[:columns].map { |c|
@@ -165,20 +405,6 @@ class Rcsv
     }.join(@write_options[:column_separator]) << @write_options[:newline_delimiter]
   end
 
-  def generate_row(row)
-    column_separator = @write_options[:column_separator]
-    csv_row = ''
-    max_index = row.size - 1
-
-    row.each_with_index do |field, index|
-      unquoted_field = process(field, @write_options[:columns] && @write_options[:columns][index])
-      csv_row << (unquoted_field.match(@quotable_chars) ? "\"#{unquoted_field.gsub(@quote, @escaped_quote)}\"" : unquoted_field)
-      csv_row << column_separator unless index == max_index
-    end
-
-    return csv_row << @write_options[:newline_delimiter]
-  end
-
   protected
 
   def process(field, column_options)
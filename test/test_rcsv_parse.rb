@@ -1,5 +1,9 @@
 require 'test/unit'
 require 'rcsv'
+require 'pathname'
+require 'zlib'
+require 'tempfile'
+require 'tmpdir'
 
 class RcsvParseTest < Test::Unit::TestCase
   def setup
@@ -85,6 +89,349 @@ class RcsvParseTest < Test::Unit::TestCase
     assert_equal([["b", 2, false, 10000000000], ["c", 3, false, 99999999999999]], parsed_data)
   end
 
+  def test_rcsv_parse_only_rows_ranges_and_regexps
+    csv = "GBP-1,10\nUSD-2,25\nGBP-3,40\nEUR-4,15"
+    parsed_data = Rcsv.parse(csv,
+      :header => :none,
+      :columns => {
+        0 => { :match => /\AGBP/ },
+        1 => { :type => :int, :not_match => (30..) }
+      }
+    )
+
+    assert_equal([["GBP-1", 10]], parsed_data)
+  end
+
+  def test_rcsv_parse_intern
+    csv = "currency,status\nGBP,ok\nUSD,failed\nGBP,ok"
+    parsed_data = Rcsv.parse(csv,
+      :columns => {
+        'currency' => { :intern => true },
+        'status' => { :intern => :symbol }
+      }
+    )
+
+    assert_equal([["GBP", :ok], ["USD", :failed], ["GBP", :ok]], parsed_data)
+    assert_same(parsed_data[0][0], parsed_data[2][0])
+  end
+
+  def test_rcsv_parse_row_as
+    csv = "a,b,c\n1,x,t\n2,y"
+
+    struct_rows = Rcsv.parse(csv, :row_as => Struct, :columns => { 'a' => { :type => :int, :alias => :id } })
+    assert_equal([:id, :b, :c], struct_rows.first.members)
+    assert_equal([[1, 'x', 't'], [2, 'y', nil]], struct_rows.map(&:to_a))
+
+    if defined?(Data)
+      data_rows = Rcsv.parse(csv, :row_as => Data, :only_listed_columns => true, :columns => { 'c' => { :type => :bool } })
+      assert_equal([{ :c => true }, { :c => nil }], data_rows.map(&:to_h))
+      assert_same(data_rows[0].class, data_rows[1].class)
+    end
+  end
+
+  def test_rcsv_parse_columns
+    csv = "a,b,c\n1,x,t\n2,y,f\n3,z,t"
+
+    assert_equal({'a' => ['1', '2', '3'], 'b' => ['x', 'y', 'z'], 'c' => ['t', 'f', 't']}, Rcsv.parse(csv, :result => :columns))
+
+    parsed_data = Rcsv.parse(csv,
+      :result => :columns,
+      :only_listed_columns => true,
+      :columns => {
+        'a' => { :type => :int, :alias => :id },
+        'c' => { :type => :bool, :match => true }
+      }
+    )
+
+    assert_equal({:id => [1, 3], 'c' => [true, true]}, parsed_data)
+  end
+
+  def test_rcsv_parse_lazy_rows
+    csv = "a,b,c\n1,x,t\n2,y,f\n3,z,t"
+
+    parsed_data = Rcsv.parse(csv,
+      :lazy_rows => true,
+      :only_listed_columns => true,
+      :columns => {
+        'a' => { :type => :int, :alias => :id },
+        'c' => { :type => :bool, :match => true }
+      }
+    )
+
+    assert_equal(2, parsed_data.size)
+    assert_equal(3, parsed_data[1][:id])
+    assert_equal(true, parsed_data[1]['c'])
+    assert_equal([{:id => 1, 'c' => true}, {:id => 3, 'c' => true}], parsed_data.map(&:to_h))
+    assert_equal([['1', 'x', 't'], ['2', 'y', 'f'], ['3', 'z', 't']], Rcsv.parse(csv, :lazy_rows => true).map(&:to_a))
+  end
+
+  def test_rcsv_parse_row_as_hash_without_columns
+    csv = "a,b\n1,x\n2,y"
+    expected = [{'a' => '1', 'b' => 'x'}, {'a' => '2', 'b' => 'y'}]
+
+    assert_equal(expected, Rcsv.parse(csv, :row_as_hash => true))
+    assert_equal(expected, Rcsv.parse(csv, :row_as_hash => true, :lazy_rows => true).map(&:to_h))
+
+    expected = [{0 => 'a', 1 => 'b'}, {0 => '1', 1 => 'x'}, {0 => '2', 1 => 'y'}]
+
+    assert_equal(expected, Rcsv.parse(csv, :row_as_hash => true, :header => :none))
+    assert_equal(expected, Rcsv.parse(csv, :row_as_hash => true, :lazy_rows => true, :header => :none).map(&:to_h))
+  end
+
+  def test_rcsv_parse_batch_size
+    csv = "a,b\n1,x\n2,y\n3,z\n4,x\n5,y\n"
+    options = { :batch_size => 2, :columns => { 'a' => { :type => :int }, 'b' => { :not_match => 'z' } } }
+    batches = []
+
+    assert_nil(Rcsv.parse(csv, options) { |rows| batches << rows })
+    assert_equal([[[1, 'x'], [2, 'y']], [[4, 'x'], [5, 'y']]], batches)
+
+    batches.clear
+    Rcsv.parse(csv, :batch_size => 3, :header => :none) { |rows| batches << rows }
+    assert_equal([3, 3], batches.map(&:size))
+    assert_equal([[1, 'x'], [2, 'y'], [4, 'x'], [5, 'y']], Rcsv.parse(csv, options))
+
+    batches.clear
+    parser = Rcsv::Parser.new(:batch_size => 4)
+    csv.each_char { |chunk| parser.feed(chunk) { |rows| batches << rows } }
+    parser.finish { |rows| batches << rows }
+    assert_equal([[['1', 'x'], ['2', 'y'], ['3', 'z'], ['4', 'x']], [['5', 'y']]], batches)
+
+    assert_raise(Rcsv::ParseError) { Rcsv.parse(csv, :batch_size => 0) {} }
+  end
+
+  def test_rcsv_parse_pathname
+    path = Pathname.new('test/test_rcsv.csv')
+    expected = Rcsv.parse(File.read(path))
+
+    assert_equal(expected, Rcsv.parse(path))
+    assert_equal(expected, File.open(path) { |file| Rcsv.parse(file) })
+  end
+
+  def test_rcsv_parse_limit_rows_with_threads
+    csv = "h\n" + "1\n" * 1000 + "\"x\"y\n" # Malformed past :limit_rows
+    options = { :threads => 2, :buffer_size => 64, :limit_rows => 10 }
+
+    assert_equal([['1']] * 10, Rcsv.parse(csv, options))
+    assert_equal([['1']] * 10, Rcsv.parse(StringIO.new(csv), options))
+
+    Tempfile.create(['rcsv', '.csv']) do |file|
+      file.write(csv)
+      file.flush
+
+      assert_equal([['1']] * 10, File.open(file.path) { |io| Rcsv.parse(io, options) })
+    end
+
+    assert_raise(Rcsv::ParseError) { Rcsv.parse(csv, options.merge(:limit_rows => 1001)) }
+  end
+
+  def test_rcsv_parse_non_seekable_input
+    csv = "\"id\",\"name, full\"\n1,Mary\n2,\"Jane, Doe\"\n"
+    options = { :columns => { 'id' => { :type => :int }, 'name, full' => { :alias => :name } }, :row_as_hash => true }
+    expected = [{ 'id' => 1, :name => 'Mary' }, { 'id' => 2, :name => 'Jane, Doe' }]
+
+    IO.pipe do |reader, writer|
+      writer.write(csv)
+      writer.close
+      assert_equal(expected, Rcsv.parse(reader, options.merge(:buffer_size => 4)))
+    end
+
+    io = StringIO.new(csv)
+    def io.pos; raise Errno::ESPIPE; end
+    def io.each_line; raise Errno::ESPIPE; end
+    assert_equal(expected, Rcsv.parse(io, options))
+  end
+
+  def test_rcsv_parse_header_with_quoted_separators
+    csv = "\"a,b\",c\n1,2\n"
+
+    assert_equal([['1', 2]], Rcsv.parse(csv, :header => :skip, :columns => { 1 => { :type => :int } }))
+    assert_equal({ 0 => ['a,b', '1'], 1 => ['c', '2'] }, Rcsv.parse(csv, :header => :none, :result => :columns))
+    assert_equal([['2']], Rcsv.parse(csv, :header => :use, :offset_rows => 0, :only_listed_columns => true, :columns => { 'c' => {} }))
+    assert_equal([], Rcsv.parse("a,b", :columns => { 'a' => { :type => :int } }))
+    assert_equal([], Rcsv.parse("", :columns => { 'a' => { :type => :int } }))
+  end
+
+  def test_rcsv_parse_compressed_input
+    csv = "id,name\n" + (1..5000).map { |i| "#{i},\"name, #{i}\"\n" }.join
+    options = { :columns => { 'id' => { :type => :int } } }
+    expected = Rcsv.parse(csv, options)
+    gzipped = Zlib.gzip(csv[0, 1000]) + Zlib.gzip(csv[1000..-1]) # Concatenated gzip members
+
+    assert_equal(expected, Rcsv.parse(gzipped, options))
+    assert_equal([['1', '2']], Rcsv.parse(Zlib::Deflate.deflate("a,b\n1,2\n"), :compression => :gzip))
+
+    Tempfile.create(['rcsv', '.csv.gz']) do |file|
+      file.binmode
+      file.write(gzipped)
+      file.flush
+
+      assert_equal(expected, Rcsv.parse(Pathname.new(file.path), options))
+      assert_equal(expected, File.open(file.path) { |io| Rcsv.parse(io, options.merge(:buffer_size => 100)) })
+    end
+
+    IO.pipe do |reader, writer|
+      thread = Thread.new { writer.write(gzipped); writer.close }
+      assert_equal(expected, Rcsv.parse(reader, options.merge(:buffer_size => 3)))
+      thread.join
+    end
+
+    error = assert_raise(Rcsv::ParseError) { Rcsv.parse(gzipped[0..-10]) }
+    assert_equal('Compressed input is truncated.', error.message)
+    error = assert_raise(Rcsv::ParseError) { Rcsv.parse(gzipped + 'garbage') }
+    assert_equal('Compressed input is corrupt.', error.message)
+    assert_raise(Rcsv::ParseError) { Rcsv.parse(gzipped, :compression => :none) }
+    assert_raise(Rcsv::ParseError) { Rcsv.parse(csv, :compression => :lzma) }
+  end
+
+  def test_rcsv_parse_zstd_input
+    zstd = "(\xB5/\xFD\x04XA\x00\x00a,b\n1,2\n5\xE7\xCA\xCE".b
+
+    begin
+      assert_equal([['1', '2']], Rcsv.parse(zstd))
+    rescue Rcsv::ParseError => e
+      assert_equal('zstd input can\'t be decompressed, rcsv was built without libzstd.', e.message)
+    end
+  end
+
+  def test_rcsv_parser_feed
+    csv = "id,name\n1,\"Mary, Jane\"\n2,Alien\n3,Moon"
+    options = { :row_as_hash => true, :columns => { 'id' => { :type => :int, :not_match => 2 }, 'name' => { :alias => :name } } }
+    expected = [{ 'id' => 1, :name => 'Mary, Jane' }, { 'id' => 3, :name => 'Moon' }]
+
+    parser = Rcsv::Parser.new(options)
+    rows = []
+    csv.each_char.each_slice(3) { |chunk| rows.concat(parser.feed(chunk.join)) }
+    rows.concat(parser.finish)
+    assert_equal(expected, rows)
+
+    parser = Rcsv::Parser.new(options)
+    rows = []
+    csv.each_char { |chunk| assert_nil(parser.feed(chunk) { |row| rows << row }) }
+    parser.finish { |row| rows << row }
+    assert_equal(expected, rows)
+
+    parser = Rcsv::Parser.new(:header => :none, :lazy_rows => true)
+    assert_equal([], parser.feed(Zlib.gzip(csv)[0, 10]))
+    assert_equal([['id', 'name'], ['1', 'Mary, Jane'], ['2', 'Alien']], parser.feed(Zlib.gzip(csv)[10..-1]).map(&:to_a))
+    assert_equal([['3', 'Moon']], parser.finish.map(&:to_a))
+
+    error = assert_raise(Rcsv::ParseError) { parser.feed("4,Sun\n") }
+    assert_equal('Rcsv::Parser has already finished.', error.message)
+
+    parser = Rcsv::Parser.new(:header => :none)
+    assert_raise(Rcsv::ParseError) { parser.feed("a,\"b\"c\n") }
+    error = assert_raise(Rcsv::ParseError) { parser.finish }
+    assert_equal('Rcsv::Parser is already parsing, or its parse was interrupted.', error.message)
+    assert_raise(Rcsv::ParseError) { Rcsv::Parser.new(:result => :columns) }
+  end
+
+  def test_rcsv_parser_each
+    csv = "a,b\n1,2\n3,4\n"
+
+    assert_equal([['1', '2'], ['3', '4']], Rcsv::Parser.new(StringIO.new(csv)).to_a)
+    assert_equal([['1', '2'], ['3', '4']], Rcsv::Parser.new(csv, :buffer_size => 3).each.to_a)
+
+    IO.pipe do |reader, writer|
+      writer.write("a,b\n1,2\n")
+      rows = Rcsv::Parser.new(reader, :header => :none).each
+      assert_equal(['a', 'b'], rows.next)
+      assert_equal(['1', '2'], rows.next)
+      writer.write("3,4")
+      writer.close
+      assert_equal(['3', '4'], rows.next)
+      assert_raise(StopIteration) { rows.next }
+    end
+
+    error = assert_raise(Rcsv::ParseError) { Rcsv::Parser.new.each {} }
+    assert_equal('Rcsv::Parser has no source to read from, its rows are returned by #feed and #finish.', error.message)
+  end
+
+  def test_rcsv_compile
+    options = { :row_as_hash => true, :columns => { 'id' => { :type => :int, :match => 1..2 }, 'name' => { :alias => :name } } }
+    plan = Rcsv.compile(options)
+    csv = "id,name\n1,Mary\n2,Jane\n3,Alien\n"
+
+    assert(plan.frozen?)
+    assert_equal(Rcsv.parse(csv, options.dup), plan.parse(csv))
+    assert_equal([{ 'id' => 1, :name => 'Mary' }, { 'id' => 2, :name => 'Jane' }], plan.parse(csv))
+
+    # Headers that differ from the first one are set up for their own parse
+    assert_equal([{ :name => 'Jane', 'id' => 2 }], plan.parse("name,id\nJane,2\nMoon,4"))
+    assert_equal([{ 'id' => 1, :name => 'Mary' }], plan.parse("id,name\n1,Mary\n".b))
+
+    rows = []
+    assert_nil(plan.parse(csv) { |row| rows << row })
+    assert_equal([{ 'id' => 1, :name => 'Mary' }, { 'id' => 2, :name => 'Jane' }], rows)
+
+    assert_equal({ 'a' => [1, 3], 'b' => ['2', '4'] }, Rcsv.compile(:result => :columns, :columns => { 'a' => { :type => :int } }).parse("a,b\n1,2\n3,4"))
+    assert_equal([['1', '2']], Rcsv.compile(:header => :none, :compression => :gzip).parse(Zlib.gzip("1,2")))
+    assert_raise(TypeError) { plan.parse(StringIO.new(csv)) }
+    assert_raise(Rcsv::ParseError) { Rcsv.compile(:parse_empty_fields_as => :zero) }
+  end
+
+  def test_rcsv_parse_index
+    csv = "id,note\n" + (1..20).map { |i| "#{i},\"line #{i}\nnext, \"\"quoted\"\"\"" }.join("\r\n") + "\r\n"
+    index = Rcsv.build_index(csv, :every => 3)
+
+    assert_equal(21, index.rows)
+    assert_equal(csv.bytesize, index.size)
+    # libcsv ends records at the \r of \r\n, the \n is skipped as an empty line
+    assert_equal(csv.index("\r\n12,") + 1, index.offset(13))
+
+    options = { :columns => { 'id' => { :type => :int } }, :row_as_hash => true }
+    rows = Rcsv.parse(csv, options.dup)
+    assert_equal(rows[13, 4], Rcsv.parse(csv, options.merge(:index => index, :offset_rows => 13, :limit_rows => 4)))
+    assert_equal(rows[19..-1], Rcsv.parse(csv, options.merge(:index => index, :offset_rows => 19)))
+    assert_equal([], Rcsv.parse(csv, :index => index, :offset_rows => 25))
+    assert_equal([['7', "line 7\nnext, \"quoted\""]], Rcsv.parse(csv, :index => index, :offset_rows => 6, :limit_rows => 1))
+
+    loaded = Rcsv::Index.load(index.dump)
+    assert_equal(index.dump, Marshal.load(Marshal.dump(loaded)).dump)
+    assert_equal(rows[5, 2], Rcsv.parse(csv, options.merge(:index => loaded, :offset_rows => 5, :limit_rows => 2)))
+
+    assert_raise(Rcsv::ParseError) { Rcsv.parse(csv + "21,x\n", :index => index, :offset_rows => 10) }
+    assert_raise(Rcsv::ParseError) { Rcsv.parse(csv, :index => index, :offset_rows => 10, :column_separator => ';') }
+    assert_raise(Rcsv::ParseError) { Rcsv::Index.load('not an index') }
+    assert_raise(Rcsv::ParseError) { Rcsv.build_index(Zlib.gzip(csv)) }
+  end
+
+  def test_rcsv_parse_files
+    Dir.mktmpdir do |dir|
+      csv = "id,note\n1,\"a\nb\"\n2,c\n3,d"
+      paths = (1..5).map { |i| File.join(dir, "#{i}.csv") }
+      paths.each { |path| File.write(path, csv) }
+      File.binwrite(paths[1], Zlib.gzip(csv))
+      File.write(paths[3], "id,note\n1,\"x\"y\n")
+      paths << File.join(dir, 'missing.csv')
+
+      options = { :columns => { 'id' => { :type => :int, :not_match => 2 } }, :row_as_hash => true }
+      expected = Rcsv.parse(csv, options.dup)
+      results = Rcsv.parse_files(paths, options.merge(:threads => 2))
+
+      assert_equal(paths, results.keys)
+      assert_equal([expected] * 3, results.values_at(paths[0], paths[1], paths[2]))
+      assert_instance_of(Rcsv::ParseError, results[paths[3]])
+      assert_kind_of(SystemCallError, results[paths[5]])
+
+      yielded = {}
+      assert_nil(Rcsv.parse_files(paths.first(3), :threads => 4) { |path, rows| yielded[path] = rows })
+      assert_equal(paths.first(3).sort, yielded.keys.sort)
+      assert_equal([['1', "a\nb"], ['2', 'c'], ['3', 'd']], yielded[paths[0]])
+
+      # Rows past :limit_rows aren't tokenized, so a malformed tail doesn't fail the file
+      malformed = File.join(dir, 'malformed.csv')
+      File.write(malformed, "h\n1\n2\n\"x\"y\n")
+      assert_equal({malformed => [['1']]}, Rcsv.parse_files([malformed], :limit_rows => 1))
+      assert_equal({malformed => [['2']]}, Rcsv.parse_files([malformed], :offset_rows => 1, :limit_rows => 1))
+      assert_instance_of(Rcsv::ParseError, Rcsv.parse_files([malformed], :limit_rows => 3)[malformed])
+
+      assert_equal({}, Rcsv.parse_files([]))
+      assert_raise(Rcsv::ParseError) { Rcsv.parse_files(paths, :threads => 0) }
+      assert_raise(ArgumentError) { Rcsv.parse_files(["#{dir}/a\0b.csv"]) }
+    end
+  end
+
   if String.instance_methods.include?(:encoding)
     def test_rcsv_parse_encoding
       utf8_csv = "a,b,c".force_encoding("UTF-8")
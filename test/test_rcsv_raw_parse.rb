@@ -78,6 +78,115 @@ class RcsvRawParseTest < Test::Unit::TestCase
     assert_equal('Dallas, TX', raw_parsed_csv_data[888][13])
   end
 
+  def test_buffer_size_does_not_affect_result
+    expected = Rcsv.raw_parse(StringIO.new(@csv_data.read))
+
+    [1, 2, 3, 7, 64, 4096].each do |buffer_size|
+      @csv_data.rewind
+      assert_equal(expected, Rcsv.raw_parse(@csv_data, :buffer_size => buffer_size))
+    end
+  end
+
+  def test_read_loop_reuses_buffer
+    data = @csv_data.read
+    allocations = [10, 100_000].map do |buffer_size|
+      GC.disable
+      before = GC.stat(:total_allocated_objects)
+      Rcsv.raw_parse(StringIO.new(data), :buffer_size => buffer_size, :row_conversions => ' ' * 20)
+      GC.stat(:total_allocated_objects) - before
+    end
+    GC.enable
+
+    # Thousands of 10 byte reads shouldn't allocate more than a single large read
+    assert_operator(allocations[0] - allocations[1], :<, 100)
+  end
+
+  def test_embedded_nul_bytes
+    assert_equal([["a\0b", "c"], ["d", "\0"]], Rcsv.raw_parse(StringIO.new("a\0b,c\nd,\0\n"), :buffer_size => 2))
+  end
+
+  if defined?(IO::Buffer)
+    def test_io_buffer
+      data = @csv_data.read
+      buffer = IO::Buffer.for(data)
+
+      assert_equal(Rcsv.raw_parse(StringIO.new(data)), Rcsv.raw_parse(buffer))
+      assert(!buffer.locked?)
+    end
+  end
+
+  def test_pool
+    pool = Rcsv::Pool.new
+    wide_csv = StringIO.new("a,#{'x' * 100_000},c\n")
+
+    # A small buffer makes the wide field span many reads, so it has to be accumulated in the entry buffer
+    first = Rcsv.raw_parse(wide_csv, :pool => pool, :buffer_size => 1000)
+    wide_csv.rewind
+    second = Rcsv.raw_parse(wide_csv, :pool => pool, :buffer_size => 1000)
+
+    assert_equal([['a', 'x' * 100_000, 'c']], first)
+    assert_equal(first, second)
+
+    stats = pool.stats
+    assert_equal(2, stats[:parses])
+    assert_equal(1, stats[:reuses])
+    assert(stats[:allocations] < 20) # geometric growth
+    assert(stats[:peak_buffer_size] >= 100_000)
+    assert_equal(stats[:peak_buffer_size], stats[:cached_buffer_size])
+  end
+
+  def test_invalid_pool
+    assert_raise(Rcsv::ParseError) do
+      Rcsv.raw_parse(@csv_data, :pool => 'pool')
+    end
+  end
+
+  def test_file_is_parsed_from_current_position
+    @csv_data.gets
+    expected = Rcsv.raw_parse(StringIO.new(File.read(@csv_data.path).lines[1..-1].join))
+
+    assert_equal(expected, Rcsv.raw_parse(@csv_data))
+    assert(@csv_data.eof?)
+  end
+
+  def test_threads
+    data = @csv_data.read
+    expected = Rcsv.raw_parse(StringIO.new(data))
+
+    [64, 100, 4096].each do |buffer_size|
+      @csv_data.rewind
+      assert_equal(expected, Rcsv.raw_parse(@csv_data, :threads => 4, :buffer_size => buffer_size))
+    end
+
+    broken_data = StringIO.new(data.sub(/"/, ''))
+    assert_raise(Rcsv::ParseError) do
+      Rcsv.raw_parse(broken_data, :threads => 4, :buffer_size => 64)
+    end
+  end
+
+  def test_many_rows
+    rows = (1..5000).map { |i| [i.to_s, "row #{i}", i.even? ? nil : "\"#{i}\""] }
+    csv = rows.map { |row| row.map { |field| field && field.include?('"') ? "\"#{field.gsub('"', '""')}\"" : field }.join(',') }.join("\n")
+
+    assert_equal(rows, Rcsv.raw_parse(StringIO.new(csv)))
+    assert_equal(rows, Rcsv.raw_parse(StringIO.new(csv), :buffer_size => 1000))
+  end
+
+  def test_release_gvl
+    data = @csv_data.read
+    expected = Rcsv.raw_parse(StringIO.new(data))
+
+    [7, 64, 4096, nil].each do |buffer_size|
+      assert_equal(expected, Rcsv.raw_parse(StringIO.new(data), :release_gvl => true, :buffer_size => buffer_size))
+    end
+    @csv_data.rewind
+    assert_equal(expected, Rcsv.raw_parse(@csv_data, :release_gvl => true, :buffer_size => 100))
+
+    assert_raise(Rcsv::ParseError) do
+      Rcsv.raw_parse(StringIO.new(data.sub(/"/, '')), :release_gvl => true, :buffer_size => 64)
+    end
+  end
+
   def test_single_item_csv
     raw_parsed_csv_data = Rcsv.raw_parse(StringIO.new("Foo"))
 
@@ -124,7 +233,8 @@ class RcsvRawParseTest < Test::Unit::TestCase
   end
 
   def test_only_rows_with_nil_beginning
-    raw_parsed_csv_data = Rcsv.raw_parse(@csv_data, :only_rows => [nil, nil, nil, [123, 96], nil], :row_conversions => 'sssi')
+    raw_parsed_csv_data = Rcsv.raw_parse(@csv_data, :only_rows => [nil, nil, nil, [123, 96], nil], :row_conversions => 'sssi',
+                                                    :offset_rows => 1) # skipping string headers
 
     assert_equal('C3B87A6B', raw_parsed_csv_data[1][0])
     assert_equal(nil, raw_parsed_csv_data[0][2])
@@ -132,6 +242,53 @@ class RcsvRawParseTest < Test::Unit::TestCase
     assert_equal(5, raw_parsed_csv_data.size)
   end
 
+  def test_only_rows_with_ranges_and_regexps
+    csv = "ab,1,1.5\nba,-2,0.5\nabc,7,2\nb,3, 1e1\nc,,9007199254740993\n"
+
+    [1, 5, 64, 100000].each do |buffer_size|
+      assert_equal([['ab', 1, 1.5], ['b', 3, 10.0]],
+                   Rcsv.raw_parse(StringIO.new(csv), :row_conversions => 'sif', :buffer_size => buffer_size,
+                                                     :only_rows => [[/\Aa/, 'b'], [(0..3), 9], [(1...2), 10]]))
+      assert_equal([['ba', -2, 0.5], ['c', nil, 9007199254740993.0]],
+                   Rcsv.raw_parse(StringIO.new(csv), :row_conversions => 'sif', :buffer_size => buffer_size,
+                                                     :except_rows => [[/b\z/], [(..-3), 3.0, 7]]))
+    end
+  end
+
+  def test_rejected_rows_are_not_converted
+    csv = "1,x\nzzz,y\n2,x\n"
+
+    # Rows rejected by raw bytes are skipped as a whole, other filters need the row converted up to the filtered column
+    assert_equal([[1, 'x'], [2, 'x']], Rcsv.raw_parse(StringIO.new(csv), :row_conversions => 'is', :only_rows => [nil, ['x']]))
+    assert_raise(Rcsv::ParseError) do
+      Rcsv.raw_parse(StringIO.new(csv), :row_conversions => 'is', :only_rows => [nil, [/x/]])
+    end
+  end
+
+  def test_invalid_filter_values
+    assert_raise(Rcsv::ParseError) do
+      Rcsv.raw_parse(StringIO.new("a\n"), :only_rows => [[:a]])
+    end
+  end
+
+  def test_intern
+    csv = "GBP,a,1\nUSD,b,2\nGBP,a,3\n" + (0...5000).map { |i| "x#{i},c,#{i}\n" }.join
+    raw_parsed_csv_data = Rcsv.raw_parse(StringIO.new(csv), :intern => [true, :symbol], :buffer_size => 7)
+
+    assert_equal(['GBP', :a, '1'], raw_parsed_csv_data[0])
+    assert_same(raw_parsed_csv_data[0][0], raw_parsed_csv_data[2][0])
+    assert_predicate(raw_parsed_csv_data[0][0], :frozen?)
+    assert_not_predicate(raw_parsed_csv_data[0][2], :frozen?)
+    assert_equal(:c, raw_parsed_csv_data[-1][1])
+
+    # Values beyond the limit are still converted, just not shared
+    assert_equal((0...5000).map { |i| "x#{i}" }, raw_parsed_csv_data[3..-1].map(&:first))
+    assert_not_predicate(raw_parsed_csv_data[-1][0], :frozen?)
+
+    lazy_rows = Rcsv.raw_parse(StringIO.new(csv), :intern => [true], :lazy_rows => true)
+    assert_same(lazy_rows[0][0], lazy_rows[2][0])
+  end
+
   def test_row_defaults
     raw_parsed_csv_data = Rcsv.raw_parse(@csv_data, :row_defaults => [nil, nil, :booya, nil, 'never ever'])
 
@@ -153,6 +310,33 @@ class RcsvRawParseTest < Test::Unit::TestCase
     assert_equal('2015-12-22', raw_parsed_csv_data[3][5])
   end
 
+  def test_numeric_conversions
+    integers = "1,-9223372036854775808,9223372036854775808,-18446744073709551616,\" 42 \"\n"
+    raw_parsed_csv_data = Rcsv.raw_parse(StringIO.new(integers), :row_conversions => 'iiiii')
+
+    assert_equal([[1, -9223372036854775808, 9223372036854775808, -18446744073709551616, 42]], raw_parsed_csv_data)
+
+    floats = "1.5,-0.1,1e300,123456789012345678901234567890e-10,\" 2.5e-3\",-0,9223372036854775808\n"
+    raw_parsed_csv_data = Rcsv.raw_parse(StringIO.new(floats), :row_conversions => 'fffffff')
+
+    assert_equal([[1.5, -0.1, 1e300, 12345678901234567890.1234567890, 0.0025, -0.0, 9.223372036854776e18]], raw_parsed_csv_data)
+  end
+
+  def test_malformed_numbers
+    ['12x', '1.5', '--1', '0x10', '+'].each do |field|
+      error = assert_raise(Rcsv::ParseError) do
+        Rcsv.raw_parse(StringIO.new("a,#{field}\n"), :row_conversions => 'si')
+      end
+      assert_match(/\A\[0:1 '#{Regexp.escape(field)}'\] Bad Integer value/, error.message)
+    end
+
+    ['1.2.3', 'e5', '1e', 'nan', '.'].each do |field|
+      assert_raise(Rcsv::ParseError) do
+        Rcsv.raw_parse(StringIO.new("#{field}\n"), :row_conversions => 'f')
+      end
+    end
+  end
+
   def test_row_conversions_with_column_exclusions
     raw_parsed_csv_data = Rcsv.raw_parse(StringIO.new(@csv_data.each_line.to_a[1..-1].join), # skipping string headers
                                          :row_conversions => 's f issss fsis fb')
@@ -165,6 +349,90 @@ class RcsvRawParseTest < Test::Unit::TestCase
     assert_equal('2020-12-09', raw_parsed_csv_data[4][3])
   end
 
+  def test_skipped_columns_are_not_passed_on
+    csv = "x, \"a,\"\"b\"\"\n\" ,1,y,2,\"skip\"\"ped\",3\n\"\",,2,,4\n"
+    raw_parsed_csv_data = Rcsv.raw_parse(StringIO.new(csv), :row_conversions => '  i i ', :except_rows => [nil, nil, nil, nil, [4]])
+
+    assert_equal([[1, 2, '3']], raw_parsed_csv_data)
+
+    # Column positions stay right across skipped columns and buffer boundaries
+    (1..csv.size).each do |buffer_size|
+      assert_equal([[1, 2, '3'], [2, 4]], Rcsv.raw_parse(StringIO.new(csv), :row_conversions => '  i i ', :buffer_size => buffer_size))
+    end
+
+    assert_raise_with_message(Rcsv::ParseError, /\A\[0:2 'y'\] Bad Integer/) do
+      Rcsv.raw_parse(StringIO.new("a,b,y\n"), :row_conversions => '  i')
+    end
+
+    assert_raise(Rcsv::ParseError) do
+      Rcsv.raw_parse(StringIO.new("a,b\"c,1\n"), :row_conversions => '  i')
+    end
+  end
+
+  def test_columns_result
+    csv = "a,1,x\nb,2\nc,3,z,extra\nd,4,w\n"
+    raw_parsed_csv_data = Rcsv.raw_parse(StringIO.new(csv), :result => :columns, :row_conversions => 'si',
+                                         :except_rows => [nil, [4]], :row_defaults => [nil, nil, 'default'],
+                                         :column_names => ['letter', 'number'])
+
+    assert_equal({
+      'letter' => ['a', 'b', 'c'],
+      'number' => [1, 2, 3],
+      2 => ['x', nil, 'z'],
+      3 => [nil, nil, 'extra']
+    }, raw_parsed_csv_data)
+
+    raw_parsed_csv_data = Rcsv.raw_parse(StringIO.new(csv), :result => :columns, :row_conversions => ' s', :offset_rows => 1)
+    assert_equal({1 => ['2', '3', '4'], 2 => [nil, 'z', 'w'], 3 => [nil, 'extra', nil]}, raw_parsed_csv_data)
+  end
+
+  def test_lazy_rows
+    csv = "a,1,skipped,\"q\"\"\"\nb,,y,\nc,3,z,w\nd,bad,v,\n"
+    rows = Rcsv.raw_parse(StringIO.new(csv), :lazy_rows => true, :row_conversions => 'si s',
+                          :except_rows => [['c']], :row_defaults => [nil, 0],
+                          :column_names => ['letter', 'number', 'skipped', 'quoted'])
+
+    assert_equal(3, rows.size)
+    assert_kind_of(Rcsv::Row, rows[0])
+    assert_equal(3, rows[0].size)
+    assert_equal('a', rows[0][0])
+    assert_equal(1, rows[0]['number'])
+    assert_equal('q"', rows[0][-1])
+    assert_nil(rows[0][3])
+    assert_nil(rows[0]['skipped'])
+    assert_same(rows[0][0], rows[0]['letter']) # Cached after the first access
+    assert_equal(['b', 0, nil], rows[1].to_a)
+    assert_equal({'letter' => 'b', 'number' => 0, 'quoted' => nil}, rows[1].to_h)
+    assert_equal('d', rows[2].first)
+
+    # Conversion errors are raised when the field is accessed
+    assert_equal('d', rows[2][0])
+    assert_raise(Rcsv::ParseError) do
+      rows[2][1]
+    end
+
+    # Rows outlive their backing buffers being filled up
+    csv = (1..10000).map { |i| "#{i},#{'x' * (i % 50)}" }.join("\n")
+    rows = []
+    Rcsv.raw_parse(StringIO.new(csv), :lazy_rows => true, :row_conversions => 'i', :buffer_size => 1000) { |row| rows << row }
+    GC.start
+    assert_equal(Rcsv.raw_parse(StringIO.new(csv), :row_conversions => 'i'), rows.map(&:to_a))
+
+    assert_raise(Rcsv::ParseError) do
+      Rcsv.raw_parse(StringIO.new(csv), :lazy_rows => true, :result => :columns)
+    end
+  end
+
+  def test_invalid_result
+    assert_raise(Rcsv::ParseError) do
+      Rcsv.raw_parse(@csv_data, :result => :hashes)
+    end
+
+    assert_raise(Rcsv::ParseError) do
+      Rcsv.raw_parse(@csv_data, :result => :columns) { |row| row }
+    end
+  end
+
   def test_offset_rows
     raw_parsed_csv_data = Rcsv.raw_parse(@csv_data, :offset_rows => 51)
 
@@ -214,6 +482,22 @@ class RcsvRawParseTest < Test::Unit::TestCase
     }, raw_parsed_csv_data[1])
   end
 
+  def test_row_class
+    row_class = Struct.new(:a, :b, :c)
+    raw_parsed_csv_data = Rcsv.raw_parse(StringIO.new("1,2,3\n4,5\n6,7,8\n"), :row_class => row_class,
+                                         :row_conversions => 'i i', :except_rows => [[6]])
+
+    assert_equal([row_class.new(1, 3), row_class.new(4, nil)], raw_parsed_csv_data)
+
+    assert_raise(Rcsv::ParseError) do
+      Rcsv.raw_parse(StringIO.new("1,2,3\n"), :row_class => Struct.new(:a, :b))
+    end
+
+    assert_raise(Rcsv::ParseError) do
+      Rcsv.raw_parse(StringIO.new("1\n"), :row_class => Struct.new(:a), :row_as_hash => true, :column_names => ['a'])
+    end
+  end
+
   def test_array_block_streaming
     raw_parsed_csv_data = []
 
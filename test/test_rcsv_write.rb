@@ -121,4 +121,141 @@ class RcsvWriteTest < Test::Unit::TestCase
     writer = Rcsv.new(:column_separator => '|')
     assert_equal "1|2|\"before pipe | after pipe\"\n", writer.generate_row([1, 2, 'before pipe | after pipe'])
   end
+
+  def test_generate_row__should_handle_multibyte_column_separators
+    writer = Rcsv.new(:column_separator => '；')
+    assert_equal "，；b\n", writer.generate_row(['，', 'b'])
+    assert_equal "\"a；b\"；\"c\"\"\"\n", writer.generate_row(['a；b', 'c"'])
+
+    writer = Rcsv.new(:column_separator => '；,', :newline_delimiter => "\r\n")
+    assert_equal "\"a,b\"；,\"c\nd\"；,，\r\n", writer.generate_row(['a,b', "c\nd", '，'])
+  end
+
+  def test_generate_row__rejects_incompatible_encodings
+    writer = Rcsv.new
+
+    assert_raise(Encoding::CompatibilityError) { writer.generate_row(['é', 'é'.encode('ISO-8859-1')]) }
+    assert_raise(Encoding::CompatibilityError) { Rcsv.new(:column_separator => '；').generate_row(['a', 'é'.encode('ISO-8859-1')]) }
+    assert_equal(Encoding::ISO_8859_1, writer.generate_row(['a', 'é'.encode('ISO-8859-1'), 1]).encoding)
+    assert_equal("é,\"x,y\"\n", writer.generate_row(['é', 'x,y'.encode('ISO-8859-1')]))
+  end
+
+  def test_write__buffers_rows_into_large_blocks
+    writes = []
+    io = Object.new
+    io.define_singleton_method(:write) { |data| writes << data.dup; data.bytesize }
+    rows = Array.new(20000) { |i| [i, "row \"#{i}\""] }
+
+    Rcsv.new.write(io) { rows.shift }
+
+    assert_operator(writes.size, :<, 20)
+    assert_equal("0,\"row \"\"0\"\"\"\n", writes.first[0, 14])
+    assert_equal(Array.new(20000) { |i| [i.to_s, "row \"#{i}\""] }, Rcsv.parse(writes.join, :header => :none))
+  end
+
+  def test_write__flushes_written_rows_when_block_raises
+    io = StringIO.new
+    rows = [[1, 2], [3, 4]]
+
+    assert_raise(RuntimeError) do
+      Rcsv.new.write(io) { rows.shift or raise 'broken' }
+    end
+    assert_equal("1,2\n3,4\n", io.string)
+  end
+
+  def test_write__drops_row_when_field_raises
+    io = StringIO.new
+    rows = [['x', Date.parse('1970-01-02')], ['é', 'not a date']]
+
+    assert_raise(NoMethodError) do
+      Rcsv.new(:columns => [{}, { :formatter => :strftime, :format => '%Y-%m-%d' }]).write(io) { rows.shift }
+    end
+    assert_equal("x,1970-01-02\n", io.string)
+  end
+
+  def test_write_rows
+    io = StringIO.new
+    writer = Rcsv.new(:header => true, :columns => [{ :name => 'a' }, { :name => 'b', :formatter => :boolean }])
+
+    writer.write_rows(io, [[1, true], ['x,y', nil]])
+    writer.write_rows(io, [[2, false]].each)
+
+    assert_equal("a,b\n1,true\n\"x,y\",\na,b\n2,false\n", io.string)
+  end
+
+  def test_write_rows__columnar_input
+    io = StringIO.new
+
+    Rcsv.new.write_rows(io, { 'a' => [1, 2, 3], 'b' => ['x', 'y'] })
+
+    assert_equal("1,x\n2,y\n3,\n", io.string)
+    assert_equal(Rcsv.parse("a,b\n1,x\n2,y\n3,\n", :result => :columns).values.transpose,
+                 Rcsv.parse(io.string, :header => :none))
+  end
+
+  def test_write_rows__writes_buffered_blocks_at_once
+    writes = []
+    io = Object.new
+    io.define_singleton_method(:write) { |*blocks| writes << blocks.map(&:dup); blocks.sum(&:bytesize) }
+    rows = Array.new(50000) { |i| [i, 'x' * 10] }
+
+    Rcsv.new(:buffer_size => 256 * 1024).write_rows(io, rows)
+
+    assert_operator(writes.size, :>, 1)
+    assert_operator(writes.first.size, :>, 1)
+    writes[0...-1].each { |blocks| assert_operator(blocks.sum(&:bytesize), :>=, 256 * 1024) }
+    assert_equal(rows.map { |row| row.map(&:to_s) }, Rcsv.parse(writes.flatten.join, :header => :none))
+  end
+
+  def test_write_rows__survives_gc_stress
+    rows = [[1, 'x'], [2, 'y,z']]
+    io = StringIO.new
+    writer_io = StringIO.new
+    writer = Rcsv::Writer.new(writer_io, :columns => [{ :name => 'a' }, { :name => 'b' }])
+
+    begin
+      GC.stress = true
+      Rcsv.new(:columns => [{ :name => 'a' }, { :name => 'b' }]).write_rows(io, rows)
+      writer.write_rows(rows).flush
+    ensure
+      GC.stress = false
+    end
+
+    assert_equal("1,x\n2,\"y,z\"\n", io.string)
+    assert_equal(io.string, writer_io.string)
+  end
+
+  def test_writer
+    io = StringIO.new
+    writer = Rcsv::Writer.new(io, :header => true, :column_separator => ';', :columns => [{ :name => 'a' }, { :name => 'b' }])
+
+    assert_same(writer, writer << [1, 'a;b'])
+    assert_equal('', io.string)
+    assert_same(writer, writer.write_rows([[2, 'c'], [3, nil]]).flush)
+    assert_equal("a;b\n1;\"a;b\"\n2;c\n3;\n", io.string)
+    writer << [4, 'd']
+    writer.flush
+    assert_equal("a;b\n1;\"a;b\"\n2;c\n3;\n4;d\n", io.string)
+
+    assert_raise(RuntimeError) { Rcsv::Writer.allocate << [1] }
+  end
+
+  def test_writer__drops_row_when_field_raises
+    columns = [{}, { :formatter => :strftime, :format => '%Y-%m-%d' }]
+    date = Date.parse('1970-01-02')
+    io = StringIO.new
+    writer = Rcsv::Writer.new(io, :columns => columns)
+
+    writer << ['x', date]
+    assert_raise(NoMethodError) { writer << ['é', 'not a date'] }
+    assert_raise(NoMethodError) { writer.write_rows([['y', date], ['z', 'not a date']]) }
+    assert_raise(NoMethodError) { writer.write_rows({ 'a' => ['w', 'v'], 'b' => [date, 'not a date'] }) }
+    writer << ['u', date]
+    writer.flush
+    assert_equal("x,1970-01-02\ny,1970-01-02\nw,1970-01-02\nu,1970-01-02\n", io.string)
+
+    io = StringIO.new
+    assert_raise(NoMethodError) { Rcsv.new(:columns => columns).write_rows(io, [['y', date], ['z', 'not a date']]) }
+    assert_equal("y,1970-01-02\n", io.string)
+  end
 end